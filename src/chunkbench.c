@@ -0,0 +1,131 @@
+/*
+ * chunkbench.c
+ * Benchmark of the adaptive AFC chunk size against fixed chunk sizes
+ *
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more profile.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "chunktuner.h"
+
+/*
+ * Stand-in for an AFC server behind a connection: every write costs a
+ * round-trip latency plus the transfer time at the link's bandwidth, and
+ * writes larger than what the device buffers comfortably get slower. The
+ * time is simulated, with a pseudo-random jitter on the latency from a
+ * fixed seed, so the results are the same on every run and machine.
+ */
+struct standin_link {
+	const char *name;
+	uint32_t latency_us;
+	double bandwidth; /* bytes per second */
+	uint32_t sweet_spot; /* largest write without a slowdown */
+};
+
+static const struct standin_link links[] = {
+	{ "USB 2", 250, 35e6, 1048576 },
+	{ "USB 3", 100, 200e6, 2097152 },
+	{ "Network", 4000, 12e6, 524288 }
+};
+
+#define NUM_LINKS (int)(sizeof(links) / sizeof(links[0]))
+
+static const uint32_t fixed_sizes[] = { 8192, 65536, 262144, 524288, 1048576, 2097152, 4194304 };
+
+#define NUM_FIXED (int)(sizeof(fixed_sizes) / sizeof(fixed_sizes[0]))
+
+/* bytes per run, about the size of an app package */
+#define BENCH_TOTAL (128 << 20)
+
+/* the adaptive size has to reach this share of the best fixed size on every link */
+#define BENCH_TOLERANCE 0.95
+
+static uint32_t jitter_state;
+
+static uint64_t standin_write(const struct standin_link *link, uint32_t len)
+{
+	double bandwidth = link->bandwidth;
+	if (len > link->sweet_spot) {
+		bandwidth = bandwidth * link->sweet_spot / len;
+	}
+	/* latency varies by +-20% */
+	jitter_state = jitter_state * 1103515245 + 12345;
+	double jitter = 0.8 + 0.4 * ((jitter_state >> 16) & 0x7fff) / 32767.0;
+	return (uint64_t)(link->latency_us * jitter) + (uint64_t)(len * 1e6 / bandwidth);
+}
+
+/* throughput in bytes per second; min == max is a fixed chunk size */
+static double run(const struct standin_link *link, uint64_t total, uint32_t initial, uint32_t min, uint32_t max, uint32_t *final_size)
+{
+	struct chunk_tuner ct;
+	uint64_t done = 0;
+	uint64_t elapsed = 0;
+
+	jitter_state = 1;
+	chunk_tuner_init(&ct, initial, min, max);
+	while (done < total) {
+		uint32_t amount = (total - done < ct.size) ? (uint32_t)(total - done) : ct.size;
+		uint64_t t = standin_write(link, amount);
+		chunk_tuner_update(&ct, amount, t);
+		elapsed += t;
+		done += amount;
+	}
+	*final_size = ct.size;
+	return (double)total * 1e6 / elapsed;
+}
+
+int main(int argc, char **argv)
+{
+	/* the tool starts at 1M for package uploads and at 8K for the other loops */
+	static const uint32_t initial_sizes[] = { 1048576, 8192 };
+	int i, j, res = 0;
+
+	printf("%-8s", "");
+	for (j = 0; j < NUM_FIXED; j++) {
+		printf(" %7uK", fixed_sizes[j] / 1024);
+	}
+	printf("  (MB/s)\n");
+	for (i = 0; i < NUM_LINKS; i++) {
+		uint32_t final_size = 0;
+		double best = 0;
+		printf("%-8s", links[i].name);
+		for (j = 0; j < NUM_FIXED; j++) {
+			double rate = run(&links[i], BENCH_TOTAL, fixed_sizes[j], fixed_sizes[j], fixed_sizes[j], &final_size);
+			best = (rate > best) ? rate : best;
+			printf(" %8.1f", rate / 1e6);
+		}
+		printf("\n");
+		for (j = 0; j < 2; j++) {
+			double adaptive = run(&links[i], BENCH_TOTAL, initial_sizes[j], 8192, 4194304, &final_size);
+			printf("  adaptive from %uK: %.1f MB/s, %.1f%% of the best fixed size, settled at %uK\n", initial_sizes[j] / 1024, adaptive / 1e6, adaptive * 100 / best, final_size / 1024);
+			if (adaptive < best * BENCH_TOLERANCE) {
+				fprintf(stderr, "FAIL: adaptive chunk size below %d%% of the best fixed size on %s\n", (int)(BENCH_TOLERANCE * 100), links[i].name);
+				res = 1;
+			}
+		}
+	}
+
+	return res;
+}
@@ -0,0 +1,158 @@
+/*
+ * chunktuner.c
+ * Adaptive AFC transfer chunk size
+ *
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more profile.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <time.h>
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#include "chunktuner.h"
+
+/*
+ * full chunks and bytes per measurement, smallest search step and
+ * throughput drop that restarts the search
+ */
+#define CHUNK_TUNER_WINDOW 2
+#define CHUNK_TUNER_WINDOW_BYTES 65536
+#define CHUNK_TUNER_MIN_STEP 16384
+#define CHUNK_TUNER_BACKOFF 0.75
+
+static uint64_t chunk_tuner_now_us(void)
+{
+#ifdef WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)((count.QuadPart * 1000000) / freq.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+#endif
+}
+
+static void chunk_tuner_search(struct chunk_tuner *ct)
+{
+	ct->step = (ct->size / 2 > CHUNK_TUNER_MIN_STEP) ? ct->size / 2 : CHUNK_TUNER_MIN_STEP;
+	ct->direction = 1;
+	ct->turned = 0;
+	ct->best_size = ct->size;
+	ct->best_rate = 0;
+}
+
+void chunk_tuner_init(struct chunk_tuner *ct, uint32_t initial_size, uint32_t min, uint32_t max)
+{
+	ct->min = min;
+	ct->max = max;
+	if (initial_size < ct->min) {
+		initial_size = ct->min;
+	} else if (initial_size > ct->max) {
+		initial_size = ct->max;
+	}
+	ct->size = initial_size;
+	ct->window_bytes = 0;
+	ct->window_us = 0;
+	ct->window_chunks = 0;
+	ct->start = 0;
+	chunk_tuner_search(ct);
+}
+
+void chunk_tuner_begin(struct chunk_tuner *ct)
+{
+	ct->start = chunk_tuner_now_us();
+}
+
+void chunk_tuner_end(struct chunk_tuner *ct, uint32_t amount)
+{
+	chunk_tuner_update(ct, amount, chunk_tuner_now_us() - ct->start);
+}
+
+/* the next size to measure from the best one, or 0 if there is none in the current direction */
+static uint32_t chunk_tuner_next(struct chunk_tuner *ct)
+{
+	if (ct->direction > 0) {
+		return (ct->best_size < ct->max) ? ((ct->max - ct->best_size > ct->step) ? ct->best_size + ct->step : ct->max) : 0;
+	}
+	return (ct->best_size > ct->min) ? ((ct->best_size - ct->min > ct->step) ? ct->best_size - ct->step : ct->min) : 0;
+}
+
+void chunk_tuner_update(struct chunk_tuner *ct, uint32_t amount, uint64_t elapsed_us)
+{
+	/* partial chunks (end of file) don't tell anything about the chunk size */
+	if (ct->min == ct->max || amount < ct->size) {
+		return;
+	}
+	ct->window_bytes += amount;
+	ct->window_us += elapsed_us;
+	ct->window_chunks++;
+	/* a size that is clearly worse than the best one is not measured any further */
+	int clearly_worse = (ct->step > 0 && (double)amount < ct->best_rate * CHUNK_TUNER_BACKOFF * elapsed_us);
+	if ((ct->window_chunks < CHUNK_TUNER_WINDOW || ct->window_bytes < CHUNK_TUNER_WINDOW_BYTES) && !clearly_worse) {
+		return;
+	}
+	double rate = (double)ct->window_bytes / ((ct->window_us > 0) ? ct->window_us : 1);
+	ct->window_bytes = 0;
+	ct->window_us = 0;
+	ct->window_chunks = 0;
+
+	if (ct->step == 0) {
+		/* settled; only a clear drop means the connection changed */
+		if (rate < ct->best_rate * CHUNK_TUNER_BACKOFF) {
+			ct->size = (ct->size / 2 > ct->min) ? ct->size / 2 : ct->min;
+			chunk_tuner_search(ct);
+		} else {
+			ct->best_rate = (ct->best_rate * 0.7) + (rate * 0.3);
+		}
+		return;
+	}
+
+	if (rate > ct->best_rate) {
+		/* keep going in the same direction, faster until the first turn */
+		if (ct->best_rate > 0 && !ct->turned && ct->step < ct->max / 2) {
+			ct->step *= 2;
+		}
+		ct->best_rate = rate;
+		ct->best_size = ct->size;
+	} else {
+		/* worse than the best so far, turn around with a smaller step */
+		ct->direction = -ct->direction;
+		ct->step /= 2;
+		ct->turned = 1;
+	}
+	uint32_t next = (ct->step >= CHUNK_TUNER_MIN_STEP) ? chunk_tuner_next(ct) : 0;
+	if (next == 0 && ct->step >= CHUNK_TUNER_MIN_STEP) {
+		/* at a bound, try the other way */
+		ct->direction = -ct->direction;
+		ct->step /= 2;
+		ct->turned = 1;
+		next = (ct->step >= CHUNK_TUNER_MIN_STEP) ? chunk_tuner_next(ct) : 0;
+	}
+	if (next == 0) {
+		ct->size = ct->best_size;
+		ct->step = 0;
+	} else {
+		ct->size = next;
+	}
+}
@@ -0,0 +1,63 @@
+/*
+ * chunktuner.h
+ * Adaptive AFC transfer chunk size
+ *
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more profile.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifndef __CHUNKTUNER_H
+#define __CHUNKTUNER_H
+
+#include <stdint.h>
+
+/*
+ * Adapts the size of AFC reads/writes to the measured throughput. The
+ * throughput is measured over a window of full chunks. Starting from the
+ * initial size, the tuner steps the size up as long as that pays off (with
+ * a doubling step until the first turn), turns around with half the step
+ * when it does not, and settles on the best size once the step gets small.
+ * A later drop in throughput halves the size and starts the search again.
+ * That finds the sweet spot of the connection (USB 2, USB 3, network)
+ * within a few megabytes.
+ */
+struct chunk_tuner {
+	uint32_t size;
+	uint32_t min;
+	uint32_t max;
+	uint32_t step; /* 0 once settled */
+	int direction;
+	int turned;
+	uint32_t best_size;
+	double best_rate;
+	uint64_t window_bytes;
+	uint64_t window_us;
+	int window_chunks;
+	uint64_t start;
+};
+
+/* starts with initial_size, kept within min and max (min == max disables adaptation) */
+void chunk_tuner_init(struct chunk_tuner *ct, uint32_t initial_size, uint32_t min, uint32_t max);
+
+/* call around every read/write of ct->size bytes, amount is what was transferred */
+void chunk_tuner_begin(struct chunk_tuner *ct);
+void chunk_tuner_end(struct chunk_tuner *ct, uint32_t amount);
+
+/* same as chunk_tuner_end() with the time the transfer took in microseconds */
+void chunk_tuner_update(struct chunk_tuner *ct, uint32_t amount, uint64_t elapsed_us);
+
+#endif
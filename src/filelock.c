@@ -0,0 +1,52 @@
+/*
+ * filelock.c
+ * Advisory locks shared by concurrent runs
+ *
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more profile.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <string.h>
+#include <errno.h>
+#ifdef WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/file.h>
+#endif
+
+#include "filelock.h"
+
+int lock_file(int fd, int nonblock)
+{
+#ifdef WIN32
+	OVERLAPPED ov;
+	memset(&ov, 0, sizeof(ov));
+	DWORD flags = LOCKFILE_EXCLUSIVE_LOCK | ((nonblock) ? LOCKFILE_FAIL_IMMEDIATELY : 0);
+	return LockFileEx((HANDLE)_get_osfhandle(fd), flags, 0, 1, 0, &ov) ? 0 : -1;
+#else
+	while (flock(fd, LOCK_EX | ((nonblock) ? LOCK_NB : 0)) < 0) {
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+	return 0;
+#endif
+}
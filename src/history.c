@@ -0,0 +1,451 @@
+/*
+ * history.c
+ * Upload and install history, and the predictions of the plan command
+ *
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more profile.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <fcntl.h>
+#ifdef WIN32
+#include <io.h>
+#endif
+
+#include <libimobiledevice/libimobiledevice.h>
+
+#include "history.h"
+#include "filelock.h"
+
+#define HISTORY_MAGIC 0x31484449
+#define HISTORY_UDID_SIZE 48
+
+struct history_record {
+	uint32_t magic;
+	uint8_t kind;
+	uint8_t network;
+	uint16_t reserved;
+	uint64_t timestamp; /* ms since the epoch */
+	uint64_t bytes;
+	uint64_t duration_us;
+	char udid[HISTORY_UDID_SIZE];
+};
+
+static char *str_printf(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (len < 0) {
+		return NULL;
+	}
+	char *str = (char*)malloc(len + 1);
+	if (!str) {
+		return NULL;
+	}
+	va_start(ap, fmt);
+	vsnprintf(str, len + 1, fmt, ap);
+	va_end(ap);
+	return str;
+}
+
+void history_ring_add(struct history_ring *ring, uint64_t bytes, uint64_t duration_us)
+{
+	int i = ring->count % HISTORY_SAMPLES;
+	ring->bytes[i] = bytes;
+	ring->duration_us[i] = duration_us;
+	ring->count++;
+}
+
+void history_ring_sum(const struct history_ring *ring, struct history_estimate *est)
+{
+	int i;
+	memset(est, 0, sizeof(struct history_estimate));
+	est->samples = (ring->count < HISTORY_SAMPLES) ? ring->count : HISTORY_SAMPLES;
+	for (i = 0; i < est->samples; i++) {
+		est->bytes += ring->bytes[i];
+		est->duration_us += ring->duration_us[i];
+	}
+}
+
+int history_load(const char *filename, const char *device_udid, int network, struct history_estimate *upload, struct history_estimate *install)
+{
+	struct history_record recs[64];
+	struct history_ring up;
+	struct history_ring inst;
+	size_t n, i;
+
+	memset(&up, 0, sizeof(up));
+	memset(&inst, 0, sizeof(inst));
+	FILE *f = (filename) ? fopen(filename, "rb") : NULL;
+	if (!f) {
+		memset(upload, 0, sizeof(struct history_estimate));
+		memset(install, 0, sizeof(struct history_estimate));
+		return -1;
+	}
+	while ((n = fread(recs, sizeof(struct history_record), sizeof(recs) / sizeof(recs[0]), f)) > 0) {
+		for (i = 0; i < n; i++) {
+			struct history_record *rec = &recs[i];
+			if (rec->magic != HISTORY_MAGIC || rec->network != network || rec->bytes == 0 || rec->duration_us == 0) {
+				continue;
+			}
+			rec->udid[HISTORY_UDID_SIZE-1] = '\0';
+			if (device_udid && strcmp(rec->udid, device_udid) != 0) {
+				continue;
+			}
+			if (rec->kind == HISTORY_UPLOAD) {
+				history_ring_add(&up, rec->bytes, rec->duration_us);
+			} else if (rec->kind == HISTORY_INSTALL) {
+				history_ring_add(&inst, rec->bytes, rec->duration_us);
+			}
+		}
+	}
+	fclose(f);
+	history_ring_sum(&up, upload);
+	history_ring_sum(&inst, install);
+
+	return 0;
+}
+
+int64_t history_predict_ms(const struct history_estimate *est, uint64_t bytes)
+{
+	if (est->samples == 0 || est->bytes == 0) {
+		return -1;
+	}
+	return (int64_t)(((double)bytes * est->duration_us) / est->bytes / 1000);
+}
+
+double history_rate(const struct history_estimate *est)
+{
+	if (est->samples == 0 || est->duration_us == 0) {
+		return 0;
+	}
+	return (double)est->bytes * 1000000 / est->duration_us;
+}
+
+void history_compact(const char *filename)
+{
+	char *tmpname = NULL;
+	char *buf = NULL;
+	size_t keep = HISTORY_MAX_RECORDS / 2;
+	size_t num = 0;
+
+	FILE *f = fopen(filename, "rb");
+	if (!f) {
+		return;
+	}
+	if (fseek(f, 0, SEEK_END) == 0) {
+		long size = ftell(f);
+		num = (size > 0) ? (size_t)size / sizeof(struct history_record) : 0;
+	}
+	/* only the records that are kept are read */
+	if (num <= keep || fseek(f, (long)((num - keep) * sizeof(struct history_record)), SEEK_SET) != 0) {
+		fclose(f);
+		return;
+	}
+	buf = (char*)malloc(keep * sizeof(struct history_record));
+	if (!buf || fread(buf, sizeof(struct history_record), keep, f) != keep) {
+		fclose(f);
+		free(buf);
+		return;
+	}
+	fclose(f);
+
+	tmpname = str_printf("%s.%d.tmp", filename, (int)getpid());
+	f = (tmpname) ? fopen(tmpname, "wb") : NULL;
+	if (f) {
+		size_t written = fwrite(buf, sizeof(struct history_record), keep, f);
+		if (fclose(f) != 0 || written != keep || rename(tmpname, filename) != 0) {
+			remove(tmpname);
+		}
+	}
+	free(tmpname);
+	free(buf);
+}
+
+void history_add(const char *filename, const char *device_udid, int network, enum history_kind kind, uint64_t bytes, uint64_t duration_us)
+{
+	struct history_record rec;
+	struct timeval tv;
+	char *lockname = NULL;
+	int lockfd = -1;
+
+	if (!filename || !device_udid || bytes == 0 || duration_us == 0 || (kind == HISTORY_UPLOAD && bytes < HISTORY_MIN_UPLOAD_SIZE)) {
+		return;
+	}
+	gettimeofday(&tv, NULL);
+	memset(&rec, 0, sizeof(rec));
+	rec.magic = HISTORY_MAGIC;
+	rec.kind = (uint8_t)kind;
+	rec.network = (uint8_t)network;
+	rec.timestamp = ((uint64_t)tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+	rec.bytes = bytes;
+	rec.duration_us = duration_us;
+	strncpy(rec.udid, device_udid, HISTORY_UDID_SIZE-1);
+
+	lockname = str_printf("%s.lock", filename);
+	if (!lockname) {
+		goto leave;
+	}
+	/* serialize with the compaction of concurrent runs */
+	lockfd = open(lockname, O_RDWR | O_CREAT, 0644);
+	if (lockfd < 0 || lock_file(lockfd, 0) < 0) {
+		goto leave;
+	}
+	FILE *f = fopen(filename, "ab");
+	if (!f) {
+		goto leave;
+	}
+	fwrite(&rec, sizeof(rec), 1, f);
+	long size = ftell(f);
+	fclose(f);
+	if (size > (long)(HISTORY_MAX_RECORDS * sizeof(struct history_record))) {
+		history_compact(filename);
+	}
+
+leave:
+	if (lockfd >= 0) {
+		close(lockfd);
+	}
+	free(lockname);
+}
+
+void format_size(uint64_t size, char *buf, size_t len)
+{
+	if (size >= 1073741824) {
+		snprintf(buf, len, "%.1f GB", (double)size / 1073741824);
+	} else if (size >= 1048576) {
+		snprintf(buf, len, "%.1f MB", (double)size / 1048576);
+	} else if (size >= 1024) {
+		snprintf(buf, len, "%.1f KB", (double)size / 1024);
+	} else {
+		snprintf(buf, len, "%" PRIu64 " B", size);
+	}
+}
+
+void format_duration(int64_t ms, char *buf, size_t len)
+{
+	if (ms < 0) {
+		snprintf(buf, len, "unknown");
+		return;
+	}
+	int secs = (int)((ms + 999) / 1000);
+	if (secs >= 3600) {
+		snprintf(buf, len, "%d:%02d:%02d", secs / 3600, (secs / 60) % 60, secs % 60);
+	} else {
+		snprintf(buf, len, "%d:%02d", secs / 60, secs % 60);
+	}
+}
+
+int package_get_size(const char *path, package_totals_func get_totals, uint64_t *size)
+{
+	struct stat st;
+	uint64_t total_files = 0;
+
+	*size = 0;
+	if (stat(path, &st) != 0) {
+		fprintf(stderr, "ERROR: stat: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	size_t len = strlen(path);
+	/* directories and carrier bundles are uploaded unpacked */
+	if (S_ISDIR(st.st_mode) || (len > 5 && strcmp(path + len - 5, ".ipcc") == 0)) {
+		int errp = 0;
+		if (get_totals(path, &st, size, &total_files, &errp) < 0) {
+			fprintf(stderr, "ERROR: zip_open: %s: %d\n", path, errp);
+			return -1;
+		}
+	} else {
+		*size = (uint64_t)st.st_size;
+	}
+	return 0;
+}
+
+/* longest first, unknown last */
+static int plan_device_cmp(const void *a, const void *b)
+{
+	const struct plan_device *da = (const struct plan_device*)a;
+	const struct plan_device *db = (const struct plan_device*)b;
+	if (da->total_ms == db->total_ms) {
+		return strcmp(da->udid, db->udid);
+	}
+	return (da->total_ms > db->total_ms) ? -1 : 1;
+}
+
+void plan_predict(struct plan_device *dev, const uint64_t *sizes, int num_sizes, const struct history_estimate *upload, const struct history_estimate *install)
+{
+	int i;
+
+	dev->upload_ms = 0;
+	dev->install_ms = 0;
+	dev->total_ms = 0;
+	for (i = 0; i < num_sizes; i++) {
+		int64_t up = history_predict_ms(upload, sizes[i]);
+		int64_t inst = history_predict_ms(install, sizes[i]);
+		if (up < 0 || inst < 0) {
+			dev->upload_ms = (up < 0) ? -1 : dev->upload_ms;
+			dev->install_ms = (inst < 0) ? -1 : dev->install_ms;
+			dev->total_ms = -1;
+			return;
+		}
+		dev->upload_ms += up;
+		dev->install_ms += inst;
+		if (i == 0) {
+			dev->total_ms += up;
+		}
+		/* the following upload overlaps with this install */
+		int64_t next_up = (i+1 < num_sizes) ? history_predict_ms(upload, sizes[i+1]) : 0;
+		dev->total_ms += (next_up > inst) ? next_up : inst;
+	}
+}
+
+int plan_run(const char *history_file, char **paths, int num_paths, const char *device_udid, int network_only, package_totals_func get_totals)
+{
+	struct history_estimate fleet[4];
+	struct plan_device *devs = NULL;
+	idevice_info_t *devices = NULL;
+	int count = 0;
+	int num_devs = 0;
+	uint64_t total_size = 0;
+	int i, j, res = -1;
+
+	uint64_t *sizes = (uint64_t*)calloc(num_paths, sizeof(uint64_t));
+	if (!sizes) {
+		return -1;
+	}
+	for (i = 0; i < num_paths; i++) {
+		if (package_get_size(paths[i], get_totals, &sizes[i]) < 0) {
+			goto leave;
+		}
+		total_size += sizes[i];
+	}
+
+	/* the connected devices, or just the given one (even if it is not connected) */
+	idevice_get_device_list_extended(&devices, &count);
+	devs = (struct plan_device*)calloc(count + 1, sizeof(struct plan_device));
+	if (!devs) {
+		goto leave;
+	}
+	for (i = 0; i < count; i++) {
+		int network = (devices[i]->conn_type == CONNECTION_NETWORK);
+		if ((device_udid && strcmp(devices[i]->udid, device_udid) != 0) || (network_only && !network)) {
+			continue;
+		}
+		for (j = 0; j < num_devs; j++) {
+			if (!strcmp(devs[j].udid, devices[i]->udid)) {
+				break;
+			}
+		}
+		if (j < num_devs) {
+			/* prefer USB if the device is connected both ways */
+			if (!network) {
+				devs[j].network = 0;
+			}
+			continue;
+		}
+		devs[num_devs].udid = strdup(devices[i]->udid);
+		devs[num_devs].network = network;
+		num_devs++;
+	}
+	if (devices) {
+		idevice_device_list_extended_free(devices);
+	}
+	if (num_devs == 0 && device_udid) {
+		devs[0].udid = strdup(device_udid);
+		devs[0].network = network_only;
+		num_devs = 1;
+	}
+	if (num_devs == 0) {
+		fprintf(stderr, "No device found.\n");
+		goto leave;
+	}
+
+	history_load(history_file, NULL, 0, &fleet[0], &fleet[1]);
+	history_load(history_file, NULL, 1, &fleet[2], &fleet[3]);
+	for (i = 0; i < num_devs; i++) {
+		struct history_estimate upload;
+		struct history_estimate install;
+		history_load(history_file, devs[i].udid, devs[i].network, &upload, &install);
+		if (upload.samples == 0) {
+			upload = fleet[devs[i].network * 2];
+			devs[i].fleet_average = 1;
+		}
+		if (install.samples == 0) {
+			install = fleet[devs[i].network * 2 + 1];
+			devs[i].fleet_average = 1;
+		}
+		plan_predict(&devs[i], sizes, num_paths, &upload, &install);
+	}
+	qsort(devs, num_devs, sizeof(struct plan_device), plan_device_cmp);
+
+	char size_str[16];
+	char up_str[16];
+	char inst_str[16];
+	char total_str[16];
+	int64_t longest = 0;
+	int64_t sum = 0;
+	format_size(total_size, size_str, sizeof(size_str));
+	printf("%d package(s), %s, on %d device(s), longest first:\n", num_paths, size_str, num_devs);
+	printf("%-40s %-8s %9s %9s %9s\n", "UDID", "TYPE", "UPLOAD", "INSTALL", "TOTAL");
+	for (i = 0; i < num_devs; i++) {
+		format_duration(devs[i].upload_ms, up_str, sizeof(up_str));
+		format_duration(devs[i].install_ms, inst_str, sizeof(inst_str));
+		format_duration(devs[i].total_ms, total_str, sizeof(total_str));
+		printf("%-40s %-8s %9s %9s %9s%s\n", devs[i].udid, (devs[i].network) ? "Network" : "USB", up_str, inst_str, total_str, (devs[i].fleet_average) ? " *" : "");
+		if (devs[i].total_ms < 0) {
+			longest = -1;
+			sum = -1;
+		} else if (longest >= 0) {
+			longest = (devs[i].total_ms > longest) ? devs[i].total_ms : longest;
+			sum += devs[i].total_ms;
+		}
+	}
+	format_duration(longest, total_str, sizeof(total_str));
+	format_duration(sum, up_str, sizeof(up_str));
+	printf("Estimated time: %s with all devices at once, %s one after another\n", total_str, up_str);
+	for (i = 0; i < num_devs; i++) {
+		if (devs[i].fleet_average) {
+			printf("* no history for this device, based on all devices with the same connection type\n");
+			break;
+		}
+	}
+	res = 0;
+
+leave:
+	if (devs) {
+		for (i = 0; i < num_devs; i++) {
+			free(devs[i].udid);
+		}
+		free(devs);
+	}
+	free(sizes);
+	return res;
+}
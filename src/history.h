@@ -0,0 +1,120 @@
+/*
+ * history.h
+ * Upload and install history, and the predictions of the plan command
+ *
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more profile.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+
+#ifndef __HISTORY_H
+#define __HISTORY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+/*
+ * History of the measured upload throughput and install durations per
+ * device and connection type. It is an append-only log of fixed size
+ * records (in host byte order), which is compacted to the most recent
+ * records when it grows too large. The most recent samples give the ETAs
+ * before a transfer has a rate of its own, the predictions of the plan
+ * command and the order of the USB upload slots.
+ */
+#define HISTORY_SAMPLES 16
+#define HISTORY_MAX_RECORDS 65536
+#define HISTORY_MIN_UPLOAD_SIZE 1048576
+
+enum history_kind {
+	HISTORY_UPLOAD = 1,
+	HISTORY_INSTALL = 2
+};
+
+/* sums over the most recent samples */
+struct history_estimate {
+	uint64_t bytes;
+	uint64_t duration_us;
+	int samples;
+};
+
+/* the last HISTORY_SAMPLES samples */
+struct history_ring {
+	uint64_t bytes[HISTORY_SAMPLES];
+	uint64_t duration_us[HISTORY_SAMPLES];
+	int count;
+};
+
+void history_ring_add(struct history_ring *ring, uint64_t bytes, uint64_t duration_us);
+void history_ring_sum(const struct history_ring *ring, struct history_estimate *est);
+
+/*
+ * Sums up the most recent samples of the device (or of all devices if
+ * device_udid is NULL) over the given connection type from the log in
+ * filename. Returns -1 if there is no history at all.
+ */
+int history_load(const char *filename, const char *device_udid, int network, struct history_estimate *upload, struct history_estimate *install);
+
+/* appends a measurement of the device to the log, compacting it if needed */
+void history_add(const char *filename, const char *device_udid, int network, enum history_kind kind, uint64_t bytes, uint64_t duration_us);
+
+/* keeps the newer half of the records, called with the log locked */
+void history_compact(const char *filename);
+
+/* expected duration in ms for the given amount of data, or -1 if unknown */
+int64_t history_predict_ms(const struct history_estimate *est, uint64_t bytes);
+
+/* bytes per second of the estimate, or 0 if unknown */
+double history_rate(const struct history_estimate *est);
+
+void format_size(uint64_t size, char *buf, size_t len);
+void format_duration(int64_t ms, char *buf, size_t len);
+
+/*
+ * Measures the unpacked content of a directory or zip package at path, as
+ * provided by the tool (which caches it for zip packages). errp receives
+ * the libzip error if the package could not be opened.
+ */
+typedef int (*package_totals_func)(const char *path, struct stat *st, uint64_t *total_bytes, uint64_t *total_files, int *errp);
+
+/* the amount of data that is uploaded for the package at path */
+int package_get_size(const char *path, package_totals_func get_totals, uint64_t *size);
+
+struct plan_device {
+	char *udid;
+	int network;
+	int64_t upload_ms;
+	int64_t install_ms;
+	int64_t total_ms;
+	int fleet_average;
+};
+
+/*
+ * Predicts the deployment of the packages of the given sizes from the
+ * estimates. Like the install command, the next package is expected to be
+ * uploaded while the current one is installed.
+ */
+void plan_predict(struct plan_device *dev, const uint64_t *sizes, int num_sizes, const struct history_estimate *upload, const struct history_estimate *install);
+
+/*
+ * Prints the predicted deployment of the packages on the connected devices
+ * (or only device_udid), longest first. Devices without history of their
+ * own are predicted from all devices over the same connection type.
+ */
+int plan_run(const char *history_file, char **paths, int num_paths, const char *device_udid, int network_only, package_totals_func get_totals);
+
+#endif
@@ -0,0 +1,351 @@
+/*
+ * historytest.c
+ * Checks for the history store and the plan predictions
+ *
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more profile.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <sys/stat.h>
+
+#include "history.h"
+
+#define MB 1048576ULL
+#define DEVICE_A "00008030-001A2D0E3C0A802E"
+#define DEVICE_B "00008101-000E1D2C3B4A5968"
+
+static int failed = 0;
+
+#define CHECK(name, cond) do { \
+		if (!(cond)) { \
+			printf("%-40s FAILED: %s\n", name, #cond); \
+			failed++; \
+		} \
+	} while (0)
+
+static void report(const char *name, int failed_before)
+{
+	printf("%-40s %s\n", name, (failed > failed_before) ? "FAILED" : "OK");
+}
+
+static long file_size(const char *path)
+{
+	struct stat st;
+	return (stat(path, &st) == 0) ? (long)st.st_size : -1;
+}
+
+static void test_ring(void)
+{
+	int failed_before = failed;
+	struct history_ring ring;
+	struct history_estimate est;
+	int i;
+
+	memset(&ring, 0, sizeof(ring));
+	history_ring_sum(&ring, &est);
+	CHECK("empty ring", est.samples == 0 && est.bytes == 0 && est.duration_us == 0);
+
+	for (i = 1; i <= 3; i++) {
+		history_ring_add(&ring, i * 100, i * 10);
+	}
+	history_ring_sum(&ring, &est);
+	CHECK("partial ring", est.samples == 3 && est.bytes == 600 && est.duration_us == 60);
+
+	/* only the most recent samples count once the ring wrapped around */
+	for (i = 4; i <= HISTORY_SAMPLES + 4; i++) {
+		history_ring_add(&ring, i * 100, i * 10);
+	}
+	history_ring_sum(&ring, &est);
+	uint64_t bytes = 0;
+	for (i = 5; i <= HISTORY_SAMPLES + 4; i++) {
+		bytes += i * 100;
+	}
+	CHECK("wrapped ring", est.samples == HISTORY_SAMPLES && est.bytes == bytes && est.duration_us == bytes / 10);
+	report("history_ring_add/sum", failed_before);
+}
+
+static void test_predict(void)
+{
+	int failed_before = failed;
+	struct history_estimate none = { 0, 0, 0 };
+	/* 10 MB/s and 5 MB/s */
+	struct history_estimate up = { 40 * MB, 4000000, 4 };
+	struct history_estimate inst = { 10 * MB, 2000000, 2 };
+
+	CHECK("predict without samples", history_predict_ms(&none, MB) == -1);
+	CHECK("predict upload", history_predict_ms(&up, 25 * MB) == 2500);
+	CHECK("predict install", history_predict_ms(&inst, 25 * MB) == 5000);
+	CHECK("predict nothing", history_predict_ms(&up, 0) == 0);
+	CHECK("rate without samples", history_rate(&none) == 0);
+	CHECK("rate", history_rate(&up) == 10.0 * MB);
+	report("history_predict_ms/rate", failed_before);
+}
+
+static void test_plan_predict(void)
+{
+	int failed_before = failed;
+	/* 100 ms per MB upload, 200 ms per MB install */
+	struct history_estimate up = { 10 * MB, 1000000, 1 };
+	struct history_estimate inst = { 10 * MB, 2000000, 1 };
+	struct history_estimate none = { 0, 0, 0 };
+	struct plan_device dev;
+	uint64_t one[] = { 10 * MB };
+	uint64_t three[] = { 10 * MB, 30 * MB, 5 * MB };
+	uint64_t small_first[] = { 5 * MB, 40 * MB };
+
+	memset(&dev, 0, sizeof(dev));
+	plan_predict(&dev, one, 1, &up, &inst);
+	CHECK("plan one package", dev.upload_ms == 1000 && dev.install_ms == 2000 && dev.total_ms == 3000);
+
+	/*
+	 * upload 1000 3000 500, install 2000 6000 1000: the first upload, then
+	 * each install overlapped with the following upload
+	 * 1000 + max(3000, 2000) + max(500, 6000) + 1000
+	 */
+	plan_predict(&dev, three, 3, &up, &inst);
+	CHECK("plan overlap", dev.upload_ms == 4500 && dev.install_ms == 9000 && dev.total_ms == 11000);
+
+	/* the second upload (4000) outlasts the first install (1000) */
+	plan_predict(&dev, small_first, 2, &up, &inst);
+	CHECK("plan upload bound", dev.upload_ms == 4500 && dev.install_ms == 9000 && dev.total_ms == 500 + 4000 + 8000);
+
+	plan_predict(&dev, three, 0, &up, &inst);
+	CHECK("plan nothing", dev.upload_ms == 0 && dev.install_ms == 0 && dev.total_ms == 0);
+
+	plan_predict(&dev, three, 3, &none, &inst);
+	CHECK("plan unknown upload", dev.upload_ms == -1 && dev.install_ms == 0 && dev.total_ms == -1);
+	plan_predict(&dev, three, 3, &up, &none);
+	CHECK("plan unknown install", dev.upload_ms == 0 && dev.install_ms == -1 && dev.total_ms == -1);
+	report("plan_predict", failed_before);
+}
+
+static void test_format_duration(void)
+{
+	int failed_before = failed;
+	static const struct {
+		int64_t ms;
+		const char *str;
+	} cases[] = {
+		{ -1, "unknown" },
+		{ 0, "0:00" },
+		{ 1, "0:01" },
+		{ 59999, "1:00" },
+		{ 61000, "1:01" },
+		{ 3599000, "59:59" },
+		{ 3600000, "1:00:00" },
+		{ 36061000, "10:01:01" },
+		{ 0, NULL }
+	};
+	char buf[16];
+	int i;
+	for (i = 0; cases[i].str; i++) {
+		format_duration(cases[i].ms, buf, sizeof(buf));
+		if (strcmp(buf, cases[i].str) != 0) {
+			printf("%-40s FAILED: %lld ms gave %s, expected %s\n", "format_duration", (long long)cases[i].ms, buf, cases[i].str);
+			failed++;
+		}
+	}
+	report("format_duration", failed_before);
+}
+
+static int fake_totals_calls = 0;
+
+static int fake_totals(const char *path, struct stat *st, uint64_t *total_bytes, uint64_t *total_files, int *errp)
+{
+	fake_totals_calls++;
+	if (strstr(path, "broken")) {
+		*errp = 19;
+		return -1;
+	}
+	*total_bytes = 12345;
+	*total_files = 3;
+	return 0;
+}
+
+static void test_package_get_size(const char *dir)
+{
+	int failed_before = failed;
+	char path[256];
+	uint64_t size = 0;
+	FILE *f;
+
+	CHECK("size of a directory", package_get_size(dir, fake_totals, &size) == 0 && size == 12345 && fake_totals_calls == 1);
+
+	snprintf(path, sizeof(path), "%s/app.ipa", dir);
+	f = fopen(path, "wb");
+	if (f) {
+		fwrite("0123456789", 1, 10, f);
+		fclose(f);
+	}
+	CHECK("size of an ipa", package_get_size(path, fake_totals, &size) == 0 && size == 10 && fake_totals_calls == 1);
+	remove(path);
+
+	snprintf(path, sizeof(path), "%s/carrier.ipcc", dir);
+	f = fopen(path, "wb");
+	if (f) {
+		fclose(f);
+	}
+	CHECK("size of an ipcc", package_get_size(path, fake_totals, &size) == 0 && size == 12345 && fake_totals_calls == 2);
+	remove(path);
+
+	snprintf(path, sizeof(path), "%s/broken.ipcc", dir);
+	f = fopen(path, "wb");
+	if (f) {
+		fclose(f);
+	}
+	CHECK("size of a broken ipcc", package_get_size(path, fake_totals, &size) < 0);
+	remove(path);
+
+	snprintf(path, sizeof(path), "%s/missing.ipa", dir);
+	CHECK("size of a missing package", package_get_size(path, fake_totals, &size) < 0 && size == 0);
+	report("package_get_size", failed_before);
+}
+
+static void test_store(const char *dir)
+{
+	int failed_before = failed;
+	char path[256];
+	struct history_estimate up, inst;
+	int i;
+
+	snprintf(path, sizeof(path), "%s/history.log", dir);
+	CHECK("load without a log", history_load(path, DEVICE_A, 0, &up, &inst) == -1 && up.samples == 0 && inst.samples == 0);
+
+	history_add(path, DEVICE_A, 0, HISTORY_UPLOAD, 20 * MB, 2000000);
+	history_add(path, DEVICE_A, 0, HISTORY_UPLOAD, 10 * MB, 2000000);
+	/* too small to tell the throughput, ignored */
+	history_add(path, DEVICE_A, 0, HISTORY_UPLOAD, HISTORY_MIN_UPLOAD_SIZE - 1, 1000);
+	history_add(path, DEVICE_A, 0, HISTORY_INSTALL, 30 * MB, 6000000);
+	history_add(path, DEVICE_A, 0, HISTORY_INSTALL, 0, 6000000);
+	history_add(path, DEVICE_A, 1, HISTORY_UPLOAD, 10 * MB, 5000000);
+	history_add(path, DEVICE_B, 0, HISTORY_UPLOAD, 10 * MB, 1000000);
+
+	CHECK("load device", history_load(path, DEVICE_A, 0, &up, &inst) == 0);
+	CHECK("device upload", up.samples == 2 && up.bytes == 30 * MB && up.duration_us == 4000000);
+	CHECK("device install", inst.samples == 1 && inst.bytes == 30 * MB && inst.duration_us == 6000000);
+	history_load(path, DEVICE_A, 1, &up, &inst);
+	CHECK("device over the network", up.samples == 1 && up.duration_us == 5000000 && inst.samples == 0);
+	history_load(path, NULL, 0, &up, &inst);
+	CHECK("all devices", up.samples == 3 && up.bytes == 40 * MB && inst.samples == 1);
+	history_load(path, "00000000-0000000000000000", 0, &up, &inst);
+	CHECK("unknown device", up.samples == 0 && inst.samples == 0);
+
+	/* a torn record at the end is skipped */
+	long record_size = file_size(path) / 5;
+	FILE *f = fopen(path, "ab");
+	if (f) {
+		fwrite("garbage", 1, 7, f);
+		fclose(f);
+	}
+	history_load(path, NULL, 0, &up, &inst);
+	CHECK("torn record", up.samples == 3 && inst.samples == 1);
+	remove(path);
+
+	/*
+	 * Compaction keeps the newer half: fill the log with copies of a record
+	 * of device A followed by ones of device B.
+	 */
+	char *rec_a = (char*)malloc(record_size);
+	char *rec_b = (char*)malloc(record_size);
+	history_add(path, DEVICE_A, 0, HISTORY_UPLOAD, 10 * MB, 1000000);
+	history_add(path, DEVICE_B, 0, HISTORY_UPLOAD, 10 * MB, 2000000);
+	f = fopen(path, "rb");
+	if (!f || !rec_a || !rec_b || fread(rec_a, 1, record_size, f) != (size_t)record_size || fread(rec_b, 1, record_size, f) != (size_t)record_size) {
+		printf("%-40s FAILED: could not read back %s\n", "history_compact", path);
+		failed++;
+		if (f) {
+			fclose(f);
+		}
+		free(rec_a);
+		free(rec_b);
+		return;
+	}
+	fclose(f);
+
+	int num_b = 1000;
+	f = fopen(path, "wb");
+	for (i = 0; f && i < HISTORY_MAX_RECORDS; i++) {
+		fwrite((i < HISTORY_MAX_RECORDS - num_b) ? rec_a : rec_b, 1, record_size, f);
+	}
+	if (f) {
+		fclose(f);
+	}
+	CHECK("log at the limit", file_size(path) == HISTORY_MAX_RECORDS * record_size);
+
+	/* the next record pushes it over the limit, it is kept last */
+	history_add(path, DEVICE_B, 0, HISTORY_UPLOAD, 10 * MB, 2000000);
+	CHECK("compacted log", file_size(path) == (HISTORY_MAX_RECORDS / 2) * record_size);
+	f = fopen(path, "rb");
+	char *rec = (char*)malloc(record_size);
+	int ordered = (f && rec);
+	for (i = 0; ordered && i < HISTORY_MAX_RECORDS / 2 - 1; i++) {
+		int want_b = (i >= HISTORY_MAX_RECORDS / 2 - 1 - num_b);
+		if (fread(rec, 1, record_size, f) != (size_t)record_size || memcmp(rec, (want_b) ? rec_b : rec_a, record_size) != 0) {
+			ordered = 0;
+		}
+	}
+	CHECK("compacted log keeps the newest", ordered);
+	if (f) {
+		fclose(f);
+	}
+
+	/* nothing to do on a small log */
+	history_compact(path);
+	CHECK("compacting a compacted log", file_size(path) == (HISTORY_MAX_RECORDS / 2) * record_size);
+
+	history_load(path, DEVICE_B, 0, &up, &inst);
+	CHECK("load compacted log", up.samples == HISTORY_SAMPLES && up.duration_us == HISTORY_SAMPLES * 2000000ULL);
+
+	free(rec);
+	free(rec_a);
+	free(rec_b);
+	remove(path);
+	snprintf(path, sizeof(path), "%s/history.log.lock", dir);
+	remove(path);
+	report("history_add/load/compact", failed_before);
+}
+
+int main(int argc, char **argv)
+{
+	char dir[] = "historytest.XXXXXX";
+
+	test_ring();
+	test_predict();
+	test_plan_predict();
+	test_format_duration();
+#ifdef WIN32
+	/* the file based checks need mkdtemp */
+#else
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "ERROR: Could not create a temporary directory\n");
+		return 1;
+	}
+	test_package_get_size(dir);
+	test_store(dir);
+	rmdir(dir);
+#endif
+	return (failed > 0) ? 1 : 0;
+}
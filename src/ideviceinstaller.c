@@ -28,7 +28,9 @@
 #define _GNU_SOURCE 1
 #define __USE_GNU 1
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
+#include <ctype.h>
 #include <getopt.h>
 #include <errno.h>
 #include <time.h>
@@ -36,12 +38,17 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <dirent.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#include <fcntl.h>
 #ifndef WIN32
 #include <signal.h>
+#include <sys/file.h>
+#else
+#include <io.h>
 #endif
 
 #include <libimobiledevice/libimobiledevice.h>
@@ -52,8 +59,20 @@
 
 #include <plist/plist.h>
 
+#include <libimobiledevice-glue/thread.h>
+
 #include <zip.h>
 
+#include "plistscan.h"
+#include "sha256.h"
+#include "chunktuner.h"
+#include "usbtopology.h"
+#include "trace.h"
+#include "metrics.h"
+#include "filelock.h"
+#include "history.h"
+#include "libideviceinstaller.h"
+
 #ifdef WIN32
 #include <windows.h>
 #define wait_ms(x) Sleep(x)
@@ -94,6 +113,8 @@ const char APPARCH_PATH[] = "ApplicationArchives";
 
 char *udid = NULL;
 char *cmdarg = NULL;
+char **cmdargs = NULL;
+int num_cmdargs = 0;
 char *extsinf = NULL;
 char *extmeta = NULL;
 
@@ -106,33 +127,82 @@ enum cmd_mode {
 	CMD_LIST_ARCHIVES,
 	CMD_ARCHIVE,
 	CMD_RESTORE,
-	CMD_REMOVE_ARCHIVE
+	CMD_REMOVE_ARCHIVE,
+	CMD_STAGING_GC,
+	CMD_PLAN
 };
 
 int cmd = CMD_NONE;
 
-char *last_status = NULL;
-int wait_for_command_complete = 0;
 int use_network = 0;
+int auto_transport = 0;
 int use_notifier = 0;
-int notification_expected = 0;
 int is_device_connected = 0;
-int command_completed = 0;
 int ignore_events = 0;
 int err_occurred = 0;
 int notified = 0;
+int apps_printed = 0;
 plist_t bundle_ids = NULL;
 plist_t return_attrs = NULL;
+plist_t uninstall_patterns = NULL;
 #define FORMAT_XML 1
 #define FORMAT_JSON 2
 int output_format = 0;
 int opt_list_user = 0;
 int opt_list_system = 0;
+int opt_list_watch = 0;
 char *copy_path = NULL;
 int remove_after_copy = 0;
 int skip_uninstall = 1;
 int app_only = 0;
 int docs_only = 0;
+int progress_fd = -1;
+char *trace_path = NULL;
+char *metrics_path = NULL;
+int progress_bar = 0;
+int use_cache = 1;
+int use_digest = 0;
+int digest_samples = 0;
+int verify_package = 0;
+/* which packages install/upgrade leave out, see --if-newer and --if-different */
+#define SKIP_IF_NEWER 1
+#define SKIP_IF_DIFFERENT 2
+static int skip_mode = 0;
+
+/* limits for the staging directory, applied after install/upgrade if set */
+#define STAGING_QUOTA_UNLIMITED UINT64_MAX
+uint64_t staging_quota = STAGING_QUOTA_UNLIMITED;
+uint64_t staging_max_age = 0;
+
+/* check the free space of the device before uploading, optionally making room */
+int space_check = 1;
+int make_room = 0;
+
+/* bounds for the adaptive AFC transfer chunk size */
+#define CHUNK_SIZE_MIN_DEFAULT 8192
+#define CHUNK_SIZE_MAX_DEFAULT 4194304
+#define CHUNK_SIZE_LIMIT 16777216
+uint32_t chunk_size_min = CHUNK_SIZE_MIN_DEFAULT;
+uint32_t chunk_size_max = CHUNK_SIZE_MAX_DEFAULT;
+
+/* concurrent uploads per USB host controller and hub, 0 means unlimited */
+int usb_controller_slots = 0;
+int usb_hub_slots = 0;
+
+/* number of parallel AFC connections used for multi-file uploads */
+#define AFC_CONNECTIONS_DEFAULT 4
+#define AFC_CONNECTIONS_LIMIT 16
+int afc_connections = AFC_CONNECTIONS_DEFAULT;
+
+/* number of instproxy connections used to uninstall several apps */
+#define UNINSTALL_CONNECTIONS_DEFAULT 4
+#define UNINSTALL_CONNECTIONS_LIMIT 16
+int uninstall_connections = UNINSTALL_CONNECTIONS_DEFAULT;
+
+/* how often a transient device error is retried before giving up */
+#define RETRIES_DEFAULT 3
+#define RETRIES_LIMIT 10
+int max_retries = RETRIES_DEFAULT;
 
 static void print_apps_header()
 {
@@ -158,6 +228,7 @@ static void print_apps(plist_t apps)
 	uint32_t i = 0;
 	for (i = 0; i < plist_array_get_size(apps); i++) {
 		plist_t app = plist_array_get_item(apps, i);
+		apps_printed++;
 		uint32_t j = 0;
 		for (j = 0; j < plist_array_get_size(return_attrs); j++) {
 			plist_t node = plist_array_get_item(return_attrs, j);
@@ -178,87 +249,755 @@ static void print_apps(plist_t apps)
 	}
 }
 
-static void notifier(const char *notification, void *unused)
+/* minimum interval in ms between two coalesced progress events */
+#define PROGRESS_INTERVAL_MS 100
+
+struct progress_event {
+	char data[2048];
+	size_t len;
+};
+
+struct progress_transfer {
+	const char *phase;
+	int active;
+	uint64_t bytes_sent;
+	uint64_t bytes_total;
+	uint64_t files_sent;
+	uint64_t files_total;
+	uint64_t last_emit;
+	uint64_t last_sent;
+	uint64_t last_draw;
+	uint64_t rate_time;
+	uint64_t rate_sent;
+	double rate;
+	double rate_hint;
+	int trace_span;
+	uint64_t start_time;
+	int draw_bar;
+};
+
+static struct progress_transfer transfer;
+static mutex_t transfer_mutex;
+static char *progress_last_status = NULL;
+static int progress_last_percent = -1;
+
+/* historical upload throughput of the device in bytes per second, see history_load() */
+static double progress_rate_hint = 0;
+/* expected duration in ms of the running install according to the history, or -1 */
+static int64_t progress_install_expected = -1;
+static uint64_t progress_install_start = 0;
+
+static uint64_t get_monotonic_us(void)
 {
-	notified = 1;
+#ifdef WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)((count.QuadPart * 1000000) / freq.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+#endif
+}
+
+static uint64_t get_monotonic_ms(void)
+{
+	return get_monotonic_us() / 1000;
+}
+
+static uint64_t get_timestamp_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return ((uint64_t)tv.tv_sec * 1000000) + tv.tv_usec;
+}
+
+static uint64_t get_timestamp_ms(void)
+{
+	return get_timestamp_us() / 1000;
+}
+
+static void progress_event_append(struct progress_event *ev, const char *fmt, ...)
+{
+	va_list ap;
+	size_t avail = sizeof(ev->data) - ev->len;
+	va_start(ap, fmt);
+	int res = vsnprintf(ev->data + ev->len, avail, fmt, ap);
+	va_end(ap);
+	if (res < 0) {
+		return;
+	}
+	ev->len += ((size_t)res < avail) ? (size_t)res : avail - 1;
 }
 
-static void status_cb(plist_t command, plist_t status, void *unused)
+static void progress_event_append_string(struct progress_event *ev, const char *key, const char *value)
 {
-	if (command && status) {
-		char* command_name = NULL;
-		instproxy_command_get_name(command, &command_name);
+	/* no separator needed as the first member of an object */
+	progress_event_append(ev, (ev->len > 0 && ev->data[ev->len-1] == '{') ? "\"%s\":\"" : ",\"%s\":\"", key);
+	/* reserve room for the closing quote and the trailing "}\n" */
+	size_t max = sizeof(ev->data) - 4;
+	const unsigned char *p = (const unsigned char*)value;
+	while (p && *p && ev->len < max - 6) {
+		switch (*p) {
+		case '"':
+		case '\\':
+			ev->data[ev->len++] = '\\';
+			ev->data[ev->len++] = *p;
+			break;
+		case '\n':
+			ev->data[ev->len++] = '\\';
+			ev->data[ev->len++] = 'n';
+			break;
+		case '\r':
+			ev->data[ev->len++] = '\\';
+			ev->data[ev->len++] = 'r';
+			break;
+		case '\t':
+			ev->data[ev->len++] = '\\';
+			ev->data[ev->len++] = 't';
+			break;
+		default:
+			if (*p < 0x20) {
+				ev->len += snprintf(ev->data + ev->len, 7, "\\u%04x", *p);
+			} else {
+				ev->data[ev->len++] = *p;
+			}
+			break;
+		}
+		p++;
+	}
+	ev->data[ev->len++] = '"';
+	ev->data[ev->len] = '\0';
+}
 
-		/* get status */
-		char *status_name = NULL;
-		instproxy_status_get_name(status, &status_name);
+static void progress_event_begin(struct progress_event *ev, const char *event)
+{
+	ev->len = 0;
+	progress_event_append(ev, "{\"event\":\"%s\",\"time\":%" PRIu64, event, get_timestamp_ms());
+}
 
-		if (status_name) {
-			if (!strcmp(status_name, "Complete")) {
-				command_completed = 1;
+static void progress_event_send(struct progress_event *ev)
+{
+	progress_event_append(ev, "}\n");
+	const char *p = ev->data;
+	size_t left = ev->len;
+	while (left > 0 && progress_fd >= 0) {
+		ssize_t n = write(progress_fd, p, left);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
 			}
+			fprintf(stderr, "WARNING: Could not write to progress fd %d: %s. Progress events disabled.\n", progress_fd, strerror(errno));
+			progress_fd = -1;
+			break;
 		}
+		p += n;
+		left -= n;
+	}
+}
 
-		/* get error if any */
-		char* error_name = NULL;
-		char* error_description = NULL;
-		uint64_t error_code = 0;
-		instproxy_status_get_error(status, &error_name, &error_description, &error_code);
+static const char *command_get_name(int command)
+{
+	switch (command) {
+	case CMD_LIST_APPS:
+		return "list";
+	case CMD_INSTALL:
+		return "install";
+	case CMD_UPGRADE:
+		return "upgrade";
+	case CMD_UNINSTALL:
+		return "uninstall";
+	case CMD_LIST_ARCHIVES:
+		return "list-archives";
+	case CMD_ARCHIVE:
+		return "archive";
+	case CMD_RESTORE:
+		return "restore";
+	case CMD_REMOVE_ARCHIVE:
+		return "remove-archive";
+	case CMD_STAGING_GC:
+		return "staging-gc";
+	case CMD_PLAN:
+		return "plan";
+	default:
+		return "none";
+	}
+}
 
-		/* output/handling */
-		if (!error_name) {
-			if (!strcmp(command_name, "Browse")) {
-				uint64_t total = 0;
-				uint64_t current_index = 0;
-				uint64_t current_amount = 0;
-				plist_t current_list = NULL;
-				instproxy_status_get_current_list(status, &total, &current_index, &current_amount, &current_list);
-				if (current_list) {
-					print_apps(current_list);
-					plist_free(current_list);
-				}
-			} else if (status_name) {
-				/* get progress if any */
-				int percent = -1;
-				instproxy_status_get_percent_complete(status, &percent);
+static double seconds_since(uint64_t start_us)
+{
+	return (double)(get_monotonic_us() - start_us) / 1000000;
+}
 
-				if (last_status && (strcmp(last_status, status_name))) {
-					printf("\n");
-				}
+static void progress_phase(const char *phase)
+{
+	struct progress_event ev;
+	if (progress_fd < 0) {
+		return;
+	}
+	progress_event_begin(&ev, "phase");
+	progress_event_append_string(&ev, "phase", phase);
+	progress_event_send(&ev);
+}
 
-				if (percent >= 0) {
-					printf("\r%s: %s (%d%%)", command_name, status_name, percent);
-				} else {
-					printf("\r%s: %s", command_name, status_name);
-				}
-				if (command_completed) {
-					printf("\n");
-				}
-			}
+static void progress_package(const char *path, const char *bundle_id, const char *result)
+{
+	struct progress_event ev;
+	if (progress_fd < 0) {
+		return;
+	}
+	progress_event_begin(&ev, "package");
+	if (path) {
+		progress_event_append_string(&ev, "path", path);
+	}
+	if (bundle_id) {
+		progress_event_append_string(&ev, "bundle_id", bundle_id);
+	}
+	progress_event_append_string(&ev, "result", result);
+	progress_event_send(&ev);
+}
+
+static void progress_digest(const char *path, uint64_t size, const char *sha256)
+{
+	struct progress_event ev;
+	if (progress_fd < 0) {
+		return;
+	}
+	progress_event_begin(&ev, "digest");
+	progress_event_append_string(&ev, "path", path);
+	progress_event_append(&ev, ",\"bytes\":%" PRIu64, size);
+	progress_event_append_string(&ev, "sha256", sha256);
+	progress_event_send(&ev);
+}
+
+/*
+ * Console output of the main thread. While an install is running, the next
+ * package is staged at the same time and status_cb rewrites its line from
+ * the instproxy thread, so everything goes through output_mutex and lines
+ * started with output_begin() are held back until output_end() completes
+ * them.
+ */
+static mutex_t output_mutex;
+static int output_deferred = 0;
+static int status_line_open = 0;
+static char output_pending[512];
+
+/* called with output_mutex held */
+static void output_close_status_line(void)
+{
+	if (status_line_open) {
+		printf("\n");
+		status_line_open = 0;
+	}
+}
+
+static void output_begin(const char *fmt, ...)
+{
+	va_list va;
+	va_start(va, fmt);
+	mutex_lock(&output_mutex);
+	if (output_deferred) {
+		vsnprintf(output_pending, sizeof(output_pending), fmt, va);
+	} else {
+		output_close_status_line();
+		vprintf(fmt, va);
+		fflush(stdout);
+	}
+	mutex_unlock(&output_mutex);
+	va_end(va);
+}
+
+static void output_end(const char *fmt, ...)
+{
+	va_list va;
+	va_start(va, fmt);
+	mutex_lock(&output_mutex);
+	output_close_status_line();
+	printf("%s", output_pending);
+	output_pending[0] = '\0';
+	vprintf(fmt, va);
+	fflush(stdout);
+	mutex_unlock(&output_mutex);
+	va_end(va);
+}
+
+static void output_line(const char *fmt, ...)
+{
+	va_list va;
+	va_start(va, fmt);
+	mutex_lock(&output_mutex);
+	output_close_status_line();
+	vprintf(fmt, va);
+	fflush(stdout);
+	mutex_unlock(&output_mutex);
+	va_end(va);
+}
+
+/* interval of the throughput samples and the progress bar updates in ms */
+#define PROGRESS_RATE_INTERVAL_MS 500
+#define PROGRESS_BAR_INTERVAL_MS 250
+#define PROGRESS_BAR_WIDTH 20
+
+/*
+ * remaining time in ms based on the smoothed throughput, or on the
+ * historical throughput until there is one, or -1 if unknown
+ */
+static int64_t progress_transfer_eta(void)
+{
+	double rate = (transfer.rate > 0) ? transfer.rate : transfer.rate_hint;
+	if (rate <= 0 || transfer.bytes_total <= transfer.bytes_sent) {
+		return -1;
+	}
+	return (int64_t)(((transfer.bytes_total - transfer.bytes_sent) * 1000) / rate);
+}
+
+static void progress_transfer_sample_rate(uint64_t now)
+{
+	if (now - transfer.rate_time < PROGRESS_RATE_INTERVAL_MS) {
+		return;
+	}
+	double sample = (double)((transfer.bytes_sent - transfer.rate_sent) * 1000) / (now - transfer.rate_time);
+	transfer.rate = (transfer.rate > 0) ? (transfer.rate * 0.7) + (sample * 0.3) : sample;
+	transfer.rate_time = now;
+	transfer.rate_sent = transfer.bytes_sent;
+}
+
+static void progress_transfer_emit(uint64_t now)
+{
+	struct progress_event ev;
+	progress_event_begin(&ev, "transfer");
+	progress_event_append_string(&ev, "phase", transfer.phase);
+	progress_event_append(&ev, ",\"bytes_sent\":%" PRIu64, transfer.bytes_sent);
+	if (transfer.bytes_total > 0) {
+		progress_event_append(&ev, ",\"bytes_total\":%" PRIu64 ",\"percent\":%d", transfer.bytes_total, (int)((transfer.bytes_sent * 100) / transfer.bytes_total));
+	}
+	if (transfer.files_total > 0) {
+		progress_event_append(&ev, ",\"files_sent\":%" PRIu64 ",\"files_total\":%" PRIu64, transfer.files_sent, transfer.files_total);
+	}
+	if (transfer.rate > 0) {
+		progress_event_append(&ev, ",\"rate\":%" PRIu64, (uint64_t)transfer.rate);
+	}
+	int64_t eta = progress_transfer_eta();
+	if (eta >= 0) {
+		progress_event_append(&ev, ",\"eta_ms\":%" PRIi64, eta);
+	}
+	progress_event_send(&ev);
+	transfer.last_emit = now;
+	transfer.last_sent = transfer.bytes_sent;
+}
+
+/* the bar is drawn behind the "Uploading ..." text, at the saved cursor position */
+static void progress_transfer_draw(uint64_t now)
+{
+	char bar[PROGRESS_BAR_WIDTH + 1];
+	char sent[16];
+	char total[16];
+	char rate[16];
+
+	format_size(transfer.bytes_sent, sent, sizeof(sent));
+	format_size((uint64_t)transfer.rate, rate, sizeof(rate));
+	printf("\0338");
+	if (transfer.bytes_total > 0) {
+		int percent = (int)((transfer.bytes_sent * 100) / transfer.bytes_total);
+		int filled = (percent * PROGRESS_BAR_WIDTH) / 100;
+		memset(bar, '#', filled);
+		memset(bar + filled, '.', PROGRESS_BAR_WIDTH - filled);
+		bar[PROGRESS_BAR_WIDTH] = '\0';
+		format_size(transfer.bytes_total, total, sizeof(total));
+		printf("[%s] %3d%% %s / %s", bar, percent, sent, total);
+	} else {
+		printf("%s", sent);
+	}
+	if (transfer.files_total > 1) {
+		printf(", %" PRIu64 "/%" PRIu64 " files", transfer.files_sent, transfer.files_total);
+	}
+	if (transfer.rate > 0) {
+		printf(", %s/s", rate);
+	}
+	int64_t eta = progress_transfer_eta();
+	if (eta >= 0) {
+		int secs = (int)(eta / 1000);
+		printf(", ETA %d:%02d", secs / 60, secs % 60);
+	}
+	printf("\033[K");
+	fflush(stdout);
+	transfer.last_draw = now;
+}
+
+static void progress_transfer_begin(const char *phase, uint64_t bytes_total, uint64_t files_total)
+{
+	memset(&transfer, 0, sizeof(transfer));
+	transfer.phase = phase;
+	transfer.bytes_total = bytes_total;
+	transfer.files_total = files_total;
+	if (!strcmp(phase, "upload")) {
+		transfer.rate_hint = progress_rate_hint;
+	}
+	/* no bar while an install is running, its status line would be drawn over */
+	transfer.draw_bar = (progress_bar && !output_deferred);
+	transfer.active = (progress_fd >= 0 || transfer.draw_bar || trace_enabled() || metrics_enabled());
+	if (!transfer.active) {
+		return;
+	}
+	transfer.start_time = get_monotonic_us();
+	transfer.trace_span = trace_begin(phase, NULL);
+	uint64_t now = get_monotonic_ms();
+	transfer.rate_time = now;
+	if (progress_fd >= 0) {
+		progress_phase(phase);
+		progress_transfer_emit(now);
+	}
+	if (transfer.draw_bar) {
+		/* remember where to draw the progress bar */
+		printf("\0337");
+		fflush(stdout);
+		transfer.last_draw = now;
+	}
+}
+
+/* called from the copy loops, so this has to stay cheap */
+static void progress_transfer_add(uint64_t amount)
+{
+	if (!transfer.active) {
+		return;
+	}
+	/* the upload workers report concurrently */
+	mutex_lock(&transfer_mutex);
+	transfer.bytes_sent += amount;
+	trace_transfer_counter(transfer.phase, amount, 0);
+	uint64_t now = get_monotonic_ms();
+	progress_transfer_sample_rate(now);
+	if (progress_fd >= 0 && now - transfer.last_emit >= PROGRESS_INTERVAL_MS) {
+		progress_transfer_emit(now);
+	}
+	if (transfer.draw_bar && now - transfer.last_draw >= PROGRESS_BAR_INTERVAL_MS) {
+		progress_transfer_draw(now);
+	}
+	mutex_unlock(&transfer_mutex);
+}
+
+static void progress_transfer_file_done(void)
+{
+	if (!transfer.active) {
+		return;
+	}
+	mutex_lock(&transfer_mutex);
+	transfer.files_sent++;
+	mutex_unlock(&transfer_mutex);
+}
+
+static void progress_transfer_end(void)
+{
+	if (!transfer.active) {
+		return;
+	}
+	if (progress_fd >= 0 && transfer.last_sent != transfer.bytes_sent) {
+		progress_transfer_emit(get_monotonic_ms());
+	}
+	trace_transfer_counter(transfer.phase, 0, 1);
+	trace_end(transfer.trace_span);
+	if (!strcmp(transfer.phase, "upload")) {
+		metrics_add_upload(transfer.bytes_sent, get_monotonic_us() - transfer.start_time);
+	}
+	if (transfer.draw_bar) {
+		/* clear the bar again so the caller can finish the line */
+		printf("\0338\033[K");
+		fflush(stdout);
+	}
+	transfer.active = 0;
+}
+
+static void progress_status(const char *command_name, const char *status_name, int percent)
+{
+	struct progress_event ev;
+	if (progress_fd < 0) {
+		return;
+	}
+	/* coalesce repeated status updates that don't carry new information */
+	if (progress_last_status && !strcmp(progress_last_status, status_name) && percent == progress_last_percent) {
+		return;
+	}
+	free(progress_last_status);
+	progress_last_status = strdup(status_name);
+	progress_last_percent = percent;
+
+	progress_event_begin(&ev, "status");
+	progress_event_append_string(&ev, "command", command_name);
+	progress_event_append_string(&ev, "status", status_name);
+	if (percent >= 0) {
+		progress_event_append(&ev, ",\"percent\":%d", percent);
+	}
+	if (progress_install_expected >= 0) {
+		int64_t remaining = progress_install_expected - (int64_t)((get_monotonic_us() - progress_install_start) / 1000);
+		progress_event_append(&ev, ",\"eta_ms\":%" PRIi64, (remaining > 0) ? remaining : 0);
+	}
+	progress_event_send(&ev);
+}
+
+static void progress_error(const char *command_name, const char *error_name, const char *error_description, uint64_t error_code)
+{
+	struct progress_event ev;
+	if (progress_fd < 0) {
+		return;
+	}
+	progress_event_begin(&ev, "error");
+	progress_event_append_string(&ev, "command", command_name);
+	progress_event_append_string(&ev, "error", error_name);
+	if (error_description) {
+		progress_event_append_string(&ev, "description", error_description);
+	}
+	progress_event_append(&ev, ",\"code\":%" PRIu64, error_code);
+	progress_event_send(&ev);
+}
+
+static void progress_result(int result)
+{
+	struct progress_event ev;
+	if (progress_fd < 0) {
+		return;
+	}
+	progress_event_begin(&ev, "result");
+	progress_event_append_string(&ev, "result", (result == 0) ? "success" : "failure");
+	progress_event_append(&ev, ",\"exit_code\":%d", result);
+	progress_event_send(&ev);
+}
+
+static void notifier(const char *notification, void *user_data)
+{
+	notified = 1;
+	idi_operation_notify((idi_operation_t)user_data);
+}
+
+/* what the status callback keeps between the statuses of a command */
+struct command_output {
+	char *last_status;
+	uint64_t completed_time;
+};
+
+static void status_cb(idi_operation_t op, const char *command_name, const char *status_name, int percent, void *user_data)
+{
+	struct command_output *out = (struct command_output*)user_data;
+	int completed = !strcmp(status_name, "Complete");
+	int changed = (!out->last_status || strcmp(out->last_status, status_name) != 0);
+
+	if (completed) {
+		out->completed_time = get_monotonic_us();
+	}
+	if (changed) {
+		trace_instant(status_name, command_name, NULL, percent);
+	}
+
+	/* the apps of a browse are printed by apps_cb(), the notification only shows in the trace */
+	if (strcmp(command_name, "Browse") != 0 && strcmp(command_name, "Notification") != 0) {
+		progress_status(command_name, status_name, percent);
+
+		mutex_lock(&output_mutex);
+		if (out->last_status && changed) {
+			output_close_status_line();
+		}
+		if (percent >= 0) {
+			printf("\r%s: %s (%d%%)", command_name, status_name, percent);
 		} else {
-			/* report error to the user */
-			if (error_description)
-				fprintf(stderr, "ERROR: %s failed. Got error \"%s\" with code 0x%08"PRIx64": %s\n", command_name, error_name, error_code, error_description ? error_description: "N/A");
-			else
-				fprintf(stderr, "ERROR: %s failed. Got error \"%s\".\n", command_name, error_name);
-			err_occurred = 1;
+			printf("\r%s: %s", command_name, status_name);
 		}
+		if (completed) {
+			printf("\n");
+		}
+		status_line_open = !completed;
+		fflush(stdout);
+		mutex_unlock(&output_mutex);
+	}
 
-		/* clean up */
-		free(error_name);
-		free(error_description);
+	if (changed) {
+		free(out->last_status);
+		out->last_status = strdup(status_name);
+	}
+}
 
-		free(last_status);
-		last_status = status_name;
+static void apps_cb(idi_operation_t op, plist_t apps, void *user_data)
+{
+	print_apps(apps);
+}
 
-		free(command_name);
-		command_name = NULL;
-	} else {
-		fprintf(stderr, "ERROR: %s was called with invalid arguments!\n", __func__);
+/* reports what went wrong on the device, see command_wait() for the rest */
+static void complete_cb(idi_operation_t op, idi_error_t result, void *user_data)
+{
+	const char *command_name = idi_operation_get_command(op);
+	const char *error_name = NULL;
+	const char *error_description = NULL;
+	uint64_t error_code = 0;
+
+	switch (result) {
+	case IDI_E_OP_FAILED:
+		idi_operation_get_error(op, &error_name, &error_description, &error_code);
+		if (!error_name) {
+			fprintf(stderr, "ERROR: %s failed.\n", command_name);
+			break;
+		}
+		if (error_description)
+			fprintf(stderr, "ERROR: %s failed. Got error \"%s\" with code 0x%08"PRIx64": %s\n", command_name, error_name, error_code, error_description);
+		else
+			fprintf(stderr, "ERROR: %s failed. Got error \"%s\".\n", command_name, error_name);
+		progress_error(command_name, error_name, error_description, error_code);
+		trace_instant("error", command_name, error_name, -1);
+		metrics_count_error(error_name);
+		break;
+	case IDI_E_NO_DEVICE:
+		fprintf(stderr, "ideviceinstaller: Device removed\n");
+		metrics_count_disconnect();
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Per-operation memory arena for the many short strings (paths) and small
+ * records built while uploading a package. Memory is only handed back to
+ * the allocator when the operation is done.
+ */
+#define ARENA_BLOCK_SIZE 65536
+
+struct arena_block {
+	struct arena_block *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+struct mem_arena {
+	struct arena_block *blocks;
+};
+
+static void *arena_alloc(struct mem_arena *arena, size_t size)
+{
+	struct arena_block *block = arena->blocks;
+	size = (size + 7) & ~(size_t)7;
+	if (!block || block->size - block->used < size) {
+		size_t bsize = (size > ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+		block = (struct arena_block*)malloc(sizeof(struct arena_block) + bsize);
+		if (!block) {
+			return NULL;
+		}
+		block->size = bsize;
+		block->used = 0;
+		block->next = arena->blocks;
+		arena->blocks = block;
+	}
+	void *p = block->data + block->used;
+	block->used += size;
+	return p;
+}
+
+/* joins the given NULL terminated list of path elements with '/' */
+static char *arena_build_path(struct mem_arena *arena, const char *elem, ...)
+{
+	va_list ap;
+	const char *p;
+	size_t len = 0;
+	int count = 0;
+
+	va_start(ap, elem);
+	for (p = elem; p; p = va_arg(ap, const char*)) {
+		len += strlen(p);
+		count++;
+	}
+	va_end(ap);
+
+	char *path = (char*)arena_alloc(arena, len + count);
+	if (!path) {
+		return NULL;
+	}
+	char *out = path;
+	va_start(ap, elem);
+	for (p = elem; p; p = va_arg(ap, const char*)) {
+		size_t plen = strlen(p);
+		if (out != path) {
+			*out++ = '/';
+		}
+		memcpy(out, p, plen);
+		out += plen;
+	}
+	va_end(ap);
+	*out = '\0';
+
+	return path;
+}
+
+static void arena_free(struct mem_arena *arena)
+{
+	while (arena->blocks) {
+		struct arena_block *next = arena->blocks->next;
+		free(arena->blocks);
+		arena->blocks = next;
+	}
+}
+
+/*
+ * Pool of page aligned transfer buffers (chunk_size_max bytes each) shared
+ * by the upload, extraction and archive copy loops and their worker
+ * threads. Buffers are recycled instead of being freed, so after the first
+ * transfer no further allocations happen.
+ */
+#define IO_BUFFER_ALIGNMENT 4096
+
+struct io_buffer {
+	struct io_buffer *next;
+};
+
+static struct io_buffer *io_buffer_pool = NULL;
+static mutex_t io_buffer_mutex;
+
+static char *io_buffer_get(void)
+{
+	char *buf = NULL;
+	mutex_lock(&io_buffer_mutex);
+	if (io_buffer_pool) {
+		buf = (char*)io_buffer_pool;
+		io_buffer_pool = io_buffer_pool->next;
+	}
+	mutex_unlock(&io_buffer_mutex);
+	if (!buf) {
+#ifdef WIN32
+		buf = (char*)_aligned_malloc(chunk_size_max, IO_BUFFER_ALIGNMENT);
+#else
+		if (posix_memalign((void**)&buf, IO_BUFFER_ALIGNMENT, chunk_size_max) != 0) {
+			buf = NULL;
+		}
+#endif
+	}
+	return buf;
+}
+
+static void io_buffer_put(char *buf)
+{
+	if (!buf) {
+		return;
+	}
+	struct io_buffer *iob = (struct io_buffer*)buf;
+	mutex_lock(&io_buffer_mutex);
+	iob->next = io_buffer_pool;
+	io_buffer_pool = iob;
+	mutex_unlock(&io_buffer_mutex);
+}
+
+static void io_buffer_pool_free(void)
+{
+	mutex_lock(&io_buffer_mutex);
+	while (io_buffer_pool) {
+		struct io_buffer *next = io_buffer_pool->next;
+#ifdef WIN32
+		_aligned_free(io_buffer_pool);
+#else
+		free(io_buffer_pool);
+#endif
+		io_buffer_pool = next;
 	}
+	mutex_unlock(&io_buffer_mutex);
 }
 
-static int zip_get_contents(struct zip *zf, const char *filename, int locate_flags, char **buffer, uint32_t *len)
+static int zip_get_contents(struct zip *zf, const char *filename, int locate_flags, struct mem_arena *arena, char **buffer, uint32_t *len)
 {
 	struct zip_stat zs;
 	struct zip_file *zfile;
@@ -289,10 +1028,9 @@ static int zip_get_contents(struct zip *zf, const char *filename, int locate_fla
 		return -4;
 	}
 
-	*buffer = malloc(zs.size);
-	if (zs.size > LLONG_MAX || zip_fread(zfile, *buffer, zs.size) != (zip_int64_t)zs.size) {
+	*buffer = (char*)arena_alloc(arena, zs.size);
+	if (!*buffer || zip_fread(zfile, *buffer, zs.size) != (zip_int64_t)zs.size) {
 		fprintf(stderr, "ERROR: zip_fread %" PRIu64 " bytes from '%s'\n", (uint64_t)zs.size, filename);
-		free(*buffer);
 		*buffer = NULL;
 		zip_fclose(zfile);
 		return -5;
@@ -365,40 +1103,107 @@ static int zip_get_app_directory(struct zip* zf, char** path)
 	return 0;
 }
 
-static void idevice_event_callback(const idevice_event_t* event, void* userdata)
+/* sums up the uncompressed file sizes from the central directory */
+static void zip_get_totals(struct zip *zf, uint64_t *total_bytes, uint64_t *total_files)
 {
-	if (ignore_events) {
-		return;
+	zip_int64_t i = 0;
+	zip_int64_t c = (zip_int64_t)zip_get_num_entries(zf, 0);
+	struct zip_stat zs;
+
+	*total_bytes = 0;
+	*total_files = 0;
+	for (i = 0; i < c; i++) {
+		zip_stat_init(&zs);
+		if (zip_stat_index(zf, i, 0, &zs) != 0 || !(zs.valid & ZIP_STAT_NAME) || !(zs.valid & ZIP_STAT_SIZE)) {
+			continue;
+		}
+		size_t len = strlen(zs.name);
+		if (len > 0 && zs.name[len-1] == '/') {
+			continue;
+		}
+		*total_bytes += zs.size;
+		(*total_files)++;
 	}
-	if (event->event == IDEVICE_DEVICE_REMOVE) {
+}
+
+/* sums up the sizes of all regular files below path */
+static void dir_get_totals(const char *path, uint64_t *total_bytes, uint64_t *total_files)
+{
+	DIR *dir = opendir(path);
+	if (!dir) {
+		return;
+	}
+	struct dirent* ep;
+	char fpath[PATH_MAX];
+	while ((ep = readdir(dir))) {
+		if ((strcmp(ep->d_name, ".") == 0) || (strcmp(ep->d_name, "..") == 0)) {
+			continue;
+		}
+		if (snprintf(fpath, sizeof(fpath), "%s/%s", path, ep->d_name) >= (int)sizeof(fpath)) {
+			continue;
+		}
+		struct stat st;
+#ifdef HAVE_LSTAT
+		if (lstat(fpath, &st) != 0 || S_ISLNK(st.st_mode)) {
+			continue;
+		}
+#else
+		if (stat(fpath, &st) != 0) {
+			continue;
+		}
+#endif
+		if (S_ISDIR(st.st_mode)) {
+			dir_get_totals(fpath, total_bytes, total_files);
+		} else {
+			*total_bytes += st.st_size;
+			(*total_files)++;
+		}
+	}
+	closedir(dir);
+}
+
+/* device removal while watching the app list, commands check for it in libideviceinstaller */
+static void idevice_event_callback(const idevice_event_t* event, void* userdata)
+{
+	if (ignore_events) {
+		return;
+	}
+	if (event->event == IDEVICE_DEVICE_REMOVE) {
 		if (!strcmp(udid, event->udid)) {
 			fprintf(stderr, "ideviceinstaller: Device removed\n");
 			is_device_connected = 0;
+			metrics_count_disconnect();
 		}
 	}
 }
 
-static void idevice_wait_for_command_to_complete()
+/* a command that could not run, the device reports its own errors to complete_cb() */
+static void command_failed(idi_operation_t op, idi_error_t result)
 {
-	is_device_connected = 1;
-	ignore_events = 0;
+	if (result != IDI_E_OP_FAILED && result != IDI_E_NO_DEVICE) {
+		fprintf(stderr, "ERROR: %s failed: %s\n", idi_operation_get_command(op), idi_strerror(result));
+	}
+	err_occurred = 1;
+}
 
-	/* subscribe to make sure to exit on device removal */
-	idevice_event_subscribe(idevice_event_callback, NULL);
+/*
+ * Waits for the command started on op, started being the result of
+ * starting it, and returns the result of the command.
+ */
+static idi_error_t command_wait(idi_operation_t op, idi_error_t started)
+{
+	idi_error_t result = started;
 
-	/* wait for command to complete */
-	while (wait_for_command_complete && !command_completed && !err_occurred
-		   && is_device_connected) {
-		wait_ms(50);
+	if (started == IDI_E_SUCCESS) {
+		int span = trace_begin("wait for completion", NULL);
+		result = idi_operation_wait(op);
+		trace_end(span);
 	}
-
-	/* wait some time if a notification is expected */
-	while (use_notifier && notification_expected && !notified && !err_occurred && is_device_connected) {
-		wait_ms(50);
+	if (result != IDI_E_SUCCESS) {
+		command_failed(op, result);
 	}
 
-	ignore_events = 1;
-	idevice_event_unsubscribe();
+	return result;
 }
 
 static void print_usage(int argc, char **argv, int is_error)
@@ -419,12 +1224,32 @@ static void print_usage(int argc, char **argv, int is_error)
 	"            (can be passed multiple times)\n"
 	"        -b, --bundle-identifier BUNDLEID  Only query given bundle identifier\n"
 	"            (can be passed multiple times)\n"
-	"  install PATH        Install app from package file specified by PATH.\n"
+	"        --watch         Keep running and print the apps and then every app\n"
+	"            that is added, removed or updated as JSON lines\n"
+	"  install PATH...     Install app from package file specified by PATH.\n"
 	"                      PATH can also be a .ipcc file for carrier bundles.\n"
+	"                      Use - as PATH to read an app package from stdin.\n"
+	"                      With several packages, the next one is uploaded\n"
+	"                      while the current one is being installed.\n"
 	"        -s, --sinf PATH  Pass an external SINF file\n"
 	"        -m, --metadata PATH  Pass an external iTunesMetadata file\n"
-	"  uninstall BUNDLEID  Uninstall app specified by BUNDLEID.\n"
-	"  upgrade PATH        Upgrade app from package file specified by PATH.\n"
+	"        --if-newer      Skip packages not newer than the installed app\n"
+	"        --if-different  Skip packages with the same version as the installed app\n"
+	"        --make-room     Remove staged packages if the packages don't fit into\n"
+	"            the free space of the device\n"
+	"        --no-space-check  Upload even if the packages seem too large for the\n"
+	"            free space of the device\n"
+	"  uninstall BUNDLEID...  Uninstall apps specified by BUNDLEID. Options:\n"
+	"        --match PATTERN  Uninstall all apps with a bundle identifier matching\n"
+	"            PATTERN (* and ? wildcards, can be passed multiple times)\n"
+	"        --uninstall-connections N  Number of apps removed at the same time\n"
+	"            when uninstalling several apps (default 4)\n"
+	"  upgrade PATH...     Upgrade app from package file specified by PATH.\n"
+	"  staging gc          Remove staged packages from the device, oldest first,\n"
+	"                      until the limits below are met (or all without limits)\n"
+	"  plan PATH...        Predict how long installing the packages takes on the\n"
+	"                      connected devices (or the one given with -u) based on\n"
+	"                      the history of earlier runs, longest first\n"
         "\n"
         "LEGACY COMMANDS (non-functional with iOS 7 or later):\n"
 	"  archive BUNDLEID    Archive app specified by BUNDLEID. Options:\n"
@@ -441,8 +1266,32 @@ static void print_usage(int argc, char **argv, int is_error)
 	"OPTIONS:\n"
 	"  -u, --udid UDID     Target specific device by UDID\n"
 	"  -n, --network       Connect to network device\n"
+	"  --auto-transport    Probe USB and network connection of the device and use\n"
+	"                      the faster one for uploads, the quicker one otherwise\n"
 	"  -w, --notify-wait   Wait for app installed/uninstalled notification\n"
 	"                      before reporting success of operation\n"
+	"  --progress-fd FD    Write progress events as JSON lines to file descriptor FD\n"
+	"  --trace FILE        Append a timeline of the run to FILE in Chrome trace\n"
+	"                      event format (can be shared by several processes)\n"
+	"  --metrics-file FILE  Update Prometheus metrics in FILE after the operation\n"
+	"                      (for the node_exporter textfile collector)\n"
+	"  --chunk-size MIN[:MAX]  Bounds for the adaptive AFC transfer chunk size\n"
+	"                      (default 8K:4M), a single value disables adaptation\n"
+	"  --afc-connections N  Number of parallel AFC connections used to upload\n"
+	"                      app directories and carrier bundles (default 4)\n"
+	"  --usb-slots N[:M]   Limit concurrent uploads of all runs to N per USB host\n"
+	"                      controller and M per hub (default N), others wait\n"
+	"                      with the longest expected upload first\n"
+	"  --retries N         Retry transient connection and transfer errors up to N\n"
+	"                      times with increasing delays (default 3, 0 disables)\n"
+	"  --no-cache          Do not use or update the package metadata cache\n"
+	"  --verify            Check the CRC of all entries of a package before upload\n"
+	"  --digest[=N]        Print the SHA-256 of an uploaded package, verify its size\n"
+	"                      on the device and compare N sampled ranges (default 0)\n"
+	"  --staging-quota SIZE  Keep staged packages on the device within SIZE bytes\n"
+	"                      (K/M/G suffixes allowed), applied after install/upgrade\n"
+	"  --staging-max-age AGE  Remove staged packages older than AGE after\n"
+	"                      install/upgrade (seconds, or with suffix m/h/d)\n"
 	"  -h, --help          Print usage information\n"
 	"  -d, --debug         Enable communication debugging\n"
 	"  -v, --version       Print version information\n"
@@ -462,9 +1311,65 @@ enum numerical_opts {
 	ARCHIVE_COPY_PATH,
 	ARCHIVE_COPY_REMOVE,
 	OUTPUT_XML,
-	OUTPUT_JSON
+	OUTPUT_JSON,
+	PROGRESS_FD,
+	CHUNK_SIZE,
+	AFC_CONNECTIONS,
+	NO_CACHE,
+	DIGEST,
+	VERIFY,
+	AUTO_TRANSPORT,
+	STAGING_QUOTA,
+	STAGING_MAX_AGE,
+	MATCH,
+	IF_NEWER,
+	IF_DIFFERENT,
+	TRACE,
+	METRICS_FILE,
+	USB_SLOTS,
+	RETRIES,
+	UNINSTALL_CONNECTIONS,
+	LIST_WATCH,
+	NO_SPACE_CHECK,
+	MAKE_ROOM
 };
 
+/* parse a size value with an optional K, M or G suffix */
+static int parse_size(const char *str, uint64_t *size, char **endp)
+{
+	char *p = NULL;
+	if (!str || *str < '0' || *str > '9') {
+		return -1;
+	}
+	uint64_t val = strtoull(str, &p, 10);
+	switch (*p) {
+	case 'k':
+	case 'K':
+		val *= 1024;
+		p++;
+		break;
+	case 'm':
+	case 'M':
+		val *= 1024 * 1024;
+		p++;
+		break;
+	case 'g':
+	case 'G':
+		val *= 1024 * 1024 * 1024;
+		p++;
+		break;
+	default:
+		break;
+	}
+	if (endp) {
+		*endp = p;
+	} else if (*p != '\0') {
+		return -1;
+	}
+	*size = val;
+	return 0;
+}
+
 static void parse_opts(int argc, char **argv)
 {
 	static struct option longopts[] = {
@@ -488,6 +1393,26 @@ static void parse_opts(int argc, char **argv)
 		{ "docs-only", no_argument, NULL, ARCHIVE_DOCS_ONLY },
 		{ "copy", required_argument, NULL, ARCHIVE_COPY_PATH },
 		{ "remove", no_argument, NULL, ARCHIVE_COPY_REMOVE },
+		{ "progress-fd", required_argument, NULL, PROGRESS_FD },
+		{ "chunk-size", required_argument, NULL, CHUNK_SIZE },
+		{ "afc-connections", required_argument, NULL, AFC_CONNECTIONS },
+		{ "no-cache", no_argument, NULL, NO_CACHE },
+		{ "digest", optional_argument, NULL, DIGEST },
+		{ "verify", no_argument, NULL, VERIFY },
+		{ "auto-transport", no_argument, NULL, AUTO_TRANSPORT },
+		{ "staging-quota", required_argument, NULL, STAGING_QUOTA },
+		{ "staging-max-age", required_argument, NULL, STAGING_MAX_AGE },
+		{ "match", required_argument, NULL, MATCH },
+		{ "if-newer", no_argument, NULL, IF_NEWER },
+		{ "if-different", no_argument, NULL, IF_DIFFERENT },
+		{ "trace", required_argument, NULL, TRACE },
+		{ "metrics-file", required_argument, NULL, METRICS_FILE },
+		{ "usb-slots", required_argument, NULL, USB_SLOTS },
+		{ "retries", required_argument, NULL, RETRIES },
+		{ "uninstall-connections", required_argument, NULL, UNINSTALL_CONNECTIONS },
+		{ "watch", no_argument, NULL, LIST_WATCH },
+		{ "no-space-check", no_argument, NULL, NO_SPACE_CHECK },
+		{ "make-room", no_argument, NULL, MAKE_ROOM },
 		{ NULL, 0, NULL, 0 }
 	};
 	int c;
@@ -563,6 +1488,10 @@ static void parse_opts(int argc, char **argv)
 		case LIST_USER:
 			opt_list_user = 1;
 			break;
+		case LIST_WATCH:
+			opt_list_watch = 1;
+			use_notifier = 1;
+			break;
 		case LIST_SYSTEM:
 			opt_list_system = 1;
 			break;
@@ -593,6 +1522,173 @@ static void parse_opts(int argc, char **argv)
 		case ARCHIVE_COPY_REMOVE:
 			remove_after_copy = 1;
 			break;
+		case PROGRESS_FD: {
+			char *endp = NULL;
+			long fd = strtol(optarg, &endp, 10);
+			if (!*optarg || *endp != '\0' || fd < 0 || fd > INT_MAX) {
+				printf("ERROR: invalid file descriptor '%s' for --progress-fd!\n", optarg);
+				print_usage(argc, argv, 1);
+				exit(2);
+			}
+			progress_fd = (int)fd;
+			} break;
+		case TRACE:
+			if (!*optarg) {
+				printf("ERROR: path for --trace must not be empty!\n");
+				print_usage(argc, argv, 1);
+				exit(2);
+			}
+			free(trace_path);
+			trace_path = strdup(optarg);
+			break;
+		case METRICS_FILE:
+			if (!*optarg) {
+				printf("ERROR: path for --metrics-file must not be empty!\n");
+				print_usage(argc, argv, 1);
+				exit(2);
+			}
+			free(metrics_path);
+			metrics_path = strdup(optarg);
+			break;
+		case USB_SLOTS: {
+			char *endp = NULL;
+			long controller_slots = strtol(optarg, &endp, 10);
+			long hub_slots = controller_slots;
+			if (*endp == ':') {
+				hub_slots = strtol(endp+1, &endp, 10);
+			}
+			if (!*optarg || *endp != '\0' || controller_slots < 1 || controller_slots > 64 || hub_slots < 1 || hub_slots > controller_slots) {
+				printf("ERROR: invalid value '%s' for --usb-slots! Expected N or N:M with 1 <= M <= N <= 64.\n", optarg);
+				print_usage(argc, argv, 1);
+				exit(2);
+			}
+			usb_controller_slots = (int)controller_slots;
+			usb_hub_slots = (int)hub_slots;
+			} break;
+		case CHUNK_SIZE: {
+			char *endp = NULL;
+			uint64_t min = 0;
+			uint64_t max = 0;
+			if (parse_size(optarg, &min, &endp) == 0) {
+				if (*endp == ':') {
+					if (parse_size(endp+1, &max, NULL) < 0) {
+						max = 0;
+					}
+				} else if (*endp == '\0') {
+					max = min;
+				}
+			}
+			if (min < 512 || max < min || max > CHUNK_SIZE_LIMIT) {
+				printf("ERROR: invalid chunk size '%s'! Expected SIZE or MIN:MAX between 512 and %d bytes.\n", optarg, CHUNK_SIZE_LIMIT);
+				print_usage(argc, argv, 1);
+				exit(2);
+			}
+			chunk_size_min = (uint32_t)min;
+			chunk_size_max = (uint32_t)max;
+			} break;
+		case AFC_CONNECTIONS: {
+			char *endp = NULL;
+			long num = strtol(optarg, &endp, 10);
+			if (!*optarg || *endp != '\0' || num < 1 || num > AFC_CONNECTIONS_LIMIT) {
+				printf("ERROR: number of AFC connections must be between 1 and %d!\n", AFC_CONNECTIONS_LIMIT);
+				print_usage(argc, argv, 1);
+				exit(2);
+			}
+			afc_connections = (int)num;
+			} break;
+		case RETRIES: {
+			char *endp = NULL;
+			long num = strtol(optarg, &endp, 10);
+			if (!*optarg || *endp != '\0' || num < 0 || num > RETRIES_LIMIT) {
+				printf("ERROR: number of retries must be between 0 and %d!\n", RETRIES_LIMIT);
+				print_usage(argc, argv, 1);
+				exit(2);
+			}
+			max_retries = (int)num;
+			} break;
+		case UNINSTALL_CONNECTIONS: {
+			char *endp = NULL;
+			long num = strtol(optarg, &endp, 10);
+			if (!*optarg || *endp != '\0' || num < 1 || num > UNINSTALL_CONNECTIONS_LIMIT) {
+				printf("ERROR: number of uninstall connections must be between 1 and %d!\n", UNINSTALL_CONNECTIONS_LIMIT);
+				print_usage(argc, argv, 1);
+				exit(2);
+			}
+			uninstall_connections = (int)num;
+			} break;
+		case NO_CACHE:
+			use_cache = 0;
+			break;
+		case NO_SPACE_CHECK:
+			space_check = 0;
+			break;
+		case MAKE_ROOM:
+			make_room = 1;
+			break;
+		case IF_NEWER:
+			skip_mode = SKIP_IF_NEWER;
+			break;
+		case IF_DIFFERENT:
+			skip_mode = SKIP_IF_DIFFERENT;
+			break;
+		case MATCH:
+			if (!uninstall_patterns) {
+				uninstall_patterns = plist_new_array();
+			}
+			plist_array_append_item(uninstall_patterns, plist_new_string(optarg));
+			break;
+		case VERIFY:
+			verify_package = 1;
+			break;
+		case AUTO_TRANSPORT:
+			auto_transport = 1;
+			break;
+		case DIGEST:
+			use_digest = 1;
+			if (optarg) {
+				char *endp = NULL;
+				long num = strtol(optarg, &endp, 10);
+				if (!*optarg || *endp != '\0' || num < 0 || num > 1024) {
+					printf("ERROR: number of digest samples must be between 0 and 1024!\n");
+					print_usage(argc, argv, 1);
+					exit(2);
+				}
+				digest_samples = (int)num;
+			}
+			break;
+		case STAGING_QUOTA:
+			if (parse_size(optarg, &staging_quota, NULL) < 0) {
+				printf("ERROR: invalid size '%s' for --staging-quota!\n", optarg);
+				print_usage(argc, argv, 1);
+				exit(2);
+			}
+			break;
+		case STAGING_MAX_AGE: {
+			char *endp = NULL;
+			staging_max_age = strtoull(optarg, &endp, 10);
+			switch (*endp) {
+			case 'd':
+				staging_max_age *= 24;
+				/* fall through */
+			case 'h':
+				staging_max_age *= 60;
+				/* fall through */
+			case 'm':
+				staging_max_age *= 60;
+				endp++;
+				break;
+			case 's':
+				endp++;
+				break;
+			default:
+				break;
+			}
+			if (*optarg < '0' || *optarg > '9' || *endp != '\0' || staging_max_age == 0) {
+				printf("ERROR: invalid age '%s' for --staging-max-age!\n", optarg);
+				print_usage(argc, argv, 1);
+				exit(2);
+			}
+			} break;
 		default:
 			print_usage(argc, argv, 1);
 			exit(2);
@@ -626,11 +1722,16 @@ static void parse_opts(int argc, char **argv)
 		cmd = CMD_RESTORE;
 	} else if (!strcmp(cmdstr, "remove-archive")) {
 		cmd = CMD_REMOVE_ARCHIVE;
+	} else if (!strcmp(cmdstr, "staging") && argc > 1 && !strcmp(argv[1], "gc")) {
+		cmd = CMD_STAGING_GC;
+	} else if (!strcmp(cmdstr, "plan")) {
+		cmd = CMD_PLAN;
 	}
 
 	switch (cmd) {
 		case CMD_LIST_APPS:
 		case CMD_LIST_ARCHIVES:
+		case CMD_STAGING_GC:
 			break;
 		case CMD_INSTALL:
 		case CMD_UPGRADE:
@@ -640,8 +1741,44 @@ static void parse_opts(int argc, char **argv)
 				exit(2);
 			}
 			cmdarg = argv[1];
+			cmdargs = &argv[1];
+			num_cmdargs = argc - 1;
+			if (num_cmdargs > 1) {
+				int i;
+				for (i = 0; i < num_cmdargs; i++) {
+					if (!strcmp(cmdargs[i], "-")) {
+						fprintf(stderr, "ERROR: Reading from stdin is only supported for a single package.\n\n");
+						print_usage(argc+optind, argv-optind, 1);
+						exit(2);
+					}
+				}
+				if (extsinf || extmeta) {
+					fprintf(stderr, "ERROR: --sinf and --metadata can only be used with a single package.\n\n");
+					print_usage(argc+optind, argv-optind, 1);
+					exit(2);
+				}
+			}
 			break;
 		case CMD_UNINSTALL:
+			if (argc < 2 && !uninstall_patterns) {
+				fprintf(stderr, "ERROR: Missing bundle ID for '%s' command.\n\n", cmdstr);
+				print_usage(argc+optind, argv-optind, 1);
+				exit(2);
+			}
+			cmdarg = argv[1];
+			cmdargs = &argv[1];
+			num_cmdargs = argc - 1;
+			break;
+		case CMD_PLAN:
+			if (argc < 2) {
+				fprintf(stderr, "ERROR: Missing filename for '%s' command.\n\n", cmdstr);
+				print_usage(argc+optind, argv-optind, 1);
+				exit(2);
+			}
+			cmdarg = argv[1];
+			cmdargs = &argv[1];
+			num_cmdargs = argc - 1;
+			break;
 		case CMD_ARCHIVE:
 		case CMD_RESTORE:
 		case CMD_REMOVE_ARCHIVE:
@@ -657,134 +1794,3553 @@ static void parse_opts(int argc, char **argv)
 			print_usage(argc+optind, argv-optind, 1);
 			exit(2);
 	}
+
+	if (opt_list_watch && (cmd != CMD_LIST_APPS || output_format)) {
+		fprintf(stderr, "ERROR: --watch can only be used with 'list' and not together with --xml or --json.\n\n");
+		print_usage(argc+optind, argv-optind, 1);
+		exit(2);
+	}
 }
 
-static int afc_upload_file(afc_client_t afc, const char* filename, const char* dstfn)
+/*
+ * Retry policy for transient device errors. Errors caused by a broken or
+ * congested connection (timeouts, mux and SSL errors, service limits) are
+ * retried with exponential backoff after reconnecting the affected service
+ * client; all other errors are reported right away.
+ */
+#define RETRY_BASE_DELAY_MS 250
+#define RETRY_MAX_DELAY_MS 8000
+
+static int lockdownd_error_is_transient(lockdownd_error_t err)
 {
-	FILE *f = NULL;
-	uint64_t af = 0;
-	char buf[1048576];
+	switch (err) {
+	case LOCKDOWN_E_SSL_ERROR:
+	case LOCKDOWN_E_RECEIVE_TIMEOUT:
+	case LOCKDOWN_E_MUX_ERROR:
+	case LOCKDOWN_E_SERVICE_LIMIT:
+		return 1;
+	default:
+		return 0;
+	}
+}
 
-	f = fopen(filename, "rb");
-	if (!f) {
-		fprintf(stderr, "fopen: %s: %s\n", filename, strerror(errno));
-		return -1;
+static int instproxy_error_is_transient(instproxy_error_t err)
+{
+	switch (err) {
+	case INSTPROXY_E_CONN_FAILED:
+	case INSTPROXY_E_RECEIVE_TIMEOUT:
+		return 1;
+	default:
+		return 0;
 	}
+}
 
-	if ((afc_file_open(afc, dstfn, AFC_FOPEN_WRONLY, &af) != AFC_E_SUCCESS) || !af) {
-		fclose(f);
-		fprintf(stderr, "afc_file_open on '%s' failed!\n", dstfn);
-		return -1;
+static int afc_error_is_transient(afc_error_t err)
+{
+	switch (err) {
+	case AFC_E_NO_RESOURCES:
+	case AFC_E_SERVICE_NOT_CONNECTED:
+	case AFC_E_OP_TIMEOUT:
+	case AFC_E_OBJECT_BUSY:
+	case AFC_E_OP_WOULD_BLOCK:
+	case AFC_E_OP_INTERRUPTED:
+	case AFC_E_MUX_ERROR:
+	case AFC_E_NOT_ENOUGH_DATA:
+		return 1;
+	default:
+		return 0;
 	}
+}
 
-	size_t amount = 0;
-	do {
-		amount = fread(buf, 1, sizeof(buf), f);
-		if (amount > 0) {
-			uint32_t written, total = 0;
-			while (total < amount) {
-				written = 0;
-				afc_error_t aerr = afc_file_write(afc, af, buf, amount, &written);
-				if (aerr != AFC_E_SUCCESS) {
-					fprintf(stderr, "AFC Write error: %d\n", aerr);
-					break;
-				}
-				total += written;
-			}
-			if (total != amount) {
-				fprintf(stderr, "Error: wrote only %u of %u\n", total, (uint32_t)amount);
-				afc_file_close(afc, af);
-				fclose(f);
+/*
+ * Waits before the next attempt of what after it failed because of reason.
+ * Returns 0 without waiting when all retries are used up. The delay doubles
+ * with every attempt and half of it is random, so that runs sharing a host
+ * or a device don't retry in lockstep.
+ */
+static int retry_wait(int *attempt, const char *what, const char *reason)
+{
+	if (*attempt >= max_retries) {
+		return 0;
+	}
+	uint32_t delay = RETRY_BASE_DELAY_MS << *attempt;
+	if (delay > RETRY_MAX_DELAY_MS) {
+		delay = RETRY_MAX_DELAY_MS;
+	}
+	uint64_t seed = get_monotonic_us() ^ ((uint64_t)getpid() << 32) ^ (uint64_t)(uintptr_t)attempt;
+	seed ^= seed >> 33;
+	seed *= 0xff51afd7ed558ccdULL;
+	seed ^= seed >> 33;
+	delay = delay / 2 + (uint32_t)(seed % (delay / 2 + 1));
+	(*attempt)++;
+
+	fprintf(stderr, "NOTE: %s failed (%s), retrying in %u ms (%d/%d)...\n", what, reason, delay, *attempt, max_retries);
+	trace_instant("retry", what, reason, -1);
+	metrics_count_retry();
+	while (delay > 0) {
+		uint32_t step = (delay > 500) ? 500 : delay;
+		wait_ms(step);
+		delay -= step;
+	}
+	return 1;
+}
+
+/* service client constructors for service_connect, returning 0, 1 for a transient error or -1 */
+static int np_connect(idevice_t device, lockdownd_service_descriptor_t service, void *service_client)
+{
+	np_error_t err = np_client_new(device, service, (np_client_t*)service_client);
+	if (err == NP_E_SUCCESS) {
+		return 0;
+	}
+	return (err == NP_E_CONN_FAILED) ? 1 : -1;
+}
+
+static int instproxy_connect(idevice_t device, lockdownd_service_descriptor_t service, void *service_client)
+{
+	instproxy_error_t err = instproxy_client_new(device, service, (instproxy_client_t*)service_client);
+	if (err == INSTPROXY_E_SUCCESS) {
+		return 0;
+	}
+	return instproxy_error_is_transient(err) ? 1 : -1;
+}
+
+static int afc_connect(idevice_t device, lockdownd_service_descriptor_t service, void *service_client)
+{
+	afc_error_t err = afc_client_new(device, service, (afc_client_t*)service_client);
+	if (err == AFC_E_SUCCESS) {
+		return 0;
+	}
+	return afc_error_is_transient(err) ? 1 : -1;
+}
+
+/* serializes the requests of concurrent service starts on the lockdownd connection */
+static mutex_t lockdownd_mutex;
+
+/*
+ * Starts the service name through lockdownd and connects to it with
+ * connect_func. Transient errors are retried; if the lockdownd connection
+ * itself broke (or *client is NULL) a new one replaces it in *client.
+ */
+static int service_connect(idevice_t device, lockdownd_client_t *client, const char *name, const char *label, int (*connect_func)(idevice_t, lockdownd_service_descriptor_t, void*), void *service_client)
+{
+	lockdownd_service_descriptor_t service = NULL;
+	lockdownd_error_t lerr = LOCKDOWN_E_SUCCESS;
+	int attempt = 0;
+	char what[128];
+
+	snprintf(what, sizeof(what), "Starting %s", name);
+	while (1) {
+		mutex_lock(&lockdownd_mutex);
+		if (!*client) {
+			lerr = lockdownd_client_new_with_handshake(device, client, "ideviceinstaller");
+		}
+		lockdownd_client_t used = *client;
+		if (*client) {
+			lerr = lockdownd_start_service(*client, name, &service);
+		}
+		mutex_unlock(&lockdownd_mutex);
+		if (lerr != LOCKDOWN_E_SUCCESS) {
+			if (!lockdownd_error_is_transient(lerr) || !retry_wait(&attempt, what, lockdownd_strerror(lerr))) {
+				fprintf(stderr, "Could not start %s: %s\n", name, lockdownd_strerror(lerr));
 				return -1;
 			}
+			mutex_lock(&lockdownd_mutex);
+			/* unless another service start replaced it already */
+			if (lerr != LOCKDOWN_E_SERVICE_LIMIT && *client && *client == used) {
+				lockdownd_client_free(*client);
+				*client = NULL;
+			}
+			mutex_unlock(&lockdownd_mutex);
+			continue;
 		}
-	} while (amount > 0);
 
-	afc_file_close(afc, af);
-	fclose(f);
+		int res = connect_func(device, service, service_client);
+		lockdownd_service_descriptor_free(service);
+		service = NULL;
+		if (res == 0) {
+			return 0;
+		}
+		if (res < 0 || !retry_wait(&attempt, what, "connection failed")) {
+			fprintf(stderr, "Could not connect to %s!\n", label);
+			return -1;
+		}
+	}
+}
+
+/* whether the command waits for an app notification (see --notify-wait) */
+static int command_uses_notifier(void)
+{
+	switch (cmd) {
+	case CMD_INSTALL:
+	case CMD_UPGRADE:
+	case CMD_RESTORE:
+		return 1;
+	case CMD_ARCHIVE:
+		return !skip_uninstall;
+	case CMD_LIST_APPS:
+		return opt_list_watch;
+	default:
+		return 0;
+	}
+}
+
+struct service_start {
+	const char *name;
+	const char *label;
+	int (*connect_func)(idevice_t, lockdownd_service_descriptor_t, void*);
+	void *service_client;
+	idevice_t device;
+	lockdownd_client_t *client;
+	THREAD_T thread;
+	int threaded;
+	int res;
+};
 
+static void service_start_add(struct service_start *services, int *num_services, const char *name, const char *label, int (*connect_func)(idevice_t, lockdownd_service_descriptor_t, void*), void *service_client)
+{
+	struct service_start *svc = &services[(*num_services)++];
+	memset(svc, 0, sizeof(struct service_start));
+	svc->name = name;
+	svc->label = label;
+	svc->connect_func = connect_func;
+	svc->service_client = service_client;
+}
+
+static void* service_start_thread(void *arg)
+{
+	struct service_start *svc = (struct service_start*)arg;
+	svc->res = service_connect(svc->device, svc->client, svc->name, svc->label, svc->connect_func, svc->service_client);
+	if (svc->res == 0) {
+		trace_instant("service ready", svc->label, svc->name, -1);
+	}
+	return NULL;
+}
+
+/*
+ * Starts the services at the same time. Their requests to lockdownd share
+ * the one connection, but the connections to the services themselves are
+ * set up in parallel, so getting ready takes about as long as the slowest
+ * service instead of all of them together. Returns -1 if any failed.
+ */
+static int services_start(idevice_t device, lockdownd_client_t *client, struct service_start *services, int num_services)
+{
+	int i, res = 0;
+
+	for (i = 0; i < num_services; i++) {
+		services[i].device = device;
+		services[i].client = client;
+		/* the last one runs on this thread */
+		if (i+1 < num_services && thread_new(&services[i].thread, service_start_thread, &services[i]) == 0) {
+			services[i].threaded = 1;
+		} else {
+			service_start_thread(&services[i]);
+		}
+	}
+	for (i = 0; i < num_services; i++) {
+		if (services[i].threaded) {
+			thread_join(services[i].thread);
+			thread_free(services[i].thread);
+		}
+		if (services[i].res < 0) {
+			res = -1;
+		}
+	}
+
+	return res;
+}
+
+struct afc_transfer {
+	struct chunk_tuner ct;
+	char *buf;
+	/* used to reconnect AFC after a transient error, NULL disables retries */
+	idevice_t device;
+};
+
+static int afc_transfer_init(struct afc_transfer *xfer, idevice_t device, uint32_t initial_size)
+{
+	chunk_tuner_init(&xfer->ct, initial_size, chunk_size_min, chunk_size_max);
+	xfer->device = device;
+	xfer->buf = io_buffer_get();
+	if (!xfer->buf) {
+		fprintf(stderr, "ERROR: Out of memory allocating transfer buffer!\n");
+		return -1;
+	}
 	return 0;
 }
 
-static void afc_upload_dir(afc_client_t afc, const char* path, const char* afcpath)
+static void afc_transfer_free(struct afc_transfer *xfer)
 {
-	afc_make_directory(afc, afcpath);
+	io_buffer_put(xfer->buf);
+	xfer->buf = NULL;
+}
 
-	DIR *dir = opendir(path);
-	if (dir) {
-		struct dirent* ep;
-		while ((ep = readdir(dir))) {
-			if ((strcmp(ep->d_name, ".") == 0) || (strcmp(ep->d_name, "..") == 0)) {
-				continue;
+/*
+ * Replaces *afc with a new connection after the transient error aerr and
+ * opens dstfn again with mode. Files opened for appending are cut back to
+ * offset, the end of the data known to be written completely.
+ */
+static afc_error_t afc_transfer_reconnect(afc_client_t *afc, struct afc_transfer *xfer, const char *dstfn, afc_file_mode_t mode, uint64_t offset, uint64_t *af, afc_error_t aerr, int *attempt)
+{
+	char reason[512];
+
+	while (xfer->device && afc_error_is_transient(aerr)) {
+		snprintf(reason, sizeof(reason), "error %d on %s", aerr, dstfn);
+		if (!retry_wait(attempt, "AFC transfer", reason)) {
+			break;
+		}
+		afc_client_t new_afc = NULL;
+		aerr = afc_client_start_service(xfer->device, &new_afc, "ideviceinstaller");
+		if (aerr != AFC_E_SUCCESS) {
+			continue;
+		}
+		/* the open file handle goes away with the old connection */
+		afc_client_free(*afc);
+		*afc = new_afc;
+		*af = 0;
+		aerr = afc_file_open(*afc, dstfn, mode, af);
+		if (aerr == AFC_E_SUCCESS && mode == AFC_FOPEN_RW) {
+			aerr = afc_file_truncate(*afc, *af, offset);
+			if (aerr == AFC_E_SUCCESS) {
+				aerr = afc_file_seek(*afc, *af, (int64_t)offset, SEEK_SET);
 			}
-			char *fpath = (char*)malloc(strlen(path)+1+strlen(ep->d_name)+1);
-			char *apath = (char*)malloc(strlen(afcpath)+1+strlen(ep->d_name)+1);
+		}
+		if (aerr == AFC_E_SUCCESS) {
+			break;
+		}
+	}
+	return aerr;
+}
 
-			struct stat st;
+/* opens dstfn for writing, retrying transient errors */
+static afc_error_t afc_transfer_open(afc_client_t *afc, struct afc_transfer *xfer, const char *dstfn, uint64_t *af)
+{
+	int attempt = 0;
+	*af = 0;
+	afc_error_t aerr = afc_file_open(*afc, dstfn, AFC_FOPEN_WRONLY, af);
+	if (aerr != AFC_E_SUCCESS) {
+		aerr = afc_transfer_reconnect(afc, xfer, dstfn, AFC_FOPEN_WRONLY, 0, af, aerr, &attempt);
+	}
+	return aerr;
+}
 
-			strcpy(fpath, path);
-			strcat(fpath, "/");
-			strcat(fpath, ep->d_name);
+/*
+ * write the whole chunk in xfer->buf to the AFC file handle *af of dstfn,
+ * where it starts at offset. After a transient error the file is reopened
+ * on a new connection and the chunk is sent again.
+ */
+static int afc_transfer_write(afc_client_t *afc, struct afc_transfer *xfer, uint64_t *af, const char *dstfn, uint64_t offset, uint32_t amount)
+{
+	uint32_t written, total = 0;
+	int attempt = 0;
+	chunk_tuner_begin(&xfer->ct);
+	while (total < amount) {
+		written = 0;
+		afc_error_t aerr = afc_file_write(*afc, *af, xfer->buf + total, amount - total, &written);
+		if (aerr != AFC_E_SUCCESS) {
+			if (afc_transfer_reconnect(afc, xfer, dstfn, AFC_FOPEN_RW, offset, af, aerr, &attempt) == AFC_E_SUCCESS) {
+				total = 0;
+				continue;
+			}
+			fprintf(stderr, "AFC Write error: %d\n", aerr);
+			break;
+		}
+		total += written;
+	}
+	chunk_tuner_end(&xfer->ct, total);
+	progress_transfer_add(total);
+	if (total != amount) {
+		fprintf(stderr, "Error: wrote only %u of %u\n", total, amount);
+		return -1;
+	}
+	return 0;
+}
 
-			strcpy(apath, afcpath);
-			strcat(apath, "/");
-			strcat(apath, ep->d_name);
+/* copies everything from f to dstfn on the device, optionally hashing the data on the way */
+static int afc_upload_stream(afc_client_t *afc, struct afc_transfer *xfer, FILE *f, const char* dstfn, sha256_ctx *digest, uint64_t *size)
+{
+	uint64_t af = 0;
+	uint64_t total = 0;
+	int res = 0;
 
-#ifdef HAVE_LSTAT
-			if ((lstat(fpath, &st) == 0) && S_ISLNK(st.st_mode)) {
-				char *target = (char *)malloc(st.st_size+1);
-				if (readlink(fpath, target, st.st_size+1) < 0) {
+	if ((afc_transfer_open(afc, xfer, dstfn, &af) != AFC_E_SUCCESS) || !af) {
+		fprintf(stderr, "afc_file_open on '%s' failed!\n", dstfn);
+		return -1;
+	}
+
+	size_t amount = 0;
+	do {
+		amount = fread(xfer->buf, 1, xfer->ct.size, f);
+		if (amount == 0) {
+			break;
+		}
+		if (digest) {
+			sha256_update(digest, xfer->buf, amount);
+		}
+		if (afc_transfer_write(afc, xfer, &af, dstfn, total, (uint32_t)amount) < 0) {
+			res = -1;
+			break;
+		}
+		total += amount;
+	} while (1);
+	if (ferror(f)) {
+		fprintf(stderr, "ERROR: read error: %s\n", strerror(errno));
+		res = -1;
+	}
+
+	afc_file_close(*afc, af);
+	if (size) {
+		*size = total;
+	}
+
+	return res;
+}
+
+/* size of the ranges read back from the device by afc_verify_upload() */
+#define DIGEST_SAMPLE_SIZE 65536
+
+/*
+ * Checks that the file uploaded to dstfn has the expected size and, if a
+ * local file f is given, compares sample ranges spread evenly over the file
+ * (always including the start and the end) with the local data.
+ */
+static int afc_verify_upload(afc_client_t afc, const char *dstfn, FILE *f, uint64_t size, int samples)
+{
+	char **info = NULL;
+	uint64_t remote_size = 0;
+	int have_size = 0;
+	int i, res = 0;
+
+	if (afc_get_file_info(afc, dstfn, &info) != AFC_E_SUCCESS || !info) {
+		fprintf(stderr, "ERROR: Could not get file info for '%s' from device\n", dstfn);
+		return -1;
+	}
+	for (i = 0; info[i] && info[i+1]; i += 2) {
+		if (!strcmp(info[i], "st_size")) {
+			remote_size = strtoull(info[i+1], NULL, 10);
+			have_size = 1;
+		}
+	}
+	afc_dictionary_free(info);
+	if (!have_size || remote_size != size) {
+		fprintf(stderr, "ERROR: Size mismatch for '%s': %" PRIu64 " bytes on device, expected %" PRIu64 "\n", dstfn, remote_size, size);
+		return -1;
+	}
+	if (!f || samples <= 0 || size == 0) {
+		return 0;
+	}
+
+	uint64_t af = 0;
+	if (afc_file_open(afc, dstfn, AFC_FOPEN_RDONLY, &af) != AFC_E_SUCCESS) {
+		fprintf(stderr, "ERROR: can't open afc://%s for reading\n", dstfn);
+		return -1;
+	}
+	char *remote = (char*)malloc(DIGEST_SAMPLE_SIZE);
+	char *local = (char*)malloc(DIGEST_SAMPLE_SIZE);
+	uint32_t len = (size < DIGEST_SAMPLE_SIZE) ? (uint32_t)size : DIGEST_SAMPLE_SIZE;
+	for (i = 0; remote && local && i < samples && res == 0; i++) {
+		uint64_t offset = (samples > 1) ? ((size - len) * i) / (samples - 1) : 0;
+		uint32_t got = 0;
+		if (afc_file_seek(afc, af, (int64_t)offset, SEEK_SET) != AFC_E_SUCCESS) {
+			res = -1;
+			break;
+		}
+		while (got < len) {
+			uint32_t bytes = 0;
+			if (afc_file_read(afc, af, remote + got, len - got, &bytes) != AFC_E_SUCCESS || bytes == 0) {
+				break;
+			}
+			got += bytes;
+		}
+		if (got != len || fseeko(f, (off_t)offset, SEEK_SET) != 0 || fread(local, 1, len, f) != len || memcmp(remote, local, len) != 0) {
+			fprintf(stderr, "ERROR: Content mismatch for '%s' at offset %" PRIu64 "\n", dstfn, offset);
+			res = -1;
+		}
+	}
+	if (!remote || !local) {
+		fprintf(stderr, "ERROR: Out of memory!?\n");
+		res = -1;
+	}
+	free(remote);
+	free(local);
+	afc_file_close(afc, af);
+
+	return res;
+}
+
+static int afc_upload_file(afc_client_t *afc, struct afc_transfer *xfer, const char* filename, const char* dstfn)
+{
+	FILE *f = fopen(filename, "rb");
+	if (!f) {
+		fprintf(stderr, "fopen: %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	int res = afc_upload_stream(afc, xfer, f, dstfn, NULL, NULL);
+	fclose(f);
+	return res;
+}
+
+static int afc_upload_zip_entry(afc_client_t *afc, struct afc_transfer *xfer, struct zip *zf, zip_uint64_t zindex, const char* dstfn)
+{
+	uint64_t af = 0;
+	int res = 0;
+
+	struct zip_stat zs;
+	zip_stat_init(&zs);
+	if (zip_stat_index(zf, zindex, 0, &zs) != 0) {
+		fprintf(stderr, "ERROR: zip_stat_index %" PRIu64 " failed!\n", (uint64_t)zindex);
+		return -1;
+	}
+
+	struct zip_file* zfile = zip_fopen_index(zf, zindex, 0);
+	if (!zfile) {
+		fprintf(stderr, "ERROR: zip_fopen_index %" PRIu64 " failed!\n", (uint64_t)zindex);
+		return -1;
+	}
+
+	if ((afc_transfer_open(afc, xfer, dstfn, &af) != AFC_E_SUCCESS) || !af) {
+		fprintf(stderr, "ERROR: can't open afc://%s for writing\n", dstfn);
+		zip_fclose(zfile);
+		return -1;
+	}
+
+	zip_uint64_t zfsize = 0;
+	while (zfsize < zs.size) {
+		zip_int64_t amount = zip_fread(zfile, xfer->buf, xfer->ct.size);
+		if (amount == 0) {
+			break;
+		}
+		if (amount < 0) {
+			fprintf(stderr, "ERROR: zip_fread failed for '%s': %s\n", zs.name, zip_file_strerror(zfile));
+			res = -1;
+			break;
+		}
+		if (afc_transfer_write(afc, xfer, &af, dstfn, zfsize, (uint32_t)amount) < 0) {
+			res = -1;
+			break;
+		}
+		zfsize += amount;
+	}
+
+	afc_file_close(*afc, af);
+	zip_fclose(zfile);
+
+	return res;
+}
+
+/*
+ * A read-only libzip source on top of a file on the device, used to parse a
+ * package that was streamed to the device without a local copy. Reads are
+ * served from a cache block so that libzip's small reads of headers and the
+ * central directory don't turn into one AFC round-trip each.
+ */
+#define AFC_ZIP_SOURCE_CACHE_SIZE 262144
+
+struct afc_zip_source {
+	afc_client_t afc;
+	uint64_t handle;
+	uint64_t size;
+	uint64_t offset;
+	zip_error_t error;
+	char *cache;
+	uint64_t cache_offset;
+	uint32_t cache_len;
+};
+
+static zip_int64_t afc_zip_source_read(struct afc_zip_source *src, char *data, zip_uint64_t len)
+{
+	zip_uint64_t done = 0;
+	while (done < len && src->offset < src->size) {
+		if (src->offset < src->cache_offset || src->offset >= src->cache_offset + src->cache_len) {
+			/* refill the cache block at the current offset */
+			src->cache_offset = src->offset;
+			src->cache_len = 0;
+			if (afc_file_seek(src->afc, src->handle, (int64_t)src->offset, SEEK_SET) != AFC_E_SUCCESS) {
+				zip_error_set(&src->error, ZIP_ER_SEEK, EIO);
+				return -1;
+			}
+			while (src->cache_len < AFC_ZIP_SOURCE_CACHE_SIZE) {
+				uint32_t bytes = 0;
+				if (afc_file_read(src->afc, src->handle, src->cache + src->cache_len, AFC_ZIP_SOURCE_CACHE_SIZE - src->cache_len, &bytes) != AFC_E_SUCCESS) {
+					zip_error_set(&src->error, ZIP_ER_READ, EIO);
+					return -1;
+				}
+				if (bytes == 0) {
+					break;
+				}
+				src->cache_len += bytes;
+			}
+			if (src->cache_len == 0) {
+				break;
+			}
+		}
+		uint64_t avail = src->cache_offset + src->cache_len - src->offset;
+		if (avail > len - done) {
+			avail = len - done;
+		}
+		memcpy(data + done, src->cache + (src->offset - src->cache_offset), avail);
+		src->offset += avail;
+		done += avail;
+	}
+	return (zip_int64_t)done;
+}
+
+static zip_int64_t afc_zip_source_cb(void *userdata, void *data, zip_uint64_t len, zip_source_cmd_t zcmd)
+{
+	struct afc_zip_source *src = (struct afc_zip_source*)userdata;
+
+	switch (zcmd) {
+	case ZIP_SOURCE_OPEN:
+		src->offset = 0;
+		return 0;
+	case ZIP_SOURCE_READ:
+		return afc_zip_source_read(src, (char*)data, len);
+	case ZIP_SOURCE_CLOSE:
+		return 0;
+	case ZIP_SOURCE_STAT: {
+		zip_stat_t *st = ZIP_SOURCE_GET_ARGS(zip_stat_t, data, len, &src->error);
+		if (!st) {
+			return -1;
+		}
+		zip_stat_init(st);
+		st->size = src->size;
+		st->valid |= ZIP_STAT_SIZE;
+		return sizeof(zip_stat_t);
+	}
+	case ZIP_SOURCE_ERROR:
+		return zip_error_to_data(&src->error, data, len);
+	case ZIP_SOURCE_FREE:
+		afc_file_close(src->afc, src->handle);
+		zip_error_fini(&src->error);
+		free(src->cache);
+		free(src);
+		return 0;
+	case ZIP_SOURCE_SEEK: {
+		zip_source_args_seek_t *args = ZIP_SOURCE_GET_ARGS(zip_source_args_seek_t, data, len, &src->error);
+		int64_t new_offset;
+		if (!args) {
+			return -1;
+		}
+		switch (args->whence) {
+		case SEEK_SET:
+			new_offset = args->offset;
+			break;
+		case SEEK_CUR:
+			new_offset = (int64_t)src->offset + args->offset;
+			break;
+		case SEEK_END:
+			new_offset = (int64_t)src->size + args->offset;
+			break;
+		default:
+			new_offset = -1;
+			break;
+		}
+		if (new_offset < 0 || (uint64_t)new_offset > src->size) {
+			zip_error_set(&src->error, ZIP_ER_INVAL, 0);
+			return -1;
+		}
+		src->offset = (uint64_t)new_offset;
+		return 0;
+	}
+	case ZIP_SOURCE_TELL:
+		return (zip_int64_t)src->offset;
+	case ZIP_SOURCE_SUPPORTS:
+		return zip_source_make_command_bitmap(ZIP_SOURCE_OPEN, ZIP_SOURCE_READ, ZIP_SOURCE_CLOSE, ZIP_SOURCE_STAT, ZIP_SOURCE_ERROR, ZIP_SOURCE_FREE, ZIP_SOURCE_SEEK, ZIP_SOURCE_TELL, ZIP_SOURCE_SUPPORTS, -1);
+	default:
+		zip_error_set(&src->error, ZIP_ER_OPNOTSUPP, 0);
+		return -1;
+	}
+}
+
+/* opens the archive at path on the device with libzip */
+static struct zip *afc_zip_open(afc_client_t afc, const char *path, uint64_t size)
+{
+	struct afc_zip_source *src = (struct afc_zip_source*)calloc(1, sizeof(struct afc_zip_source));
+	zip_error_t zerr;
+	zip_source_t *zs = NULL;
+	struct zip *zf = NULL;
+
+	if (!src || !(src->cache = (char*)malloc(AFC_ZIP_SOURCE_CACHE_SIZE))) {
+		fprintf(stderr, "ERROR: Out of memory!?\n");
+		free(src);
+		return NULL;
+	}
+	if (afc_file_open(afc, path, AFC_FOPEN_RDONLY, &src->handle) != AFC_E_SUCCESS) {
+		fprintf(stderr, "ERROR: can't open afc://%s for reading\n", path);
+		free(src->cache);
+		free(src);
+		return NULL;
+	}
+	src->afc = afc;
+	src->size = size;
+	zip_error_init(&src->error);
+
+	zip_error_init(&zerr);
+	zs = zip_source_function_create(afc_zip_source_cb, src, &zerr);
+	if (!zs) {
+		afc_zip_source_cb(src, NULL, 0, ZIP_SOURCE_FREE);
+	} else {
+		zf = zip_open_from_source(zs, ZIP_RDONLY, &zerr);
+		if (!zf) {
+			zip_source_free(zs);
+		}
+	}
+	if (!zf) {
+		fprintf(stderr, "ERROR: zip_open: afc://%s: %s\n", path, zip_error_strerror(&zerr));
+	}
+	zip_error_fini(&zerr);
+	return zf;
+}
+
+/*
+ * Uploading bundles and carrier bundles means uploading lots of tiny files,
+ * where the open/write/close round-trips dominate the actual transfer.
+ * The upload queue distributes the files over a number of worker threads
+ * with their own AFC connection so that several files are in flight at the
+ * same time. The producer creates directories and links in order before
+ * queueing the files inside of them, and helps draining the queue when it
+ * is done. Jobs and their paths live in the queue's arena.
+ */
+struct upload_job {
+	struct upload_job *next;
+	const char *srcpath;
+	zip_uint64_t zindex;
+	const char *dstpath;
+};
+
+struct upload_queue {
+	mutex_t mutex;
+	cond_t cond;
+	struct upload_job *first;
+	struct upload_job *last;
+	int finished;
+	int errors;
+	idevice_t device;
+	const char *archive;
+	afc_client_t *afc;
+	struct zip *zf;
+	struct afc_transfer xfer;
+	struct mem_arena arena;
+	int num_workers;
+	THREAD_T *workers;
+};
+
+static int upload_job_run(afc_client_t *afc, struct zip *zf, struct afc_transfer *xfer, struct upload_job *job)
+{
+	if (job->srcpath) {
+		return afc_upload_file(afc, xfer, job->srcpath, job->dstpath);
+	}
+	return afc_upload_zip_entry(afc, xfer, zf, job->zindex, job->dstpath);
+}
+
+static struct upload_job *upload_queue_next(struct upload_queue *queue, int wait)
+{
+	struct upload_job *job = NULL;
+	mutex_lock(&queue->mutex);
+	while (!queue->first && !queue->finished && wait) {
+		cond_wait(&queue->cond, &queue->mutex);
+	}
+	job = queue->first;
+	if (job) {
+		queue->first = job->next;
+		if (!queue->first) {
+			queue->last = NULL;
+		}
+	}
+	mutex_unlock(&queue->mutex);
+	return job;
+}
+
+static void upload_queue_job_done(struct upload_queue *queue, int res)
+{
+	if (res < 0) {
+		mutex_lock(&queue->mutex);
+		queue->errors++;
+		mutex_unlock(&queue->mutex);
+	} else {
+		progress_transfer_file_done();
+	}
+}
+
+static void* upload_worker_thread(void *arg)
+{
+	struct upload_queue *queue = (struct upload_queue*)arg;
+	afc_client_t afc = NULL;
+	struct zip *zf = NULL;
+	struct afc_transfer xfer;
+	struct upload_job *job;
+
+	if (afc_client_start_service(queue->device, &afc, "ideviceinstaller") != AFC_E_SUCCESS) {
+		/* the remaining connections (and the producer) will do the work */
+		return NULL;
+	}
+	if (queue->archive) {
+		int errp = 0;
+		zf = zip_open(queue->archive, 0, &errp);
+		if (!zf) {
+			afc_client_free(afc);
+			return NULL;
+		}
+	}
+	if (afc_transfer_init(&xfer, queue->device, 8192) < 0) {
+		if (zf) {
+			zip_close(zf);
+		}
+		afc_client_free(afc);
+		return NULL;
+	}
+
+	while ((job = upload_queue_next(queue, 1))) {
+		upload_queue_job_done(queue, upload_job_run(&afc, zf, &xfer, job));
+	}
+
+	afc_transfer_free(&xfer);
+	if (zf) {
+		zip_close(zf);
+	}
+	afc_client_free(afc);
+	return NULL;
+}
+
+static int upload_queue_init(struct upload_queue *queue, idevice_t device, afc_client_t *afc, struct zip *zf, const char *archive)
+{
+	memset(queue, 0, sizeof(struct upload_queue));
+	if (afc_transfer_init(&queue->xfer, device, 8192) < 0) {
+		return -1;
+	}
+	mutex_init(&queue->mutex);
+	cond_init(&queue->cond);
+	queue->device = device;
+	queue->afc = afc;
+	queue->zf = zf;
+	queue->archive = archive;
+
+	if (afc_connections > 1) {
+		int i;
+		queue->workers = (THREAD_T*)calloc(afc_connections, sizeof(THREAD_T));
+		for (i = 0; queue->workers && i < afc_connections; i++) {
+			if (thread_new(&queue->workers[queue->num_workers], upload_worker_thread, queue) == 0) {
+				queue->num_workers++;
+			}
+		}
+	}
+	return 0;
+}
+
+/* srcpath and dstpath have to be allocated from the queue's arena */
+static void upload_queue_add(struct upload_queue *queue, const char *srcpath, zip_uint64_t zindex, const char *dstpath)
+{
+	struct upload_job *job = (struct upload_job*)arena_alloc(&queue->arena, sizeof(struct upload_job));
+	if (!job || !dstpath) {
+		mutex_lock(&queue->mutex);
+		queue->errors++;
+		mutex_unlock(&queue->mutex);
+		return;
+	}
+	job->next = NULL;
+	job->srcpath = srcpath;
+	job->zindex = zindex;
+	job->dstpath = dstpath;
+
+	if (queue->num_workers == 0) {
+		upload_queue_job_done(queue, upload_job_run(queue->afc, queue->zf, &queue->xfer, job));
+		return;
+	}
+
+	mutex_lock(&queue->mutex);
+	if (queue->last) {
+		queue->last->next = job;
+	} else {
+		queue->first = job;
+	}
+	queue->last = job;
+	cond_signal(&queue->cond);
+	mutex_unlock(&queue->mutex);
+}
+
+/* drains the queue, stops the workers and returns the number of failed uploads */
+static int upload_queue_finish(struct upload_queue *queue)
+{
+	struct upload_job *job;
+	int i;
+
+	mutex_lock(&queue->mutex);
+	queue->finished = 1;
+	mutex_unlock(&queue->mutex);
+	for (i = 0; i < queue->num_workers; i++) {
+		mutex_lock(&queue->mutex);
+		cond_signal(&queue->cond);
+		mutex_unlock(&queue->mutex);
+	}
+
+	while ((job = upload_queue_next(queue, 0))) {
+		upload_queue_job_done(queue, upload_job_run(queue->afc, queue->zf, &queue->xfer, job));
+	}
+
+	for (i = 0; i < queue->num_workers; i++) {
+		thread_join(queue->workers[i]);
+		thread_free(queue->workers[i]);
+	}
+	free(queue->workers);
+	queue->workers = NULL;
+	queue->num_workers = 0;
+
+	cond_destroy(&queue->cond);
+	mutex_destroy(&queue->mutex);
+	afc_transfer_free(&queue->xfer);
+	arena_free(&queue->arena);
+
+	return queue->errors;
+}
+
+static void afc_upload_dir(struct upload_queue *queue, const char* path, const char* afcpath)
+{
+	afc_make_directory(*queue->afc, afcpath);
+
+	DIR *dir = opendir(path);
+	if (dir) {
+		struct dirent* ep;
+		while ((ep = readdir(dir))) {
+			if ((strcmp(ep->d_name, ".") == 0) || (strcmp(ep->d_name, "..") == 0)) {
+				continue;
+			}
+			char *fpath = arena_build_path(&queue->arena, path, ep->d_name, NULL);
+			char *apath = arena_build_path(&queue->arena, afcpath, ep->d_name, NULL);
+			if (!fpath || !apath) {
+				fprintf(stderr, "ERROR: Out of memory!?\n");
+				break;
+			}
+
+			struct stat st;
+
+#ifdef HAVE_LSTAT
+			if ((lstat(fpath, &st) == 0) && S_ISLNK(st.st_mode)) {
+				char target[PATH_MAX];
+				ssize_t tlen = readlink(fpath, target, sizeof(target)-1);
+				if (tlen < 0) {
 					fprintf(stderr, "ERROR: readlink: %s (%d)\n", strerror(errno), errno);
 				} else {
-					target[st.st_size] = '\0';
-					afc_make_link(afc, AFC_SYMLINK, target, fpath);
+					target[tlen] = '\0';
+					afc_make_link(*queue->afc, AFC_SYMLINK, target, apath);
 				}
-				free(target);
 			} else
 #endif
 			if ((stat(fpath, &st) == 0) && S_ISDIR(st.st_mode)) {
-				afc_upload_dir(afc, fpath, apath);
+				afc_upload_dir(queue, fpath, apath);
 			} else {
-				afc_upload_file(afc, fpath, apath);
+				upload_queue_add(queue, fpath, 0, apath);
+			}
+		}
+		closedir(dir);
+	}
+}
+
+static char *buf_from_file(const char *filename, size_t *size)
+{
+	struct stat st;
+	FILE *fp = NULL;
+
+	if (stat(filename, &st) == -1 || (fp = fopen(filename, "r")) == NULL) {
+		return NULL;
+	}
+	size_t filesize = st.st_size;
+	if (filesize == 0) {
+		return NULL;
+	}
+	char *ibuf = malloc(filesize * sizeof(char));
+	if (ibuf == NULL) {
+		return NULL;
+	}
+	size_t amount = fread(ibuf, 1, filesize, fp);
+	if (amount != filesize) {
+		fprintf(stderr, "ERROR: could not read %" PRIu64 " bytes from %s\n", (uint64_t)filesize, filename);
+		free(ibuf);
+		return NULL;
+	}
+	fclose(fp);
+
+	if (size) {
+		*size = filesize;
+	}
+
+	return ibuf;
+}
+
+/* an entry (package file or directory) in the staging directory on the device */
+struct staging_entry {
+	char *path;
+	uint64_t size;
+	uint64_t mtime;
+};
+
+struct staging_gc {
+	mutex_t mutex;
+	idevice_t device;
+	struct staging_entry *victims;
+	int num_victims;
+	int next;
+	int errors;
+	uint64_t freed;
+};
+
+/* gets type, size (recursive for directories) and mtime (in seconds) of an AFC path */
+static int afc_get_path_info(afc_client_t afc, const char *path, int *is_dir, uint64_t *size, uint64_t *mtime)
+{
+	char **info = NULL;
+	int i;
+
+	*is_dir = 0;
+	*size = 0;
+	if (afc_get_file_info(afc, path, &info) != AFC_E_SUCCESS || !info) {
+		return -1;
+	}
+	for (i = 0; info[i] && info[i+1]; i += 2) {
+		if (!strcmp(info[i], "st_ifmt")) {
+			*is_dir = !strcmp(info[i+1], "S_IFDIR");
+		} else if (!strcmp(info[i], "st_size")) {
+			*size = strtoull(info[i+1], NULL, 10);
+		} else if (mtime && !strcmp(info[i], "st_mtime")) {
+			*mtime = strtoull(info[i+1], NULL, 10) / 1000000000;
+		}
+	}
+	afc_dictionary_free(info);
+
+	if (*is_dir) {
+		char **list = NULL;
+		*size = 0;
+		if (afc_read_directory(afc, path, &list) == AFC_E_SUCCESS && list) {
+			for (i = 0; list[i]; i++) {
+				int sub_dir = 0;
+				uint64_t sub_size = 0;
+				char *sub_path = NULL;
+				if (!strcmp(list[i], ".") || !strcmp(list[i], "..")) {
+					continue;
+				}
+				if (asprintf(&sub_path, "%s/%s", path, list[i]) < 0) {
+					continue;
+				}
+				if (afc_get_path_info(afc, sub_path, &sub_dir, &sub_size, NULL) == 0) {
+					*size += sub_size;
+				}
+				free(sub_path);
+			}
+			afc_dictionary_free(list);
+		}
+	}
+	return 0;
+}
+
+static int staging_entry_cmp(const void *a, const void *b)
+{
+	const struct staging_entry *ea = (const struct staging_entry*)a;
+	const struct staging_entry *eb = (const struct staging_entry*)b;
+	if (ea->mtime != eb->mtime) {
+		return (ea->mtime < eb->mtime) ? -1 : 1;
+	}
+	return strcmp(ea->path, eb->path);
+}
+
+static void staging_gc_run(struct staging_gc *gc, afc_client_t afc)
+{
+	while (1) {
+		struct staging_entry *entry = NULL;
+		mutex_lock(&gc->mutex);
+		if (gc->next < gc->num_victims) {
+			entry = &gc->victims[gc->next++];
+		}
+		mutex_unlock(&gc->mutex);
+		if (!entry) {
+			break;
+		}
+		afc_error_t aerr = afc_remove_path_and_contents(afc, entry->path);
+		mutex_lock(&gc->mutex);
+		if (aerr == AFC_E_SUCCESS) {
+			gc->freed += entry->size;
+		} else {
+			fprintf(stderr, "WARNING: Could not remove '%s' from device: %d\n", entry->path, aerr);
+			gc->errors++;
+		}
+		mutex_unlock(&gc->mutex);
+	}
+}
+
+static void* staging_gc_thread(void *arg)
+{
+	struct staging_gc *gc = (struct staging_gc*)arg;
+	afc_client_t afc = NULL;
+
+	if (afc_client_start_service(gc->device, &afc, "ideviceinstaller") != AFC_E_SUCCESS) {
+		return NULL;
+	}
+	staging_gc_run(gc, afc);
+	afc_client_free(afc);
+	return NULL;
+}
+
+/*
+ * Removes entries from the staging directory that are older than max_age
+ * seconds (0 for no age limit), then the oldest remaining entries until the
+ * total size of the staging directory is within quota and at least min_free
+ * bytes were removed. Returns the number of entries that could not be
+ * removed.
+ */
+static int staging_gc(idevice_t device, afc_client_t afc, uint64_t quota, uint64_t max_age, uint64_t min_free)
+{
+	struct staging_entry *entries = NULL;
+	struct staging_gc gc;
+	char **list = NULL;
+	int num_entries = 0;
+	uint64_t total = 0;
+	uint64_t now = (uint64_t)time(NULL);
+	int i;
+
+	if (afc_read_directory(afc, PKG_PATH, &list) != AFC_E_SUCCESS || !list) {
+		/* nothing staged */
+		return 0;
+	}
+	for (i = 0; list[i]; i++);
+	entries = (struct staging_entry*)calloc(i, sizeof(struct staging_entry));
+	for (i = 0; entries && list[i]; i++) {
+		struct staging_entry *entry = &entries[num_entries];
+		int is_dir = 0;
+		if (!strcmp(list[i], ".") || !strcmp(list[i], "..")) {
+			continue;
+		}
+		if (asprintf(&entry->path, "%s/%s", PKG_PATH, list[i]) < 0) {
+			entry->path = NULL;
+			continue;
+		}
+		if (afc_get_path_info(afc, entry->path, &is_dir, &entry->size, &entry->mtime) < 0) {
+			free(entry->path);
+			entry->path = NULL;
+			continue;
+		}
+		total += entry->size;
+		num_entries++;
+	}
+	afc_dictionary_free(list);
+	if (!entries) {
+		fprintf(stderr, "ERROR: Out of memory!?\n");
+		return -1;
+	}
+
+	/* oldest first, victims are collected at the front of the array */
+	qsort(entries, num_entries, sizeof(struct staging_entry), staging_entry_cmp);
+
+	memset(&gc, 0, sizeof(gc));
+	gc.device = device;
+	gc.victims = entries;
+	uint64_t remaining = total;
+	for (i = 0; i < num_entries; i++) {
+		int expired = (max_age > 0 && entries[i].mtime + max_age < now);
+		if (!expired && remaining <= quota && total - remaining >= min_free) {
+			break;
+		}
+		remaining -= entries[i].size;
+		gc.num_victims++;
+	}
+
+	if (gc.num_victims > 0) {
+		THREAD_T workers[AFC_CONNECTIONS_LIMIT];
+		int num_workers = 0;
+		mutex_init(&gc.mutex);
+		for (i = 1; i < afc_connections && i < gc.num_victims; i++) {
+			if (thread_new(&workers[num_workers], staging_gc_thread, &gc) == 0) {
+				num_workers++;
+			}
+		}
+		staging_gc_run(&gc, afc);
+		for (i = 0; i < num_workers; i++) {
+			thread_join(workers[i]);
+			thread_free(workers[i]);
+		}
+		mutex_destroy(&gc.mutex);
+	}
+
+	char freed_str[32];
+	char total_str[32];
+	format_size(gc.freed, freed_str, sizeof(freed_str));
+	format_size(total - gc.freed, total_str, sizeof(total_str));
+	printf("Staging: removed %d of %d entries (%s), %s remaining\n", gc.num_victims - gc.errors, num_entries, freed_str, total_str);
+
+	for (i = 0; i < num_entries; i++) {
+		free(entries[i].path);
+	}
+	free(entries);
+
+	return gc.errors;
+}
+
+/* free space of the device's data partition and its block size as reported by AFC */
+static int afc_get_free_space(afc_client_t afc, uint64_t *free_bytes, uint64_t *block_size)
+{
+	char *value = NULL;
+
+	if (afc_get_device_info_key(afc, "FSFreeBytes", &value) != AFC_E_SUCCESS || !value) {
+		return -1;
+	}
+	*free_bytes = strtoull(value, NULL, 10);
+	free(value);
+	value = NULL;
+
+	*block_size = 4096;
+	if (afc_get_device_info_key(afc, "FSBlockSize", &value) == AFC_E_SUCCESS && value) {
+		uint64_t bsize = strtoull(value, NULL, 10);
+		if (bsize > 0) {
+			*block_size = bsize;
+		}
+		free(value);
+	}
+	return 0;
+}
+
+/*
+ * Validation of a package archive before it is uploaded: every entry is
+ * read completely so libzip checks its CRC32. The entries are distributed
+ * over a number of threads with their own zip handle, and all threads stop
+ * as soon as one of them found a problem.
+ */
+#define ZIP_VERIFY_THREADS_MAX 16
+
+struct zip_verify;
+
+struct zip_verify_worker {
+	struct zip_verify *zv;
+	int index;
+	THREAD_T thread;
+};
+
+struct zip_verify {
+	const char *path;
+	mutex_t mutex;
+	int failed;
+	char *error;
+	int num_threads;
+	struct zip_verify_worker workers[ZIP_VERIFY_THREADS_MAX];
+};
+
+static int get_num_cpus(void)
+{
+#ifdef WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return (int)si.dwNumberOfProcessors;
+#else
+	long num = sysconf(_SC_NPROCESSORS_ONLN);
+	return (num > 0) ? (int)num : 1;
+#endif
+}
+
+static int zip_verify_failed(struct zip_verify *zv)
+{
+	mutex_lock(&zv->mutex);
+	int failed = zv->failed;
+	mutex_unlock(&zv->mutex);
+	return failed;
+}
+
+static void zip_verify_fail(struct zip_verify *zv, const char *format, ...)
+{
+	va_list args;
+	mutex_lock(&zv->mutex);
+	if (!zv->failed) {
+		zv->failed = 1;
+		va_start(args, format);
+		if (vasprintf(&zv->error, format, args) < 0) {
+			zv->error = NULL;
+		}
+		va_end(args);
+	}
+	mutex_unlock(&zv->mutex);
+}
+
+static void* zip_verify_thread(void *arg)
+{
+	struct zip_verify_worker *worker = (struct zip_verify_worker*)arg;
+	struct zip_verify *zv = worker->zv;
+	int errp = 0;
+
+	/* one consistency check of the central directory is enough */
+	struct zip *zf = zip_open(zv->path, (worker->index == 0) ? ZIP_CHECKCONS : 0, &errp);
+	if (!zf) {
+		zip_verify_fail(zv, "zip_open: %s: %d", zv->path, errp);
+		return NULL;
+	}
+	char *buf = (char*)malloc(65536);
+	if (!buf) {
+		zip_verify_fail(zv, "Out of memory");
+		zip_close(zf);
+		return NULL;
+	}
+
+	zip_int64_t num = zip_get_num_entries(zf, 0);
+	zip_int64_t i;
+	for (i = worker->index; i < num && !zip_verify_failed(zv); i += zv->num_threads) {
+		const char *name = zip_get_name(zf, i, 0);
+		if (!name) {
+			zip_verify_fail(zv, "can't get name of entry %" PRId64, (int64_t)i);
+			break;
+		}
+		if (name[0] != '\0' && name[strlen(name)-1] == '/') {
+			continue;
+		}
+		struct zip_file *zfile = zip_fopen_index(zf, i, 0);
+		if (!zfile) {
+			zip_verify_fail(zv, "%s: %s", name, zip_strerror(zf));
+			break;
+		}
+		zip_int64_t amount;
+		while ((amount = zip_fread(zfile, buf, 65536)) > 0) {
+		}
+		if (amount < 0) {
+			/* a CRC mismatch is reported here once the entry was read completely */
+			zip_verify_fail(zv, "%s: %s", name, zip_file_strerror(zfile));
+		}
+		zip_fclose(zfile);
+	}
+
+	free(buf);
+	zip_close(zf);
+	return NULL;
+}
+
+static void zip_verify_start(struct zip_verify *zv, const char *path)
+{
+	int i;
+
+	memset(zv, 0, sizeof(struct zip_verify));
+	zv->path = path;
+	mutex_init(&zv->mutex);
+
+	int num_threads = get_num_cpus();
+	if (num_threads > ZIP_VERIFY_THREADS_MAX) {
+		num_threads = ZIP_VERIFY_THREADS_MAX;
+	}
+	/* the stride has to be known before the first thread runs */
+	zv->num_threads = num_threads;
+	for (i = 0; i < num_threads; i++) {
+		zv->workers[i].zv = zv;
+		zv->workers[i].index = i;
+		if (thread_new(&zv->workers[i].thread, zip_verify_thread, &zv->workers[i]) != 0) {
+			break;
+		}
+	}
+	if (i < num_threads) {
+		/* the entries of the missing threads would never be checked */
+		zip_verify_fail(zv, "Could not start verification threads");
+		mutex_lock(&zv->mutex);
+		zv->num_threads = i;
+		mutex_unlock(&zv->mutex);
+	}
+}
+
+/* waits for the verification to complete, returns -1 if the archive is bad */
+static int zip_verify_finish(struct zip_verify *zv)
+{
+	int i;
+
+	if (!zv->path) {
+		return 0;
+	}
+	for (i = 0; i < zv->num_threads; i++) {
+		thread_join(zv->workers[i].thread);
+		thread_free(zv->workers[i].thread);
+	}
+	zv->num_threads = 0;
+	zv->path = NULL;
+	mutex_destroy(&zv->mutex);
+	if (zv->failed) {
+		fprintf(stderr, "ERROR: Package verification failed: %s\n", (zv->error) ? zv->error : "unknown error");
+		free(zv->error);
+		zv->error = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/* information about an app package needed to install it */
+struct pkg_info {
+	char *bundle_id;
+	char *bundle_executable;
+	char *bundle_version;
+	char *bundle_short_version;
+	char *app_directory;
+	char *sinf;
+	uint64_t sinf_len;
+	char *meta;
+	uint64_t meta_len;
+};
+
+static void pkg_info_free(struct pkg_info *pinfo)
+{
+	free(pinfo->bundle_id);
+	free(pinfo->bundle_executable);
+	free(pinfo->bundle_version);
+	free(pinfo->bundle_short_version);
+	free(pinfo->app_directory);
+	free(pinfo->sinf);
+	free(pinfo->meta);
+	memset(pinfo, 0, sizeof(struct pkg_info));
+}
+
+static char *memdup(const char *buf, uint64_t len)
+{
+	char *res = (char*)malloc(len);
+	if (res) {
+		memcpy(res, buf, len);
+	}
+	return res;
+}
+
+/* gets the string values needed from the app's Info.plist */
+static void pkg_info_from_plist(plist_t info, struct pkg_info *pinfo)
+{
+	plist_t node = plist_dict_get_item(info, "CFBundleExecutable");
+	if (node) {
+		plist_get_string_val(node, &pinfo->bundle_executable);
+	}
+	node = plist_dict_get_item(info, "CFBundleIdentifier");
+	if (node) {
+		plist_get_string_val(node, &pinfo->bundle_id);
+	}
+	node = plist_dict_get_item(info, "CFBundleVersion");
+	if (node) {
+		plist_get_string_val(node, &pinfo->bundle_version);
+	}
+	node = plist_dict_get_item(info, "CFBundleShortVersionString");
+	if (node) {
+		plist_get_string_val(node, &pinfo->bundle_short_version);
+	}
+}
+
+/* the Info.plist keys needed for installing, in the order of pkg_info_set_strings() */
+static const char *const pkg_info_keys[] = {
+	"CFBundleExecutable",
+	"CFBundleIdentifier",
+	"CFBundleVersion",
+	"CFBundleShortVersionString"
+};
+#define PKG_INFO_NUM_KEYS (int)(sizeof(pkg_info_keys) / sizeof(pkg_info_keys[0]))
+
+static void pkg_info_set_strings(struct pkg_info *pinfo, char **values)
+{
+	pinfo->bundle_executable = values[0];
+	pinfo->bundle_id = values[1];
+	pinfo->bundle_version = values[2];
+	pinfo->bundle_short_version = values[3];
+}
+
+/* fallback for Info.plist formats the scanner does not handle */
+static int pkg_info_from_buffer(const char *buf, uint32_t len, struct pkg_info *pinfo)
+{
+	plist_t info = NULL;
+	plist_from_memory(buf, len, &info, NULL);
+	if (!info) {
+		return -1;
+	}
+	pkg_info_from_plist(info, pinfo);
+	plist_free(info);
+	return 0;
+}
+
+static int64_t zip_file_read_func(void *userdata, char *buf, uint64_t len)
+{
+	return zip_fread((struct zip_file*)userdata, buf, len);
+}
+
+static int64_t stdio_read_func(void *userdata, char *buf, uint64_t len)
+{
+	size_t amount = fread(buf, 1, len, (FILE*)userdata);
+	if (amount == 0 && ferror((FILE*)userdata)) {
+		return -1;
+	}
+	return amount;
+}
+
+/*
+ * Extracts the needed values from the Info.plist in the archive. Only the
+ * top-level strings are picked from the stream, so there is neither a size
+ * limit nor a full plist tree being built.
+ * Returns 0 on success, -1 if the file is missing or -2 if it can't be scanned.
+ */
+static int zip_scan_info_plist(struct zip *zf, const char *filename, struct pkg_info *pinfo)
+{
+	struct zip_stat zs;
+	struct zip_file *zfile;
+	char *values[PKG_INFO_NUM_KEYS];
+	int zindex = zip_name_locate(zf, filename, 0);
+
+	if (zindex < 0) {
+		return -1;
+	}
+	zip_stat_init(&zs);
+	if (zip_stat_index(zf, zindex, 0, &zs) != 0) {
+		fprintf(stderr, "ERROR: zip_stat_index '%s' failed!\n", filename);
+		return -1;
+	}
+	zfile = zip_fopen_index(zf, zindex, 0);
+	if (!zfile) {
+		fprintf(stderr, "ERROR: zip_fopen '%s' failed!\n", filename);
+		return -1;
+	}
+	int res = plistscan_get_strings(zip_file_read_func, zfile, zs.size, pkg_info_keys, values, PKG_INFO_NUM_KEYS);
+	zip_fclose(zfile);
+	if (res < 0) {
+		return -2;
+	}
+	pkg_info_set_strings(pinfo, values);
+	return 0;
+}
+
+/* extracts the package information from an Info.plist file */
+static int pkg_info_from_file(const char *filename, struct pkg_info *pinfo)
+{
+	struct stat st;
+	FILE *fp = NULL;
+	char *values[PKG_INFO_NUM_KEYS];
+
+	if (stat(filename, &st) == -1 || (fp = fopen(filename, "rb")) == NULL) {
+		fprintf(stderr, "ERROR: could not locate %s in app!\n", filename);
+		return -1;
+	}
+	if (plistscan_get_strings(stdio_read_func, fp, st.st_size, pkg_info_keys, values, PKG_INFO_NUM_KEYS) >= 0) {
+		fclose(fp);
+		pkg_info_set_strings(pinfo, values);
+		return 0;
+	}
+
+	size_t filesize = st.st_size;
+	char *ibuf = malloc(filesize);
+	rewind(fp);
+	size_t amount = (ibuf) ? fread(ibuf, 1, filesize, fp) : 0;
+	fclose(fp);
+	if (amount != filesize) {
+		fprintf(stderr, "ERROR: could not read %u bytes from %s\n", (uint32_t)filesize, filename);
+		free(ibuf);
+		return -1;
+	}
+	int res = pkg_info_from_buffer(ibuf, filesize, pinfo);
+	free(ibuf);
+	if (res < 0) {
+		fprintf(stderr, "ERROR: could not parse Info.plist!\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* extracts the package information from the .ipa archive */
+static int pkg_info_from_zip(struct zip *zf, struct mem_arena *arena, struct pkg_info *pinfo)
+{
+	char *zbuf = NULL;
+	uint32_t len = 0;
+
+	memset(pinfo, 0, sizeof(struct pkg_info));
+
+	/* iTunesMetadata.plist, only kept if it is a valid plist */
+	if (zip_get_contents(zf, ITUNES_METADATA_PLIST_FILENAME, 0, arena, &zbuf, &len) == 0) {
+		plist_t meta_dict = NULL;
+		plist_from_memory(zbuf, len, &meta_dict, NULL);
+		if (meta_dict) {
+			pinfo->meta = memdup(zbuf, len);
+			pinfo->meta_len = len;
+			plist_free(meta_dict);
+		}
+	}
+
+	/* determine .app directory in archive */
+	if (zip_get_app_directory(zf, &pinfo->app_directory)) {
+		fprintf(stderr, "ERROR: Unable to locate .app directory in archive. Make sure it is inside a 'Payload' directory.\n");
+		return -1;
+	}
+
+	/* construct full filename to Info.plist */
+	char *filename = (char*)arena_alloc(arena, strlen(pinfo->app_directory)+10+1);
+	if (!filename) {
+		fprintf(stderr, "Out of memory!?\n");
+		return -1;
+	}
+	strcpy(filename, pinfo->app_directory);
+	strcat(filename, "Info.plist");
+
+	int res = zip_scan_info_plist(zf, filename, pinfo);
+	if (res == -2) {
+		if (zip_get_contents(zf, filename, 0, arena, &zbuf, &len) == 0) {
+			res = pkg_info_from_buffer(zbuf, len, pinfo);
+		}
+		if (res < 0) {
+			fprintf(stderr, "Could not parse Info.plist!\n");
+			return -1;
+		}
+	} else if (res < 0) {
+		fprintf(stderr, "WARNING: could not locate %s in archive!\n", filename);
+		return -1;
+	}
+
+	if (!pinfo->bundle_executable) {
+		fprintf(stderr, "Could not determine value for CFBundleExecutable!\n");
+		return -1;
+	}
+
+	char *sinfname = NULL;
+	if (asprintf(&sinfname, "Payload/%s.app/SC_Info/%s.sinf", pinfo->bundle_executable, pinfo->bundle_executable) < 0) {
+		fprintf(stderr, "Out of memory!?\n");
+		return -1;
+	}
+	if (zip_get_contents(zf, sinfname, 0, arena, &zbuf, &len) == 0) {
+		pinfo->sinf = memdup(zbuf, len);
+		pinfo->sinf_len = len;
+	}
+	free(sinfname);
+
+	return 0;
+}
+
+/*
+ * Cache for the package information of .ipa files, so that installing the
+ * same package again (e.g. to many devices one after another) does not
+ * need to open and parse the archive. Besides the app information, an
+ * entry holds the unpacked size and number of files for the free space
+ * check and the plan command. Entries are keyed by the path and the
+ * identity (inode, size, mtime and ctime in nanoseconds) of the package file.
+ * Entries not written for PKG_CACHE_MAX_AGE are removed, and only the most
+ * recent PKG_CACHE_MAX_ENTRIES are kept.
+ */
+#define PKG_CACHE_VERSION 3
+#define PKG_CACHE_MAX_AGE (30*24*60*60)
+#define PKG_CACHE_MAX_ENTRIES 256
+
+static char *get_cache_dir(void)
+{
+	char *dir = NULL;
+#ifdef WIN32
+	const char *base = getenv("LOCALAPPDATA");
+	if (base && *base) {
+		if (asprintf(&dir, "%s\\ideviceinstaller", base) < 0) {
+			dir = NULL;
+		}
+	}
+#else
+	const char *base = getenv("XDG_CACHE_HOME");
+	if (base && *base) {
+		if (asprintf(&dir, "%s/ideviceinstaller", base) < 0) {
+			dir = NULL;
+		}
+	} else if ((base = getenv("HOME")) && *base) {
+		if (asprintf(&dir, "%s/.cache/ideviceinstaller", base) < 0) {
+			dir = NULL;
+		}
+	}
+#endif
+	return dir;
+}
+
+static int mkdir_with_parents(const char *dir, int mode)
+{
+	struct stat st;
+	if (stat(dir, &st) == 0) {
+		return S_ISDIR(st.st_mode) ? 0 : -1;
+	}
+	char *parent = strdup(dir);
+	char *p = strrchr(parent, '/');
+	if (p && p != parent) {
+		*p = '\0';
+		mkdir_with_parents(parent, mode);
+	}
+	free(parent);
+#ifdef WIN32
+	return mkdir(dir);
+#else
+	return mkdir(dir, mode);
+#endif
+}
+
+static char *pkg_cache_canonical_path(const char *path)
+{
+#ifdef WIN32
+	return _fullpath(NULL, path, 0);
+#else
+	return realpath(path, NULL);
+#endif
+}
+
+static uint64_t stat_mtime_ns(struct stat *st)
+{
+#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+	return (uint64_t)st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC)
+	return (uint64_t)st->st_mtimespec.tv_sec * 1000000000ULL + st->st_mtimespec.tv_nsec;
+#else
+	return (uint64_t)st->st_mtime * 1000000000ULL;
+#endif
+}
+
+static uint64_t stat_ctime_ns(struct stat *st)
+{
+#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+	return (uint64_t)st->st_ctim.tv_sec * 1000000000ULL + st->st_ctim.tv_nsec;
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC)
+	return (uint64_t)st->st_ctimespec.tv_sec * 1000000000ULL + st->st_ctimespec.tv_nsec;
+#else
+	return (uint64_t)st->st_ctime * 1000000000ULL;
+#endif
+}
+
+static char *pkg_cache_get_filename(const char *path, struct stat *st)
+{
+	char *cachedir = get_cache_dir();
+	char *filename = NULL;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	const char *p;
+
+	if (!cachedir) {
+		return NULL;
+	}
+	/* FNV-1a over the path; the identity is verified on load */
+	for (p = path; *p; p++) {
+		hash ^= (unsigned char)*p;
+		hash *= 0x100000001b3ULL;
+	}
+	if (asprintf(&filename, "%s/pkg-%016" PRIx64 "-%" PRIx64 ".plist", cachedir, hash, (uint64_t)st->st_size) < 0) {
+		filename = NULL;
+	}
+	free(cachedir);
+	return filename;
+}
+
+/* the cache entry of the package, or NULL if there is none for this identity */
+static plist_t pkg_cache_read(const char *path, struct stat *st)
+{
+	char *filename = pkg_cache_get_filename(path, st);
+	plist_t dict = NULL;
+
+	if (!filename) {
+		return NULL;
+	}
+	plist_read_from_file(filename, &dict, NULL);
+	free(filename);
+	if (!dict || plist_get_node_type(dict) != PLIST_DICT) {
+		plist_free(dict);
+		return NULL;
+	}
+
+	uint64_t version = 0, inode = 0, size = 0, mtime_ns = 0, ctime_ns = 0;
+	plist_t node = plist_dict_get_item(dict, "CacheVersion");
+	plist_get_uint_val(node, &version);
+	plist_get_uint_val(plist_dict_get_item(dict, "Inode"), &inode);
+	plist_get_uint_val(plist_dict_get_item(dict, "Size"), &size);
+	plist_get_uint_val(plist_dict_get_item(dict, "MTimeNS"), &mtime_ns);
+	plist_get_uint_val(plist_dict_get_item(dict, "CTimeNS"), &ctime_ns);
+	node = plist_dict_get_item(dict, "Path");
+	if (version != PKG_CACHE_VERSION || !node || plist_string_val_compare(node, path) != 0
+	    || inode != (uint64_t)st->st_ino || size != (uint64_t)st->st_size
+	    || mtime_ns != stat_mtime_ns(st) || ctime_ns != stat_ctime_ns(st)) {
+		plist_free(dict);
+		return NULL;
+	}
+	return dict;
+}
+
+static int pkg_cache_load(const char *path, struct stat *st, struct pkg_info *pinfo)
+{
+	plist_t dict = pkg_cache_read(path, st);
+	int res = -1;
+
+	memset(pinfo, 0, sizeof(struct pkg_info));
+	if (!dict) {
+		return -1;
+	}
+
+	plist_t node = plist_dict_get_item(dict, "CFBundleExecutable");
+	if (node) {
+		plist_get_string_val(node, &pinfo->bundle_executable);
+	}
+	node = plist_dict_get_item(dict, "CFBundleIdentifier");
+	if (node) {
+		plist_get_string_val(node, &pinfo->bundle_id);
+	}
+	node = plist_dict_get_item(dict, "AppDirectory");
+	if (node) {
+		plist_get_string_val(node, &pinfo->app_directory);
+	}
+	node = plist_dict_get_item(dict, "CFBundleVersion");
+	if (node) {
+		plist_get_string_val(node, &pinfo->bundle_version);
+	}
+	node = plist_dict_get_item(dict, "CFBundleShortVersionString");
+	if (node) {
+		plist_get_string_val(node, &pinfo->bundle_short_version);
+	}
+	node = plist_dict_get_item(dict, "ApplicationSINF");
+	if (node) {
+		plist_get_data_val(node, &pinfo->sinf, &pinfo->sinf_len);
+	}
+	node = plist_dict_get_item(dict, "iTunesMetadata");
+	if (node) {
+		plist_get_data_val(node, &pinfo->meta, &pinfo->meta_len);
+	}
+	plist_free(dict);
+
+	if (pinfo->bundle_executable && pinfo->app_directory) {
+		res = 0;
+	} else {
+		pkg_info_free(pinfo);
+	}
+	return res;
+}
+
+/* the unpacked size and number of files of a zip package, see zip_get_totals() */
+static int pkg_cache_load_totals(const char *path, struct stat *st, uint64_t *total_bytes, uint64_t *total_files)
+{
+	plist_t dict = pkg_cache_read(path, st);
+	int res = -1;
+
+	if (!dict) {
+		return -1;
+	}
+	plist_t bytes_node = plist_dict_get_item(dict, "UnpackedSize");
+	plist_t files_node = plist_dict_get_item(dict, "NumFiles");
+	if (bytes_node && files_node) {
+		plist_get_uint_val(bytes_node, total_bytes);
+		plist_get_uint_val(files_node, total_files);
+		res = 0;
+	}
+	plist_free(dict);
+	return res;
+}
+
+struct pkg_cache_entry {
+	char *name;
+	time_t mtime;
+};
+
+static int pkg_cache_entry_cmp(const void *a, const void *b)
+{
+	const struct pkg_cache_entry *ea = (const struct pkg_cache_entry*)a;
+	const struct pkg_cache_entry *eb = (const struct pkg_cache_entry*)b;
+	/* newest first */
+	if (ea->mtime != eb->mtime) {
+		return (ea->mtime < eb->mtime) ? 1 : -1;
+	}
+	return strcmp(ea->name, eb->name);
+}
+
+/* removes expired entries, and the oldest ones beyond PKG_CACHE_MAX_ENTRIES */
+static void pkg_cache_evict(const char *cachedir)
+{
+	struct pkg_cache_entry *entries = NULL;
+	size_t count = 0, capacity = 0, i;
+	time_t now = time(NULL);
+
+	DIR *dir = opendir(cachedir);
+	if (!dir) {
+		return;
+	}
+	struct dirent* ep;
+	while ((ep = readdir(dir))) {
+		size_t len = strlen(ep->d_name);
+		if (strncmp(ep->d_name, "pkg-", 4) != 0 || len < 10 || strcmp(ep->d_name + len - 6, ".plist") != 0) {
+			continue;
+		}
+		char *fpath = NULL;
+		struct stat st;
+		if (asprintf(&fpath, "%s/%s", cachedir, ep->d_name) < 0) {
+			break;
+		}
+		if (stat(fpath, &st) != 0 || !S_ISREG(st.st_mode)) {
+			free(fpath);
+			continue;
+		}
+		if (now - st.st_mtime > PKG_CACHE_MAX_AGE) {
+			remove(fpath);
+			free(fpath);
+			continue;
+		}
+		if (count == capacity) {
+			size_t newcap = capacity ? capacity * 2 : 64;
+			struct pkg_cache_entry *newentries = realloc(entries, newcap * sizeof(struct pkg_cache_entry));
+			if (!newentries) {
+				free(fpath);
+				break;
+			}
+			entries = newentries;
+			capacity = newcap;
+		}
+		entries[count].name = fpath;
+		entries[count].mtime = st.st_mtime;
+		count++;
+	}
+	closedir(dir);
+
+	if (count > PKG_CACHE_MAX_ENTRIES) {
+		qsort(entries, count, sizeof(struct pkg_cache_entry), pkg_cache_entry_cmp);
+		for (i = PKG_CACHE_MAX_ENTRIES; i < count; i++) {
+			remove(entries[i].name);
+		}
+	}
+	for (i = 0; i < count; i++) {
+		free(entries[i].name);
+	}
+	free(entries);
+}
+
+/* writes dict as the cache entry of the package, consumes dict */
+static void pkg_cache_write(const char *path, struct stat *st, plist_t dict)
+{
+	char *cachedir = get_cache_dir();
+	char *filename = pkg_cache_get_filename(path, st);
+	char *tmpname = NULL;
+
+	if (!cachedir || !filename || mkdir_with_parents(cachedir, 0755) < 0
+	    || asprintf(&tmpname, "%s.%d.tmp", filename, (int)getpid()) < 0) {
+		plist_free(dict);
+		free(cachedir);
+		free(filename);
+		return;
+	}
+
+	plist_dict_set_item(dict, "CacheVersion", plist_new_uint(PKG_CACHE_VERSION));
+	plist_dict_set_item(dict, "Path", plist_new_string(path));
+	plist_dict_set_item(dict, "Inode", plist_new_uint(st->st_ino));
+	plist_dict_set_item(dict, "Size", plist_new_uint(st->st_size));
+	plist_dict_set_item(dict, "MTimeNS", plist_new_uint(stat_mtime_ns(st)));
+	plist_dict_set_item(dict, "CTimeNS", plist_new_uint(stat_ctime_ns(st)));
+
+	/* write to a temporary file first so concurrent runs never see partial entries */
+	if (plist_write_to_file(dict, tmpname, PLIST_FORMAT_BINARY, PLIST_OPT_NONE) == PLIST_ERR_SUCCESS) {
+		if (rename(tmpname, filename) != 0) {
+			remove(tmpname);
+		}
+	} else {
+		remove(tmpname);
+	}
+	plist_free(dict);
+	pkg_cache_evict(cachedir);
+	free(tmpname);
+	free(filename);
+	free(cachedir);
+}
+
+/* adds the package information to the entry of the package */
+static void pkg_cache_store(const char *path, struct stat *st, struct pkg_info *pinfo)
+{
+	plist_t dict = pkg_cache_read(path, st);
+	if (!dict) {
+		dict = plist_new_dict();
+	}
+	plist_dict_set_item(dict, "CFBundleExecutable", plist_new_string(pinfo->bundle_executable));
+	if (pinfo->bundle_id) {
+		plist_dict_set_item(dict, "CFBundleIdentifier", plist_new_string(pinfo->bundle_id));
+	}
+	plist_dict_set_item(dict, "AppDirectory", plist_new_string(pinfo->app_directory));
+	if (pinfo->bundle_version) {
+		plist_dict_set_item(dict, "CFBundleVersion", plist_new_string(pinfo->bundle_version));
+	}
+	if (pinfo->bundle_short_version) {
+		plist_dict_set_item(dict, "CFBundleShortVersionString", plist_new_string(pinfo->bundle_short_version));
+	}
+	if (pinfo->sinf) {
+		plist_dict_set_item(dict, "ApplicationSINF", plist_new_data(pinfo->sinf, pinfo->sinf_len));
+	}
+	if (pinfo->meta) {
+		plist_dict_set_item(dict, "iTunesMetadata", plist_new_data(pinfo->meta, pinfo->meta_len));
+	}
+	pkg_cache_write(path, st, dict);
+}
+
+/* adds the unpacked size and number of files to the entry of the package */
+static void pkg_cache_store_totals(const char *path, struct stat *st, uint64_t total_bytes, uint64_t total_files)
+{
+	plist_t dict = pkg_cache_read(path, st);
+	if (!dict) {
+		dict = plist_new_dict();
+	}
+	plist_dict_set_item(dict, "UnpackedSize", plist_new_uint(total_bytes));
+	plist_dict_set_item(dict, "NumFiles", plist_new_uint(total_files));
+	pkg_cache_write(path, st, dict);
+}
+
+/*
+ * The unpacked size and number of files of the zip package at path (.ipa
+ * or .ipcc), from the cache if possible. Returns -1 with the libzip error
+ * in errp if the package can't be opened.
+ */
+static int package_zip_totals(const char *path, struct stat *st, uint64_t *total_bytes, uint64_t *total_files, int *errp)
+{
+	char *pkgpath = (use_cache) ? pkg_cache_canonical_path(path) : NULL;
+
+	if (pkgpath && pkg_cache_load_totals(pkgpath, st, total_bytes, total_files) == 0) {
+		free(pkgpath);
+		return 0;
+	}
+	struct zip *zf = zip_open(path, 0, errp);
+	if (!zf) {
+		free(pkgpath);
+		return -1;
+	}
+	zip_get_totals(zf, total_bytes, total_files);
+	zip_close(zf);
+	if (pkgpath) {
+		pkg_cache_store_totals(pkgpath, st, *total_bytes, *total_files);
+	}
+	free(pkgpath);
+	return 0;
+}
+
+/*
+ * Estimates the space a package takes on the device: the upload to the
+ * staging directory plus the app installd unpacks from it, taken from the
+ * central directory (or the package cache) without reading any data. Every file is assumed to
+ * waste half a block. Packages read from stdin are unknown in advance.
+ */
+static uint64_t package_space_estimate(const char *path, uint64_t block_size)
+{
+	struct stat fst;
+	uint64_t total_bytes = 0;
+	uint64_t total_files = 0;
+
+	if (!strcmp(path, "-") || stat(path, &fst) != 0) {
+		return 0;
+	}
+	if (S_ISDIR(fst.st_mode)) {
+		dir_get_totals(path, &total_bytes, &total_files);
+		return 2 * (total_bytes + total_files * block_size / 2);
+	}
+
+	int errp = 0;
+	if (package_zip_totals(path, &fst, &total_bytes, &total_files, &errp) < 0) {
+		return (uint64_t)fst.st_size;
+	}
+
+	uint64_t unpacked = total_bytes + total_files * block_size / 2;
+	size_t len = strlen(path);
+	if (len > 5 && !strcmp(path + len - 5, ".ipcc")) {
+		/* carrier bundles are uploaded unpacked */
+		return 2 * unpacked;
+	}
+	return (uint64_t)fst.st_size + unpacked;
+}
+
+/*
+ * Checks before anything is uploaded that the packages fit into the free
+ * space of the device (keeping some reserve), optionally removing staged
+ * packages to make room. If the device doesn't report its free space the
+ * check is skipped.
+ */
+#define FREE_SPACE_RESERVE 104857600
+
+static int check_free_space(idevice_t device, afc_client_t afc, char **paths, int num_paths)
+{
+	uint64_t free_bytes = 0;
+	uint64_t block_size = 0;
+	uint64_t needed = FREE_SPACE_RESERVE;
+	int i;
+
+	if (afc_get_free_space(afc, &free_bytes, &block_size) < 0) {
+		return 0;
+	}
+	for (i = 0; i < num_paths; i++) {
+		needed += package_space_estimate(paths[i], block_size);
+	}
+	if (needed <= free_bytes) {
+		return 0;
+	}
+
+	if (make_room) {
+		printf("Not enough free space on the device, removing staged packages...\n");
+		staging_gc(device, afc, STAGING_QUOTA_UNLIMITED, 0, needed - free_bytes);
+		if (afc_get_free_space(afc, &free_bytes, &block_size) < 0 || needed <= free_bytes) {
+			return 0;
+		}
+	}
+
+	char needed_str[32];
+	char free_str[32];
+	format_size(needed, needed_str, sizeof(needed_str));
+	format_size(free_bytes, free_str, sizeof(free_str));
+	fprintf(stderr, "ERROR: Not enough free space on the device: about %s needed, %s available.\n", needed_str, free_str);
+	if (!make_room) {
+		fprintf(stderr, "Use --make-room to remove staged packages first, or --no-space-check to try anyway.\n");
+	}
+	return -1;
+}
+
+/*
+ * Transport selection for devices that are reachable via USB and via the
+ * network at the same time. Both connections are probed with a short AFC
+ * write and a couple of round-trips; uploads use the faster one, all other
+ * commands the one with less latency. Results are kept in the cache
+ * directory so that the probe only runs once in a while.
+ */
+#define TRANSPORT_PROBE_SIZE 1048576
+#define TRANSPORT_PROBE_PINGS 5
+#define TRANSPORT_CACHE_MAX_AGE 86400
+
+struct transport_probe {
+	double throughput; /* bytes per second */
+	double latency; /* ms per round-trip */
+};
+
+static int transport_probe_run(const char *device_udid, enum idevice_options lookup, struct transport_probe *probe)
+{
+	idevice_t dev = NULL;
+	afc_client_t probe_afc = NULL;
+	char *probe_path = NULL;
+	char *buf = NULL;
+	uint64_t af = 0;
+	int i, res = -1;
+
+	if (idevice_new_with_options(&dev, device_udid, lookup) != IDEVICE_E_SUCCESS) {
+		return -1;
+	}
+	if (afc_client_start_service(dev, &probe_afc, "ideviceinstaller") != AFC_E_SUCCESS) {
+		idevice_free(dev);
+		return -1;
+	}
+
+	uint64_t start = get_monotonic_us();
+	for (i = 0; i < TRANSPORT_PROBE_PINGS; i++) {
+		char **info = NULL;
+		if (afc_get_file_info(probe_afc, "/", &info) == AFC_E_SUCCESS) {
+			afc_dictionary_free(info);
+		}
+	}
+	probe->latency = (double)(get_monotonic_us() - start) / (TRANSPORT_PROBE_PINGS * 1000.0);
+
+	buf = (char*)calloc(1, TRANSPORT_PROBE_SIZE);
+	if (buf && asprintf(&probe_path, "%s/.probe-%d", PKG_PATH, (int)getpid()) > 0) {
+		afc_make_directory(probe_afc, PKG_PATH);
+		if (afc_file_open(probe_afc, probe_path, AFC_FOPEN_WRONLY, &af) == AFC_E_SUCCESS) {
+			uint32_t total = 0;
+			start = get_monotonic_us();
+			while (total < TRANSPORT_PROBE_SIZE) {
+				uint32_t written = 0;
+				if (afc_file_write(probe_afc, af, buf + total, TRANSPORT_PROBE_SIZE - total, &written) != AFC_E_SUCCESS) {
+					break;
+				}
+				total += written;
+			}
+			afc_file_close(probe_afc, af);
+			uint64_t elapsed = get_monotonic_us() - start;
+			if (total == TRANSPORT_PROBE_SIZE) {
+				probe->throughput = (double)total * 1000000 / ((elapsed > 0) ? elapsed : 1);
+				res = 0;
+			}
+			afc_remove_path(probe_afc, probe_path);
+		}
+	}
+	free(probe_path);
+	free(buf);
+	afc_client_free(probe_afc);
+	idevice_free(dev);
+
+	return res;
+}
+
+static char *transport_cache_get_filename(const char *device_udid)
+{
+	char *cachedir = get_cache_dir();
+	char *filename = NULL;
+	if (!cachedir) {
+		return NULL;
+	}
+	if (asprintf(&filename, "%s/transport-%s.plist", cachedir, device_udid) < 0) {
+		filename = NULL;
+	}
+	free(cachedir);
+	return filename;
+}
+
+static void transport_probe_to_plist(plist_t dict, const char *key, struct transport_probe *probe)
+{
+	plist_t node = plist_new_dict();
+	plist_dict_set_item(node, "Throughput", plist_new_real(probe->throughput));
+	plist_dict_set_item(node, "Latency", plist_new_real(probe->latency));
+	plist_dict_set_item(dict, key, node);
+}
+
+static int transport_probe_from_plist(plist_t dict, const char *key, struct transport_probe *probe)
+{
+	plist_t node = plist_dict_get_item(dict, key);
+	plist_t tp = plist_dict_get_item(node, "Throughput");
+	plist_t lat = plist_dict_get_item(node, "Latency");
+	if (!tp || !lat) {
+		return -1;
+	}
+	plist_get_real_val(tp, &probe->throughput);
+	plist_get_real_val(lat, &probe->latency);
+	return 0;
+}
+
+static int transport_cache_load(const char *device_udid, struct transport_probe *usb, struct transport_probe *net)
+{
+	char *filename = transport_cache_get_filename(device_udid);
+	plist_t dict = NULL;
+	uint64_t timestamp = 0;
+	int res = -1;
+
+	if (!filename) {
+		return -1;
+	}
+	plist_read_from_file(filename, &dict, NULL);
+	free(filename);
+	if (!dict) {
+		return -1;
+	}
+	plist_get_uint_val(plist_dict_get_item(dict, "Timestamp"), &timestamp);
+	if (timestamp + TRANSPORT_CACHE_MAX_AGE >= (uint64_t)time(NULL)
+	    && transport_probe_from_plist(dict, "USB", usb) == 0
+	    && transport_probe_from_plist(dict, "Network", net) == 0) {
+		res = 0;
+	}
+	plist_free(dict);
+	return res;
+}
+
+static void transport_cache_store(const char *device_udid, struct transport_probe *usb, struct transport_probe *net)
+{
+	char *cachedir = get_cache_dir();
+	char *filename = transport_cache_get_filename(device_udid);
+	char *tmpname = NULL;
+
+	if (cachedir && filename && mkdir_with_parents(cachedir, 0755) == 0
+	    && asprintf(&tmpname, "%s.%d.tmp", filename, (int)getpid()) > 0) {
+		plist_t dict = plist_new_dict();
+		plist_dict_set_item(dict, "Timestamp", plist_new_uint((uint64_t)time(NULL)));
+		transport_probe_to_plist(dict, "USB", usb);
+		transport_probe_to_plist(dict, "Network", net);
+		if (plist_write_to_file(dict, tmpname, PLIST_FORMAT_XML, PLIST_OPT_NONE) != PLIST_ERR_SUCCESS
+		    || rename(tmpname, filename) != 0) {
+			remove(tmpname);
+		}
+		plist_free(dict);
+		free(tmpname);
+	}
+	free(filename);
+	free(cachedir);
+}
+
+/*
+ * Determines how to connect to the device. If no UDID was given, the first
+ * device found is used and its UDID is returned in device_udid.
+ */
+static enum idevice_options transport_select(char **device_udid, int bulk)
+{
+	idevice_info_t *devices = NULL;
+	int count = 0;
+	int i, has_usb = 0, has_net = 0;
+
+	if (idevice_get_device_list_extended(&devices, &count) != IDEVICE_E_SUCCESS) {
+		return IDEVICE_LOOKUP_USBMUX;
+	}
+	for (i = 0; i < count; i++) {
+		if (!*device_udid) {
+			*device_udid = strdup(devices[i]->udid);
+		}
+		if (strcmp(devices[i]->udid, *device_udid) != 0) {
+			continue;
+		}
+		if (devices[i]->conn_type == CONNECTION_NETWORK) {
+			has_net = 1;
+		} else {
+			has_usb = 1;
+		}
+	}
+	idevice_device_list_extended_free(devices);
+
+	if (!has_usb || !has_net) {
+		return (has_net) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX;
+	}
+
+	struct transport_probe usb = { 0, 0 };
+	struct transport_probe net = { 0, 0 };
+	if (transport_cache_load(*device_udid, &usb, &net) < 0) {
+		int usb_ok = (transport_probe_run(*device_udid, IDEVICE_LOOKUP_USBMUX, &usb) == 0);
+		int net_ok = (transport_probe_run(*device_udid, IDEVICE_LOOKUP_NETWORK, &net) == 0);
+		if (!usb_ok || !net_ok) {
+			return (usb_ok || !net_ok) ? IDEVICE_LOOKUP_USBMUX : IDEVICE_LOOKUP_NETWORK;
+		}
+		transport_cache_store(*device_udid, &usb, &net);
+	}
+
+	int use_net = (bulk) ? (net.throughput > usb.throughput) : (net.latency < usb.latency);
+	struct transport_probe *chosen = (use_net) ? &net : &usb;
+	char rate[32];
+	format_size((uint64_t)chosen->throughput, rate, sizeof(rate));
+	fprintf(stderr, "Using %s connection (%s/s, %.1f ms latency)\n", (use_net) ? "network" : "USB", rate, chosen->latency);
+
+	return (use_net) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX;
+}
+
+/* connection type of this run and the history estimates for its device */
+static int history_network = 0;
+static struct history_estimate history_upload;
+static struct history_estimate history_install;
+
+static char *history_get_filename(void)
+{
+	char *cachedir = get_cache_dir();
+	char *filename = NULL;
+	if (!cachedir) {
+		return NULL;
+	}
+	if (asprintf(&filename, "%s/history.log", cachedir) < 0) {
+		filename = NULL;
+	}
+	free(cachedir);
+	return filename;
+}
+
+/* records a measurement for the device of this run */
+static void history_record(enum history_kind kind, uint64_t bytes, uint64_t duration_us)
+{
+	char *cachedir = get_cache_dir();
+	char *filename = history_get_filename();
+	if (udid && cachedir && filename && mkdir_with_parents(cachedir, 0755) == 0) {
+		history_add(filename, udid, history_network, kind, bytes, duration_us);
+	}
+	free(filename);
+	free(cachedir);
+}
+
+/* the unpacked content of a directory or zip package, see package_get_size() */
+static int package_totals(const char *path, struct stat *st, uint64_t *total_bytes, uint64_t *total_files, int *errp)
+{
+	if (S_ISDIR(st->st_mode)) {
+		*total_bytes = 0;
+		*total_files = 0;
+		dir_get_totals(path, total_bytes, total_files);
+		return 0;
+	}
+	return package_zip_totals(path, st, total_bytes, total_files, errp);
+}
+
+/*
+ * Scheduling of uploads of concurrent runs (e.g. one per device) by USB
+ * topology, see --usb-slots. The host controller and hub of a device are
+ * looked up in sysfs by its serial number. Every controller and hub has a
+ * number of slot files in the cache directory; an upload holds a lock on one
+ * slot of its hub and one of its controller, and waits until both are free.
+ * The sysfs root can be overridden with IDEVICEINSTALLER_SYSFS_ROOT.
+ */
+#define USB_SLOTS_POLL_MS 100
+
+struct usb_sched {
+	int enabled;
+	char *hub_prefix;
+	char *controller_prefix;
+	int hub_fd;
+	int controller_fd;
+	char *wait_path;
+	int wait_fd;
+};
+
+static struct usb_sched usb_sched = { 0, NULL, NULL, -1, -1, NULL, -1 };
+
+/* replaces characters that are not safe in file names */
+static void sanitize_name(char *name)
+{
+	for (; *name; name++) {
+		if (!isalnum((unsigned char)*name) && *name != '.' && *name != '-' && *name != '_') {
+			*name = '_';
+		}
+	}
+}
+
+static void usb_sched_init(const char *device_udid)
+{
+	char *controller = NULL;
+	char *hub = NULL;
+	char *cachedir = NULL;
+	char *slotdir = NULL;
+
+	if (usb_topology_lookup(getenv("IDEVICEINSTALLER_SYSFS_ROOT"), device_udid, &controller, &hub) < 0) {
+		fprintf(stderr, "NOTE: Could not determine the USB topology of the device, uploads are not scheduled.\n");
+		return;
+	}
+	cachedir = get_cache_dir();
+	if (!cachedir || asprintf(&slotdir, "%s/usb-slots", cachedir) < 0 || mkdir_with_parents(slotdir, 0755) < 0) {
+		fprintf(stderr, "NOTE: Could not create the USB slot directory, uploads are not scheduled.\n");
+		goto leave;
+	}
+	/* the hub slots are per controller, as hub port paths repeat across buses */
+	char *hub_name = NULL;
+	if (asprintf(&hub_name, "%s-%s", controller, hub) < 0) {
+		goto leave;
+	}
+	sanitize_name(hub_name);
+	sanitize_name(controller);
+	if (asprintf(&usb_sched.hub_prefix, "%s/hub-%s", slotdir, hub_name) < 0
+	    || asprintf(&usb_sched.controller_prefix, "%s/controller-%s", slotdir, controller) < 0) {
+		free(hub_name);
+		goto leave;
+	}
+	free(hub_name);
+	usb_sched.enabled = 1;
+
+leave:
+	free(controller);
+	free(hub);
+	free(cachedir);
+	free(slotdir);
+}
+
+/* tries to lock one of the slot files prefix.0 ... prefix.<num-1>, returns -1 if all are busy or -2 on error */
+static int usb_slot_try(const char *prefix, int num)
+{
+	int i;
+	for (i = 0; i < num; i++) {
+		char *slotname = NULL;
+		if (asprintf(&slotname, "%s.%d", prefix, i) < 0) {
+			return -2;
+		}
+		int fd = open(slotname, O_RDWR | O_CREAT, 0644);
+		if (fd < 0) {
+			fprintf(stderr, "WARNING: Could not open %s: %s. Uploads are not scheduled.\n", slotname, strerror(errno));
+			free(slotname);
+			return -2;
+		}
+		free(slotname);
+		if (lock_file(fd, 1) == 0) {
+			return fd;
+		}
+		close(fd);
+	}
+	return -1;
+}
+
+static void usb_slots_release(void)
+{
+	if (usb_sched.controller_fd >= 0) {
+		close(usb_sched.controller_fd);
+	}
+	if (usb_sched.hub_fd >= 0) {
+		close(usb_sched.hub_fd);
+	}
+	usb_sched.controller_fd = -1;
+	usb_sched.hub_fd = -1;
+}
+
+/*
+ * Runs waiting for a slot announce the expected duration of their upload
+ * in a wait file next to the slot files of their hub, named
+ * <hub>.wait.<pid>.<ms> and locked while the run is waiting. A free slot
+ * is left to a longer upload that waits too, so the longest jobs start
+ * first and the shorter ones fill in behind them. Wait files that aren't
+ * locked anymore are leftovers of runs that are gone and get removed.
+ */
+static void usb_wait_announce(int64_t job_ms)
+{
+	char *tmpname = NULL;
+
+	if (asprintf(&usb_sched.wait_path, "%s.wait.%d.%" PRIi64, usb_sched.hub_prefix, (int)getpid(), job_ms) < 0
+	    || asprintf(&tmpname, "%s.tmp", usb_sched.wait_path) < 0) {
+		free(usb_sched.wait_path);
+		usb_sched.wait_path = NULL;
+		return;
+	}
+	/* only appear under the final name once locked */
+	usb_sched.wait_fd = open(tmpname, O_RDWR | O_CREAT, 0644);
+	if (usb_sched.wait_fd < 0 || lock_file(usb_sched.wait_fd, 1) < 0 || rename(tmpname, usb_sched.wait_path) < 0) {
+		if (usb_sched.wait_fd >= 0) {
+			close(usb_sched.wait_fd);
+		}
+		remove(tmpname);
+		usb_sched.wait_fd = -1;
+		free(usb_sched.wait_path);
+		usb_sched.wait_path = NULL;
+	}
+	free(tmpname);
+}
+
+static void usb_wait_done(void)
+{
+	if (usb_sched.wait_path) {
+		remove(usb_sched.wait_path);
+		free(usb_sched.wait_path);
+		usb_sched.wait_path = NULL;
+	}
+	if (usb_sched.wait_fd >= 0) {
+		close(usb_sched.wait_fd);
+		usb_sched.wait_fd = -1;
+	}
+}
+
+/* checks whether another run with a longer upload waits for the same hub */
+static int usb_longer_job_waiting(int64_t job_ms)
+{
+	char *dirname = strdup(usb_sched.hub_prefix);
+	char *base = NULL;
+	char *prefix = NULL;
+	struct dirent *ep;
+	int res = 0;
+
+	char *sep = (dirname) ? strrchr(dirname, '/') : NULL;
+	if (!sep) {
+		free(dirname);
+		return 0;
+	}
+	*sep = '\0';
+	base = sep + 1;
+	if (asprintf(&prefix, "%s.wait.", base) < 0) {
+		free(dirname);
+		return 0;
+	}
+	size_t prefix_len = strlen(prefix);
+	DIR *dir = opendir(dirname);
+	while (dir && !res && (ep = readdir(dir))) {
+		int pid = 0;
+		long long other_ms = 0;
+		if (strncmp(ep->d_name, prefix, prefix_len) != 0 || sscanf(ep->d_name + prefix_len, "%d.%lld", &pid, &other_ms) != 2 || pid == (int)getpid()) {
+			continue;
+		}
+		char *path = NULL;
+		if (asprintf(&path, "%s/%s", dirname, ep->d_name) < 0) {
+			break;
+		}
+		int fd = open(path, O_RDWR);
+		if (fd >= 0) {
+			if (lock_file(fd, 1) == 0) {
+				remove(path);
+			} else if (other_ms > job_ms) {
+				res = 1;
+			}
+			close(fd);
+		}
+		free(path);
+	}
+	if (dir) {
+		closedir(dir);
+	}
+	free(prefix);
+	free(dirname);
+
+	return res;
+}
+
+/*
+ * Waits until the device's hub and controller have a free upload slot for
+ * an upload of the given size (0 if unknown).
+ */
+static void usb_slots_acquire(uint64_t bytes)
+{
+	int span = 0;
+	int waiting = 0;
+
+	if (!usb_sched.enabled) {
+		return;
+	}
+	int64_t job_ms = history_predict_ms(&history_upload, bytes);
+	while (1) {
+		if (usb_longer_job_waiting(job_ms)) {
+			/* don't hold a hub slot the longer upload might need */
+			usb_slots_release();
+			goto wait;
+		}
+		/* always hub first, so runs never wait for each other in a cycle */
+		if (usb_sched.hub_fd < 0) {
+			usb_sched.hub_fd = usb_slot_try(usb_sched.hub_prefix, usb_hub_slots);
+		}
+		if (usb_sched.hub_fd >= 0) {
+			usb_sched.controller_fd = usb_slot_try(usb_sched.controller_prefix, usb_controller_slots);
+			if (usb_sched.controller_fd >= 0) {
+				break;
+			}
+		}
+		if (usb_sched.hub_fd == -2 || usb_sched.controller_fd == -2) {
+			usb_slots_release();
+			usb_sched.enabled = 0;
+			break;
+		}
+wait:
+		if (!waiting) {
+			output_begin("Waiting for a free USB upload slot... ");
+			progress_phase("queued");
+			span = trace_begin("queued", NULL);
+			if (job_ms >= 0) {
+				usb_wait_announce(job_ms);
+			}
+			waiting = 1;
+		}
+		wait_ms(USB_SLOTS_POLL_MS);
+	}
+	if (waiting) {
+		usb_wait_done();
+		trace_end(span);
+		output_end((usb_sched.enabled) ? "OK\n" : "\n");
+	}
+}
+
+static void usb_sched_free(void)
+{
+	usb_wait_done();
+	usb_slots_release();
+	free(usb_sched.hub_prefix);
+	free(usb_sched.controller_prefix);
+	usb_sched.hub_prefix = NULL;
+	usb_sched.controller_prefix = NULL;
+	usb_sched.enabled = 0;
+}
+
+/* appends str to the plist array unless it is already contained */
+static void string_array_add_unique(plist_t array, const char *str)
+{
+	uint32_t i;
+	for (i = 0; i < plist_array_get_size(array); i++) {
+		if (!plist_string_val_compare(plist_array_get_item(array, i), str)) {
+			return;
+		}
+	}
+	plist_array_append_item(array, plist_new_string(str));
+}
+
+/* matches str against a shell-style pattern with * and ? wildcards */
+static int glob_match(const char *pattern, const char *str)
+{
+	const char *star = NULL;
+	const char *resume = NULL;
+
+	while (*str) {
+		if (*pattern == '*') {
+			star = pattern++;
+			resume = str;
+		} else if (*pattern == '?' || *pattern == *str) {
+			pattern++;
+			str++;
+		} else if (star) {
+			pattern = star + 1;
+			str = ++resume;
+		} else {
+			return 0;
+		}
+	}
+	while (*pattern == '*') {
+		pattern++;
+	}
+	return (*pattern == '\0');
+}
+
+/* appends the bundle identifiers of all apps matching one of the patterns to ids */
+static int uninstall_resolve_patterns(instproxy_client_t ipc, plist_t patterns, plist_t ids)
+{
+	plist_t client_opts = instproxy_client_options_new();
+	plist_t apps = NULL;
+	uint32_t i, j;
+
+	if (opt_list_system && opt_list_user) {
+		/* all apps */
+	} else if (opt_list_system) {
+		instproxy_client_options_add(client_opts, "ApplicationType", "System", NULL);
+	} else {
+		instproxy_client_options_add(client_opts, "ApplicationType", "User", NULL);
+	}
+	/* the identifiers are all that is needed, keep the reply small */
+	instproxy_client_options_set_return_attributes(client_opts, "CFBundleIdentifier", NULL);
+
+	uint64_t browse_start = get_monotonic_us();
+	instproxy_error_t ierr = instproxy_browse(ipc, client_opts, &apps);
+	metrics_observe_browse(seconds_since(browse_start));
+	instproxy_client_options_free(client_opts);
+	if (ierr != INSTPROXY_E_SUCCESS || !apps || plist_get_node_type(apps) != PLIST_ARRAY) {
+		fprintf(stderr, "ERROR: Could not get list of apps from device (%d)\n", ierr);
+		plist_free(apps);
+		return -1;
+	}
+
+	for (i = 0; i < plist_array_get_size(apps); i++) {
+		plist_t node = plist_dict_get_item(plist_array_get_item(apps, i), "CFBundleIdentifier");
+		const char *bundle_id = plist_get_string_ptr(node, NULL);
+		if (!bundle_id) {
+			continue;
+		}
+		for (j = 0; j < plist_array_get_size(patterns); j++) {
+			if (glob_match(plist_get_string_ptr(plist_array_get_item(patterns, j), NULL), bundle_id)) {
+				string_array_add_unique(ids, bundle_id);
+				break;
+			}
+		}
+	}
+	plist_free(apps);
+
+	return 0;
+}
+
+/*
+ * list --watch prints the installed apps and then one event per change as
+ * JSON lines. An app installed/uninstalled notification triggers a browse
+ * of only the identifiers and versions, which is compared with the known
+ * inventory; the details are fetched for added and updated apps only.
+ */
+#define WATCH_SETTLE_MS 250
+
+static const char *watch_app_string(plist_t app, const char *key)
+{
+	plist_t node = plist_dict_get_item(app, key);
+	if (!node || plist_get_node_type(node) != PLIST_STRING) {
+		return NULL;
+	}
+	return plist_get_string_ptr(node, NULL);
+}
+
+/* browses the apps selected for listing, returns a dictionary of the apps by bundle identifier */
+static instproxy_error_t watch_browse(instproxy_client_t ipc, plist_t ids, int details, plist_t *inventory)
+{
+	plist_t client_opts = instproxy_client_options_new();
+	plist_t apps = NULL;
+	uint32_t i;
+
+	if (opt_list_system && opt_list_user) {
+		/* all apps */
+	} else if (opt_list_system) {
+		instproxy_client_options_add(client_opts, "ApplicationType", "System", NULL);
+	} else {
+		instproxy_client_options_add(client_opts, "ApplicationType", "User", NULL);
+	}
+	if (ids) {
+		plist_dict_set_item(client_opts, "BundleIDs", plist_copy(ids));
+	}
+	if (details) {
+		instproxy_client_options_set_return_attributes(client_opts, "CFBundleIdentifier", "CFBundleVersion", "CFBundleShortVersionString", "CFBundleDisplayName", NULL);
+	} else {
+		instproxy_client_options_set_return_attributes(client_opts, "CFBundleIdentifier", "CFBundleVersion", "CFBundleShortVersionString", NULL);
+	}
+
+	int span = trace_begin("browse", NULL);
+	uint64_t browse_start = get_monotonic_us();
+	instproxy_error_t ierr = instproxy_browse(ipc, client_opts, &apps);
+	metrics_observe_browse(seconds_since(browse_start));
+	trace_end(span);
+	instproxy_client_options_free(client_opts);
+	if (ierr == INSTPROXY_E_SUCCESS && (!apps || plist_get_node_type(apps) != PLIST_ARRAY)) {
+		ierr = INSTPROXY_E_PLIST_ERROR;
+	}
+	if (ierr != INSTPROXY_E_SUCCESS) {
+		plist_free(apps);
+		return ierr;
+	}
+
+	*inventory = plist_new_dict();
+	for (i = 0; i < plist_array_get_size(apps); i++) {
+		plist_t app = plist_array_get_item(apps, i);
+		const char *bundle_id = watch_app_string(app, "CFBundleIdentifier");
+		if (bundle_id) {
+			plist_dict_set_item(*inventory, bundle_id, plist_copy(app));
+		}
+	}
+	plist_free(apps);
+
+	return INSTPROXY_E_SUCCESS;
+}
+
+/* like watch_browse(), but reconnects installation_proxy after transient errors */
+static plist_t watch_browse_retry(idevice_t device, lockdownd_client_t *client, instproxy_client_t *ipc, plist_t ids, int details)
+{
+	plist_t inventory = NULL;
+	int attempt = 0;
+	char reason[32];
+
+	while (1) {
+		instproxy_error_t ierr = watch_browse(*ipc, ids, details, &inventory);
+		if (ierr == INSTPROXY_E_SUCCESS) {
+			return inventory;
+		}
+		snprintf(reason, sizeof(reason), "error %d", ierr);
+		if (!is_device_connected || !instproxy_error_is_transient(ierr) || !retry_wait(&attempt, "Browsing apps", reason)) {
+			fprintf(stderr, "ERROR: Could not get list of apps from device (%d)\n", ierr);
+			return NULL;
+		}
+		instproxy_client_free(*ipc);
+		*ipc = NULL;
+		if (service_connect(device, client, "com.apple.mobile.installation_proxy", "installation_proxy", instproxy_connect, ipc) < 0) {
+			return NULL;
+		}
+	}
+}
+
+static void watch_event(const char *event, const char *bundle_id, plist_t app, plist_t previous)
+{
+	struct progress_event ev;
+	const char *value;
+
+	progress_event_begin(&ev, event);
+	progress_event_append_string(&ev, "udid", udid);
+	progress_event_append_string(&ev, "bundle_id", bundle_id);
+	if ((value = watch_app_string(app, "CFBundleVersion"))) {
+		progress_event_append_string(&ev, "version", value);
+	}
+	if ((value = watch_app_string(app, "CFBundleShortVersionString"))) {
+		progress_event_append_string(&ev, "short_version", value);
+	}
+	if ((value = watch_app_string(app, "CFBundleDisplayName"))) {
+		progress_event_append_string(&ev, "name", value);
+	}
+	if (previous) {
+		if ((value = watch_app_string(previous, "CFBundleVersion"))) {
+			progress_event_append_string(&ev, "previous_version", value);
+		}
+		if ((value = watch_app_string(previous, "CFBundleShortVersionString"))) {
+			progress_event_append_string(&ev, "previous_short_version", value);
+		}
+	}
+	progress_event_append(&ev, "}\n");
+	fputs(ev.data, stdout);
+}
+
+static int watch_app_changed(plist_t app, plist_t previous)
+{
+	static const char *keys[] = { "CFBundleVersion", "CFBundleShortVersionString" };
+	size_t i;
+	for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+		const char *a = watch_app_string(app, keys[i]);
+		const char *b = watch_app_string(previous, keys[i]);
+		if ((a || b) && (!a || !b || strcmp(a, b) != 0)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* emits the events for the differences between the inventories, fetching details of new versions */
+static int watch_emit_changes(idevice_t device, lockdownd_client_t *client, instproxy_client_t *ipc, plist_t inventory, plist_t current)
+{
+	plist_t changed = plist_new_array();
+	plist_dict_iter iter = NULL;
+	char *bundle_id = NULL;
+	plist_t app = NULL;
+
+	plist_dict_new_iter(inventory, &iter);
+	while (1) {
+		plist_dict_next_item(inventory, iter, &bundle_id, &app);
+		if (!app) {
+			break;
+		}
+		if (!plist_dict_get_item(current, bundle_id)) {
+			watch_event("remove", bundle_id, app, NULL);
+		}
+		free(bundle_id);
+		bundle_id = NULL;
+	}
+	free(iter);
+
+	iter = NULL;
+	plist_dict_new_iter(current, &iter);
+	while (1) {
+		plist_dict_next_item(current, iter, &bundle_id, &app);
+		if (!app) {
+			break;
+		}
+		plist_t previous = plist_dict_get_item(inventory, bundle_id);
+		if (!previous || watch_app_changed(app, previous)) {
+			string_array_add_unique(changed, bundle_id);
+		}
+		free(bundle_id);
+		bundle_id = NULL;
+	}
+	free(iter);
+
+	if (plist_array_get_size(changed) == 0) {
+		plist_free(changed);
+		return 0;
+	}
+
+	plist_t details = watch_browse_retry(device, client, ipc, changed, 1);
+	uint32_t i;
+	for (i = 0; i < plist_array_get_size(changed); i++) {
+		const char *id = plist_get_string_ptr(plist_array_get_item(changed, i), NULL);
+		plist_t previous = plist_dict_get_item(inventory, id);
+		app = (details) ? plist_dict_get_item(details, id) : NULL;
+		if (!app) {
+			/* gone again in the meantime, or details not available */
+			app = plist_dict_get_item(current, id);
+		}
+		watch_event((previous) ? "update" : "add", id, app, previous);
+	}
+	plist_free(details);
+	plist_free(changed);
+
+	return (details) ? 0 : -1;
+}
+
+static int list_watch(idevice_t device, lockdownd_client_t *client, instproxy_client_t *ipc)
+{
+	struct progress_event ev;
+	int res = 0;
+
+	is_device_connected = 1;
+	ignore_events = 0;
+	idevice_event_subscribe(idevice_event_callback, NULL);
+
+	notified = 0;
+	plist_t inventory = watch_browse_retry(device, client, ipc, bundle_ids, 1);
+	if (!inventory) {
+		res = -1;
+	} else {
+		plist_dict_iter iter = NULL;
+		char *bundle_id = NULL;
+		plist_t app = NULL;
+		plist_dict_new_iter(inventory, &iter);
+		while (1) {
+			plist_dict_next_item(inventory, iter, &bundle_id, &app);
+			if (!app) {
+				break;
+			}
+			watch_event("app", bundle_id, app, NULL);
+			free(bundle_id);
+			bundle_id = NULL;
+		}
+		free(iter);
+		progress_event_begin(&ev, "ready");
+		progress_event_append_string(&ev, "udid", udid);
+		progress_event_append(&ev, ",\"count\":%u}\n", plist_dict_get_size(inventory));
+		fputs(ev.data, stdout);
+	}
+
+	while (res == 0 && is_device_connected) {
+		if (!notified) {
+			wait_ms(50);
+			continue;
+		}
+		/* an install posts several notifications, let them settle */
+		wait_ms(WATCH_SETTLE_MS);
+		notified = 0;
+		plist_t current = watch_browse_retry(device, client, ipc, bundle_ids, 0);
+		if (!current) {
+			res = -1;
+			break;
+		}
+		res = watch_emit_changes(device, client, ipc, inventory, current);
+		plist_free(inventory);
+		inventory = current;
+	}
+	if (!is_device_connected) {
+		res = -1;
+	}
+
+	ignore_events = 1;
+	idevice_event_unsubscribe();
+	plist_free(inventory);
+
+	return res;
+}
+
+/*
+ * Removing many apps one by one is dominated by the round-trips of the
+ * individual commands. The removals are spread over several instproxy
+ * connections (see --uninstall-connections), each running one (synchronous)
+ * uninstall command at a time. The removal is complete when the command
+ * returns, so there is nothing to wait for with --notify-wait.
+ */
+
+struct uninstall_batch {
+	mutex_t mutex;
+	idevice_t device;
+	plist_t ids;
+	uint32_t next;
+	int failed;
+};
+
+static void uninstall_batch_run(struct uninstall_batch *batch, instproxy_client_t client)
+{
+	while (1) {
+		const char *bundle_id = NULL;
+		mutex_lock(&batch->mutex);
+		if (batch->next < plist_array_get_size(batch->ids)) {
+			bundle_id = plist_get_string_ptr(plist_array_get_item(batch->ids, batch->next++), NULL);
+		}
+		mutex_unlock(&batch->mutex);
+		if (!bundle_id) {
+			break;
+		}
+		instproxy_error_t ierr = instproxy_uninstall(client, bundle_id, NULL, NULL, NULL);
+		mutex_lock(&batch->mutex);
+		if (ierr == INSTPROXY_E_SUCCESS) {
+			printf("Uninstalled '%s'\n", bundle_id);
+		} else {
+			fprintf(stderr, "ERROR: Uninstalling '%s' failed (%d)\n", bundle_id, ierr);
+			batch->failed++;
+		}
+		progress_package(NULL, bundle_id, (ierr == INSTPROXY_E_SUCCESS) ? "success" : "failure");
+		mutex_unlock(&batch->mutex);
+	}
+}
+
+static void* uninstall_batch_thread(void *arg)
+{
+	struct uninstall_batch *batch = (struct uninstall_batch*)arg;
+	instproxy_client_t client = NULL;
+
+	if (instproxy_client_start_service(batch->device, &client, "ideviceinstaller") != INSTPROXY_E_SUCCESS) {
+		return NULL;
+	}
+	uninstall_batch_run(batch, client);
+	instproxy_client_free(client);
+	return NULL;
+}
+
+/* uninstalls all apps in ids, returns the number of failed removals */
+static int uninstall_batch(idevice_t device, instproxy_client_t ipc, plist_t ids)
+{
+	struct uninstall_batch batch;
+	THREAD_T workers[UNINSTALL_CONNECTIONS_LIMIT];
+	int num_workers = 0;
+	uint32_t i;
+
+	memset(&batch, 0, sizeof(batch));
+	mutex_init(&batch.mutex);
+	batch.device = device;
+	batch.ids = ids;
+
+	for (i = 1; i < (uint32_t)uninstall_connections && i < plist_array_get_size(ids); i++) {
+		if (thread_new(&workers[num_workers], uninstall_batch_thread, &batch) == 0) {
+			num_workers++;
+		}
+	}
+	uninstall_batch_run(&batch, ipc);
+	for (i = 0; i < (uint32_t)num_workers; i++) {
+		thread_join(workers[i]);
+		thread_free(workers[i]);
+	}
+	mutex_destroy(&batch.mutex);
+
+	printf("Uninstalled %u of %u apps\n", plist_array_get_size(ids) - batch.failed, plist_array_get_size(ids));
+
+	return batch.failed;
+}
+
+/*
+ * Compares two version strings component by component (numerically where
+ * possible, so that 1.10 > 1.9). Returns <0, 0 or >0 like strcmp.
+ */
+static int version_compare(const char *a, const char *b)
+{
+	while (*a || *b) {
+		if (isdigit((unsigned char)*a) && isdigit((unsigned char)*b)) {
+			char *enda = NULL;
+			char *endb = NULL;
+			unsigned long long va = strtoull(a, &enda, 10);
+			unsigned long long vb = strtoull(b, &endb, 10);
+			if (va != vb) {
+				return (va < vb) ? -1 : 1;
+			}
+			a = enda;
+			b = endb;
+		} else if (*a == '\0' || *b == '\0') {
+			/* 1.2 == 1.2.0, but 1.2 < 1.2.1 */
+			const char *rest = (*a) ? a : b;
+			while (*rest == '.' || *rest == '0') {
+				rest++;
+			}
+			if (*rest == '\0') {
+				return 0;
+			}
+			return (*a) ? 1 : -1;
+		} else if (*a != *b) {
+			return (unsigned char)*a - (unsigned char)*b;
+		} else {
+			a++;
+			b++;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Checks whether the app from a package needs to be installed, according
+ * to --if-newer or --if-different. Uses its own instproxy connection since
+ * the main one may be busy with the install of the previous package.
+ * Returns 1 if the installed app is current and the package can be
+ * skipped, 0 otherwise.
+ */
+static int package_is_current(idevice_t device, struct pkg_info *pinfo)
+{
+	instproxy_client_t client = NULL;
+	plist_t client_opts = NULL;
+	plist_t apps = NULL;
+	char *installed_version = NULL;
+	char *installed_short_version = NULL;
+	int res = 0;
+
+	if (!skip_mode || !pinfo->bundle_id) {
+		return 0;
+	}
+	if (instproxy_client_start_service(device, &client, "ideviceinstaller") != INSTPROXY_E_SUCCESS) {
+		return 0;
+	}
+	client_opts = instproxy_client_options_new();
+	plist_t ids = plist_new_array();
+	plist_array_append_item(ids, plist_new_string(pinfo->bundle_id));
+	plist_dict_set_item(client_opts, "BundleIDs", ids);
+	instproxy_client_options_set_return_attributes(client_opts, "CFBundleIdentifier", "CFBundleVersion", "CFBundleShortVersionString", NULL);
+	uint64_t browse_start = get_monotonic_us();
+	instproxy_error_t ierr = instproxy_browse(client, client_opts, &apps);
+	metrics_observe_browse(seconds_since(browse_start));
+	if (ierr == INSTPROXY_E_SUCCESS && apps && plist_array_get_size(apps) > 0) {
+		plist_t app = plist_array_get_item(apps, 0);
+		plist_t node = plist_dict_get_item(app, "CFBundleVersion");
+		if (node) {
+			plist_get_string_val(node, &installed_version);
+		}
+		node = plist_dict_get_item(app, "CFBundleShortVersionString");
+		if (node) {
+			plist_get_string_val(node, &installed_short_version);
+		}
+	}
+	plist_free(apps);
+	instproxy_client_options_free(client_opts);
+	instproxy_client_free(client);
+
+	const char *pkg_version = (pinfo->bundle_version) ? pinfo->bundle_version : pinfo->bundle_short_version;
+	const char *dev_version = (pinfo->bundle_version) ? installed_version : installed_short_version;
+	if (pkg_version && dev_version) {
+		int cmp = version_compare(pkg_version, dev_version);
+		if (skip_mode == SKIP_IF_NEWER) {
+			res = (cmp <= 0);
+		} else {
+			const char *pkg_short = (pinfo->bundle_short_version) ? pinfo->bundle_short_version : "";
+			const char *dev_short = (installed_short_version) ? installed_short_version : "";
+			res = (cmp == 0 && strcmp(pkg_short, dev_short) == 0);
+		}
+		if (res) {
+			output_line("Skipping '%s': version %s (%s) is installed, package has %s (%s)\n", pinfo->bundle_id,
+				(installed_short_version) ? installed_short_version : "-", (installed_version) ? installed_version : "-",
+				(pinfo->bundle_short_version) ? pinfo->bundle_short_version : "-", (pinfo->bundle_version) ? pinfo->bundle_version : "-");
+		}
+	}
+	free(installed_version);
+	free(installed_short_version);
+
+	return res;
+}
+
+/* a package that has been uploaded to the staging directory on the device */
+struct staged_package {
+	char *pkgname;
+	char *bundle_id;
+	char *bundle_version;
+	plist_t client_opts;
+	uint64_t size;
+};
+
+static void staged_package_free(struct staged_package *spkg)
+{
+	free(spkg->pkgname);
+	free(spkg->bundle_id);
+	free(spkg->bundle_version);
+	instproxy_client_options_free(spkg->client_opts);
+	memset(spkg, 0, sizeof(struct staged_package));
+}
+
+/*
+ * Uploads the package (.ipa, .ipcc or .app directory) at path to the
+ * device and prepares the options to install it. If the package is the
+ * one zv is checking, waits for the check; otherwise runs it when
+ * requested. Returns 0 on success, 1 if the package was skipped because
+ * the installed app is current (see --if-newer) or -1 on error.
+ */
+static int stage_package(idevice_t device, afc_client_t *afc, char *path, struct zip_verify *zv, struct staged_package *spkg)
+{
+	plist_t client_opts = NULL;
+	plist_t sinf = NULL;
+	plist_t meta = NULL;
+	char *pkgname = NULL;
+	char *staged_path = NULL;
+	struct zip *zf = NULL;
+	struct mem_arena arena = { NULL };
+	struct pkg_info pinfo;
+	struct stat fst;
+	int res = -1;
+	int span = trace_begin("stage", path);
+
+	memset(spkg, 0, sizeof(struct staged_package));
+	memset(&pinfo, 0, sizeof(pinfo));
+
+	int from_stdin = (strcmp(path, "-") == 0);
+	if (from_stdin) {
+		memset(&fst, 0, sizeof(fst));
+#ifdef WIN32
+		_setmode(_fileno(stdin), _O_BINARY);
+#endif
+	} else if (stat(path, &fst) != 0) {
+		fprintf(stderr, "ERROR: stat: %s: %s\n", path, strerror(errno));
+		goto leave;
+	}
+
+	if (verify_package && !zv->path && !from_stdin && S_ISREG(fst.st_mode)) {
+		zip_verify_start(zv, path);
+	}
+	if (zv->path) {
+		progress_phase("verify");
+		int verify_span = trace_begin("verify", NULL);
+		if (zip_verify_finish(zv) < 0) {
+			goto leave;
+		}
+		trace_end(verify_span);
+	}
+
+	client_opts = instproxy_client_options_new();
+
+	/* open install package */
+	int errp = 0;
+
+	if ((strlen(path) > 5) && (strcmp(&path[strlen(path)-5], ".ipcc") == 0)) {
+		zf = zip_open(path, 0, &errp);
+		if (!zf) {
+			fprintf(stderr, "ERROR: zip_open: %s: %d\n", path, errp);
+			goto leave;
+		}
+
+		char* ipcc = strdup(path);
+		if ((asprintf(&pkgname, "%s/%s", PKG_PATH, basename(ipcc)) > 0) && pkgname) {
+			afc_make_directory(*afc, pkgname);
+		}
+
+		uint64_t total_bytes = 0;
+		uint64_t total_files = 0;
+		zip_get_totals(zf, &total_bytes, &total_files);
+
+		usb_slots_acquire(total_bytes);
+		output_begin("Uploading %s package contents... ", basename(ipcc));
+		progress_transfer_begin("upload", total_bytes, total_files);
+		uint64_t upload_start = get_monotonic_us();
+
+		struct upload_queue queue;
+		if (upload_queue_init(&queue, device, afc, zf, path) < 0) {
+			free(ipcc);
+			goto leave;
+		}
+
+		/* extract the contents of the .ipcc file to PublicStaging/<name>.ipcc directory */
+		zip_int64_t numzf = (zip_int64_t)zip_get_num_entries(zf, 0);
+		zip_int64_t i = 0;
+		for (i = 0; numzf > 0 && i < numzf; i++) {
+			const char* zname = zip_get_name(zf, i, 0);
+			if (!zname) continue;
+			char* dstpath = arena_build_path(&queue.arena, pkgname, zname, NULL);
+			if (!dstpath) {
+				fprintf(stderr, "ERROR: Out of memory!?\n");
+				continue;
+			}
+			if (zname[strlen(zname)-1] == '/') {
+				// directory
+				afc_make_directory(*afc, dstpath);
+			} else {
+				// file
+				upload_queue_add(&queue, NULL, i, dstpath);
+			}
+		}
+		free(ipcc);
+		int failed = upload_queue_finish(&queue);
+		progress_transfer_end();
+		usb_slots_release();
+		if (failed > 0) {
+			output_end("FAILED\n");
+			fprintf(stderr, "ERROR: Failed to upload %d file(s) from package.\n", failed);
+			goto leave;
+		}
+		output_end("DONE.\n");
+		history_record(HISTORY_UPLOAD, total_bytes, get_monotonic_us() - upload_start);
+		spkg->size = total_bytes;
+
+		instproxy_client_options_add(client_opts, "PackageType", "CarrierBundle", NULL);
+	} else if (S_ISDIR(fst.st_mode)) {
+		/* extract the CFBundleIdentifier from the package */
+
+		/* construct full filename to Info.plist */
+		char *filename = (char*)malloc(strlen(path)+11+1);
+		strcpy(filename, path);
+		strcat(filename, "/Info.plist");
+
+		int parse_span = trace_begin("parse", NULL);
+		int pres = pkg_info_from_file(filename, &pinfo);
+		trace_end(parse_span);
+		free(filename);
+		if (pres < 0) {
+			goto leave;
+		}
+		if (pinfo.bundle_id) {
+			spkg->bundle_id = strdup(pinfo.bundle_id);
+		}
+		if (pinfo.bundle_version) {
+			spkg->bundle_version = strdup(pinfo.bundle_version);
+		}
+		if (package_is_current(device, &pinfo)) {
+			res = 1;
+			goto leave;
+		}
+
+		/* upload developer app directory */
+		instproxy_client_options_add(client_opts, "PackageType", "Developer", NULL);
+
+		if (asprintf(&pkgname, "%s/%s", PKG_PATH, basename(path)) < 0) {
+			fprintf(stderr, "ERROR: Out of memory allocating pkgname!?\n");
+			goto leave;
+		}
+
+		uint64_t total_bytes = 0;
+		uint64_t total_files = 0;
+		dir_get_totals(path, &total_bytes, &total_files);
+
+		usb_slots_acquire(total_bytes);
+		output_begin("Uploading %s package contents... ", basename(path));
+		progress_transfer_begin("upload", total_bytes, total_files);
+		uint64_t upload_start = get_monotonic_us();
+		struct upload_queue queue;
+		if (upload_queue_init(&queue, device, afc, NULL, NULL) < 0) {
+			goto leave;
+		}
+		afc_upload_dir(&queue, path, pkgname);
+		int failed = upload_queue_finish(&queue);
+		progress_transfer_end();
+		usb_slots_release();
+		if (failed > 0) {
+			output_end("FAILED\n");
+			fprintf(stderr, "ERROR: Failed to upload %d file(s) from app directory.\n", failed);
+			goto leave;
+		}
+		output_end("DONE.\n");
+		history_record(HISTORY_UPLOAD, total_bytes, get_monotonic_us() - upload_start);
+		spkg->size = total_bytes;
+	} else {
+		char *pkgpath = (use_cache && !from_stdin) ? pkg_cache_canonical_path(path) : NULL;
+		if (from_stdin) {
+			/* stream the package to the device and parse it from there, without a local copy */
+			if (asprintf(&staged_path, "%s/.stdin-%d.ipa", PKG_PATH, (int)getpid()) < 0) {
+				staged_path = NULL;
+				fprintf(stderr, "Out of memory!?\n");
+				goto leave;
+			}
+
+			usb_slots_acquire(0);
+			output_begin("Copying package from stdin to device... ");
+
+			struct afc_transfer xfer;
+			if (afc_transfer_init(&xfer, device, 1048576) < 0) {
+				goto leave;
+			}
+			sha256_ctx digest;
+			uint64_t size = 0;
+			sha256_init(&digest);
+			progress_transfer_begin("upload", 0, 1);
+			uint64_t upload_start = get_monotonic_us();
+			int upload_res = afc_upload_stream(afc, &xfer, stdin, staged_path, &digest, &size);
+			if (upload_res == 0) {
+				progress_transfer_file_done();
+			}
+			progress_transfer_end();
+			usb_slots_release();
+			afc_transfer_free(&xfer);
+			if (upload_res < 0) {
+				output_end("FAILED\n");
+				goto leave;
+			}
+			output_end("DONE.\n");
+			history_record(HISTORY_UPLOAD, size, get_monotonic_us() - upload_start);
+			spkg->size = size;
+
+			unsigned char md[SHA256_DIGEST_LENGTH];
+			char hex[SHA256_DIGEST_LENGTH*2+1];
+			sha256_final(&digest, md);
+			sha256_to_hex(md, hex);
+			output_line("Received %" PRIu64 " bytes, SHA-256: %s\n", size, hex);
+			progress_digest(staged_path, size, hex);
+			if (use_digest && afc_verify_upload(*afc, staged_path, NULL, size, 0) < 0) {
+				goto leave;
+			}
+
+			int parse_span = trace_begin("parse", NULL);
+			zf = afc_zip_open(*afc, staged_path, size);
+			if (!zf) {
+				goto leave;
+			}
+			int pres = pkg_info_from_zip(zf, &arena, &pinfo);
+			zip_close(zf);
+			zf = NULL;
+			if (pres < 0) {
+				goto leave;
+			}
+			trace_end(parse_span);
+		} else {
+			int parse_span = trace_begin("parse", NULL);
+			if (!pkgpath || pkg_cache_load(pkgpath, &fst, &pinfo) < 0) {
+				zf = zip_open(path, 0, &errp);
+				if (!zf) {
+					fprintf(stderr, "ERROR: zip_open: %s: %d\n", path, errp);
+					free(pkgpath);
+					goto leave;
+				}
+				if (pkg_info_from_zip(zf, &arena, &pinfo) < 0) {
+					free(pkgpath);
+					goto leave;
+				}
+				if (pkgpath) {
+					pkg_cache_store(pkgpath, &fst, &pinfo);
+				}
+			}
+			trace_end(parse_span);
+		}
+		free(pkgpath);
+		if (pinfo.bundle_id) {
+			spkg->bundle_id = strdup(pinfo.bundle_id);
+		}
+		if (pinfo.bundle_version) {
+			spkg->bundle_version = strdup(pinfo.bundle_version);
+		}
+		if (package_is_current(device, &pinfo)) {
+			res = 1;
+			goto leave;
+		}
+
+		if (extmeta) {
+			size_t flen = 0;
+			char *zbuf = buf_from_file(extmeta, &flen);
+			plist_t meta_dict = NULL;
+			if (zbuf && flen) {
+				plist_from_memory(zbuf, flen, &meta_dict, NULL);
+				if (meta_dict) {
+					meta = plist_new_data(zbuf, flen);
+					plist_free(meta_dict);
+				}
+			}
+			free(zbuf);
+			if (!meta) {
+				fprintf(stderr, "WARNING: could not load external iTunesMetadata %s!\n", extmeta);
+			}
+		}
+		if (!meta) {
+			if (pinfo.meta) {
+				meta = plist_new_data(pinfo.meta, pinfo.meta_len);
+			} else {
+				fprintf(stderr, "WARNING: could not locate %s in archive!\n", ITUNES_METADATA_PLIST_FILENAME);
+			}
+		}
+
+		if (extsinf) {
+			size_t flen = 0;
+			char *zbuf = buf_from_file(extsinf, &flen);
+			if (zbuf && flen) {
+				sinf = plist_new_data(zbuf, flen);
+			} else {
+				fprintf(stderr, "WARNING: could not load external SINF %s!\n", extsinf);
+			}
+			free(zbuf);
+		}
+		if (!sinf) {
+			if (pinfo.sinf) {
+				sinf = plist_new_data(pinfo.sinf, pinfo.sinf_len);
+			} else {
+				fprintf(stderr, "WARNING: could not locate Payload/%s.app/SC_Info/%s.sinf in archive!\n", pinfo.bundle_executable, pinfo.bundle_executable);
+			}
+		}
+
+		/* copy archive to device */
+		pkgname = NULL;
+		if (asprintf(&pkgname, "%s/%s", PKG_PATH, spkg->bundle_id) < 0) {
+			fprintf(stderr, "Out of memory!?\n");
+			goto leave;
+		}
+
+		if (from_stdin) {
+			/* already on the device, just move it into place */
+			afc_error_t aerr = afc_rename_path(*afc, staged_path, pkgname);
+			if (aerr != AFC_E_SUCCESS) {
+				fprintf(stderr, "ERROR: Could not rename '%s' to '%s' on device: %d\n", staged_path, pkgname, aerr);
+				goto leave;
+			}
+			free(staged_path);
+			staged_path = NULL;
+		} else {
+			usb_slots_acquire(fst.st_size);
+			output_begin("Copying '%s' to device... ", path);
+
+			struct afc_transfer xfer;
+			if (afc_transfer_init(&xfer, device, 1048576) < 0) {
+				goto leave;
+			}
+			FILE *pf = fopen(path, "rb");
+			if (!pf) {
+				fprintf(stderr, "fopen: %s: %s\n", path, strerror(errno));
+				afc_transfer_free(&xfer);
+				goto leave;
+			}
+			/* the digest is computed over the same buffers that are sent to the device */
+			sha256_ctx digest;
+			uint64_t size = 0;
+			sha256_init(&digest);
+			progress_transfer_begin("upload", fst.st_size, 1);
+			uint64_t upload_start = get_monotonic_us();
+			int upload_res = afc_upload_stream(afc, &xfer, pf, pkgname, (use_digest) ? &digest : NULL, &size);
+			if (upload_res == 0) {
+				progress_transfer_file_done();
+			}
+			progress_transfer_end();
+			usb_slots_release();
+			afc_transfer_free(&xfer);
+			if (upload_res < 0) {
+				output_end("FAILED\n");
+				fclose(pf);
+				goto leave;
+			}
+
+			output_end("DONE.\n");
+			history_record(HISTORY_UPLOAD, fst.st_size, get_monotonic_us() - upload_start);
+			spkg->size = fst.st_size;
+
+			if (use_digest) {
+				unsigned char md[SHA256_DIGEST_LENGTH];
+				char hex[SHA256_DIGEST_LENGTH*2+1];
+				sha256_final(&digest, md);
+				sha256_to_hex(md, hex);
+				output_line("SHA-256: %s\n", hex);
+				progress_digest(pkgname, size, hex);
+				upload_res = afc_verify_upload(*afc, pkgname, pf, size, digest_samples);
+			}
+			fclose(pf);
+			if (upload_res < 0) {
+				goto leave;
 			}
-			free(fpath);
-			free(apath);
 		}
-		closedir(dir);
+
+		if (spkg->bundle_id) {
+			instproxy_client_options_add(client_opts, "CFBundleIdentifier", spkg->bundle_id, NULL);
+		}
+		if (sinf) {
+			instproxy_client_options_add(client_opts, "ApplicationSINF", sinf, NULL);
+		}
+		if (meta) {
+			instproxy_client_options_add(client_opts, "iTunesMetadata", meta, NULL);
+		}
 	}
-}
 
-static char *buf_from_file(const char *filename, size_t *size)
-{
-	struct stat st;
-	FILE *fp = NULL;
+	spkg->pkgname = pkgname;
+	spkg->client_opts = client_opts;
+	pkgname = NULL;
+	client_opts = NULL;
+	res = 0;
 
-	if (stat(filename, &st) == -1 || (fp = fopen(filename, "r")) == NULL) {
-		return NULL;
-	}
-	size_t filesize = st.st_size;
-	if (filesize == 0) {
-		return NULL;
-	}
-	char *ibuf = malloc(filesize * sizeof(char));
-	if (ibuf == NULL) {
-		return NULL;
+leave:
+	usb_slots_release();
+	if (zf) {
+		zip_unchange_all(zf);
+		zip_close(zf);
 	}
-	size_t amount = fread(ibuf, 1, filesize, fp);
-	if (amount != filesize) {
-		fprintf(stderr, "ERROR: could not read %" PRIu64 " bytes from %s\n", (uint64_t)filesize, filename);
-		free(ibuf);
-		return NULL;
+	if (staged_path) {
+		/* don't leave a partial or unused package behind */
+		afc_remove_path(*afc, staged_path);
+		free(staged_path);
 	}
-	fclose(fp);
-
-	if (size) {
-		*size = filesize;
+	instproxy_client_options_free(client_opts);
+	free(pkgname);
+	plist_free(sinf);
+	plist_free(meta);
+	pkg_info_free(&pinfo);
+	arena_free(&arena);
+	if (res < 0) {
+		staged_package_free(spkg);
 	}
+	trace_end(span);
 
-	return ibuf;
+	return res;
 }
 
+
 int main(int argc, char **argv)
 {
 	idevice_t device = NULL;
@@ -793,95 +5349,153 @@ int main(int argc, char **argv)
 	instproxy_error_t err;
 	np_client_t np = NULL;
 	afc_client_t afc = NULL;
-	lockdownd_service_descriptor_t service = NULL;
+	idi_operation_t op = NULL;
+	struct command_output output;
+	idi_error_t ierr = IDI_E_SUCCESS;
+	int command_started = 0;
 	int res = EXIT_FAILURE;
-	char *bundleidentifier = NULL;
+	struct zip_verify zverify;
+	int failed_stage = 0;
+	int device_removed = 0;
+
+	memset(&zverify, 0, sizeof(zverify));
+	memset(&output, 0, sizeof(output));
 
 #ifndef WIN32
 	signal(SIGPIPE, SIG_IGN);
 #endif
 	parse_opts(argc, argv);
 
+	mutex_init(&transfer_mutex);
+	mutex_init(&io_buffer_mutex);
+	mutex_init(&lockdownd_mutex);
+	mutex_init(&output_mutex);
+
+	if (trace_path && trace_open(trace_path) < 0) {
+		progress_result(EXIT_FAILURE);
+		return EXIT_FAILURE;
+	}
+	trace_begin("ideviceinstaller", NULL);
+	metrics_init(metrics_path, command_get_name(cmd));
+
+#ifndef WIN32
+	/* only draw a progress bar when a user is looking */
+	progress_bar = isatty(STDOUT_FILENO);
+#endif
+
 	argc -= optind;
 	argv += optind;
 
-	if (IDEVICE_E_SUCCESS != idevice_new_with_options(&device, udid, (use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX)) {
+	if (verify_package && (cmd == CMD_INSTALL || cmd == CMD_UPGRADE) && strcmp(cmdarg, "-") != 0) {
+		struct stat vst;
+		if (stat(cmdarg, &vst) == 0 && S_ISREG(vst.st_mode)) {
+			/* check the archive while the connection to the device is set up */
+			zip_verify_start(&zverify, cmdarg);
+		}
+	}
+
+	if (cmd == CMD_PLAN) {
+		char *history_file = history_get_filename();
+		res = (plan_run(history_file, cmdargs, num_cmdargs, udid, use_network, package_totals) == 0) ? 0 : 1;
+		free(history_file);
+		goto leave_cleanup;
+	}
+
+	progress_phase("connect");
+	int span = trace_begin("connect", NULL);
+
+	enum idevice_options lookup = (use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX;
+	if (auto_transport) {
+		lookup = transport_select(&udid, (cmd == CMD_INSTALL || cmd == CMD_UPGRADE));
+	}
+
+	if (IDEVICE_E_SUCCESS != idevice_new_with_options(&device, udid, lookup)) {
 		if (udid) {
 			fprintf(stderr, "No device found with udid %s.\n", udid);
 		} else {
 			fprintf(stderr, "No device found.\n");
 		}
+		progress_result(EXIT_FAILURE);
+		trace_close();
+		metrics_write(udid, EXIT_FAILURE);
+		metrics_free();
 		return EXIT_FAILURE;
 	}
 
 	if (!udid) {
 		idevice_get_udid(device, &udid);
 	}
+	trace_process_name(udid);
+	trace_end(span);
+
+	if (idi_operation_new(udid, lookup, &op) != IDI_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		goto leave_cleanup;
+	}
+	idi_operation_set_callbacks(op, status_cb, complete_cb, &output);
+
+	if (cmd == CMD_INSTALL || cmd == CMD_UPGRADE) {
+		history_network = ((lookup & IDEVICE_LOOKUP_NETWORK) != 0);
+		char *history_file = history_get_filename();
+		history_load(history_file, udid, history_network, &history_upload, &history_install);
+		free(history_file);
+		progress_rate_hint = history_rate(&history_upload);
+	}
+
+	if (usb_controller_slots > 0 && (cmd == CMD_INSTALL || cmd == CMD_UPGRADE) && !(lookup & IDEVICE_LOOKUP_NETWORK)) {
+		usb_sched_init(udid);
+	}
 
+	span = trace_begin("handshake", NULL);
 	lockdownd_error_t lerr = lockdownd_client_new_with_handshake(device, &client, "ideviceinstaller");
 	if (lerr != LOCKDOWN_E_SUCCESS) {
 		fprintf(stderr, "Could not connect to lockdownd: %s. Exiting.\n", lockdownd_strerror(lerr));
 		goto leave_cleanup;
 	}
+	trace_end(span);
 
-	if (use_notifier) {
-		lerr =lockdownd_start_service(client, "com.apple.mobile.notification_proxy", &service);
-		if (lerr != LOCKDOWN_E_SUCCESS) {
-			fprintf(stderr,	"Could not start com.apple.mobile.notification_proxy: %s\n", lockdownd_strerror(lerr));
-			goto leave_cleanup;
-		}
-
-		np_error_t nperr = np_client_new(device, service, &np);
-
-		if (service) {
-			lockdownd_service_descriptor_free(service);
-		}
-		service = NULL;
-
-		if (nperr != NP_E_SUCCESS) {
-			fprintf(stderr, "Could not connect to notification_proxy!\n");
-			goto leave_cleanup;
-		}
-
-		np_set_notify_callback(np, notifier, NULL);
-
-		const char *noties[3] = { NP_APP_INSTALLED, NP_APP_UNINSTALLED, NULL };
-
-		np_observe_notifications(np, noties);
-	}
+	struct service_start services[3];
+	int num_services;
 
 run_again:
-	if (service) {
-		lockdownd_service_descriptor_free(service);
+	/* only what the command needs */
+	num_services = 0;
+	if (use_notifier && !np && command_uses_notifier()) {
+		service_start_add(services, &num_services, "com.apple.mobile.notification_proxy", "notification_proxy", np_connect, &np);
 	}
-	service = NULL;
-
-	lerr = lockdownd_start_service(client, "com.apple.mobile.installation_proxy", &service);
-	if (lerr != LOCKDOWN_E_SUCCESS) {
-		fprintf(stderr, "Could not start com.apple.mobile.installation_proxy: %s\n", lockdownd_strerror(lerr));
+	if (cmd != CMD_STAGING_GC && !ipc) {
+		service_start_add(services, &num_services, "com.apple.mobile.installation_proxy", "installation_proxy", instproxy_connect, &ipc);
+	}
+	if ((cmd == CMD_INSTALL || cmd == CMD_UPGRADE || cmd == CMD_STAGING_GC || (cmd == CMD_ARCHIVE && copy_path)) && !afc) {
+		service_start_add(services, &num_services, "com.apple.afc", "AFC", afc_connect, &afc);
+	}
+	span = trace_begin("start services", NULL);
+	if (services_start(device, &client, services, num_services) < 0) {
 		goto leave_cleanup;
 	}
+	trace_end(span);
 
-	err = instproxy_client_new(device, service, &ipc);
+	if (np && num_services > 0 && services[0].service_client == &np) {
+		np_set_notify_callback(np, notifier, op);
 
-	if (service) {
-		lockdownd_service_descriptor_free(service);
-	}
-	service = NULL;
+		const char *noties[3] = { NP_APP_INSTALLED, NP_APP_UNINSTALLED, NULL };
 
-	if (err != INSTPROXY_E_SUCCESS) {
-		fprintf(stderr, "Could not connect to installation_proxy!\n");
-		goto leave_cleanup;
+		np_observe_notifications(np, noties);
 	}
 
-	setbuf(stdout, NULL);
+	idi_operation_set_client(op, ipc);
 
-	free(last_status);
-	last_status = NULL;
+	setbuf(stdout, NULL);
 
-	notification_expected = 0;
+	free(output.last_status);
+	output.last_status = NULL;
 
-	if (cmd == CMD_LIST_APPS) {
+	if (cmd == CMD_LIST_APPS && opt_list_watch) {
+		if (list_watch(device, &client, &ipc) == 0) {
+			res = 0;
+		}
+		goto leave_cleanup;
+	} else if (cmd == CMD_LIST_APPS) {
 		plist_t client_opts = instproxy_client_options_new();
 		instproxy_client_options_add(client_opts, "ApplicationType", "User", NULL);
 		plist_t apps = NULL;
@@ -909,8 +5523,27 @@ run_again:
 			instproxy_client_options_add(client_opts, "ReturnAttributes", return_attrs, NULL);
 		}
 
+		int attempt = 0;
+		char reason[32];
 		if (output_format) {
-			err = instproxy_browse(ipc, client_opts, &apps);
+			while (1) {
+				span = trace_begin("browse", NULL);
+				uint64_t browse_start = get_monotonic_us();
+				err = instproxy_browse(ipc, client_opts, &apps);
+				metrics_observe_browse(seconds_since(browse_start));
+				trace_end(span);
+				snprintf(reason, sizeof(reason), "error %d", err);
+				if (err == INSTPROXY_E_SUCCESS || !instproxy_error_is_transient(err) || !retry_wait(&attempt, "Browsing apps", reason)) {
+					break;
+				}
+				plist_free(apps);
+				apps = NULL;
+				instproxy_client_free(ipc);
+				ipc = NULL;
+				if (service_connect(device, &client, "com.apple.mobile.installation_proxy", "installation_proxy", instproxy_connect, &ipc) < 0) {
+					goto leave_cleanup;
+				}
+			}
 
 			if (!apps || (plist_get_node_type(apps) != PLIST_ARRAY)) {
 				fprintf(stderr, "ERROR: instproxy_browse returnd an invalid plist!\n");
@@ -969,50 +5602,39 @@ run_again:
 		}
 
 		print_apps_header();
-
-		err = instproxy_browse_with_callback(ipc, client_opts, status_cb, NULL);
-		if (err == INSTPROXY_E_RECEIVE_TIMEOUT) {
-			fprintf(stderr, "NOTE: timeout waiting for device to browse apps, trying again...\n");
+		idi_operation_set_apps_callback(op, apps_cb);
+
+		uint64_t list_browse_start = 0;
+		while (1) {
+			list_browse_start = get_monotonic_us();
+			ierr = idi_browse_async(op, client_opts);
+			if (ierr == IDI_E_SUCCESS) {
+				ierr = idi_operation_wait(op);
+			}
+			snprintf(reason, sizeof(reason), "%s", idi_strerror(ierr));
+			/* starting over is only possible as long as nothing was printed */
+			if (ierr != IDI_E_CONN_FAILED || apps_printed > 0 || !retry_wait(&attempt, "Browsing apps", reason)) {
+				break;
+			}
+			instproxy_client_free(ipc);
+			ipc = NULL;
+			if (service_connect(device, &client, "com.apple.mobile.installation_proxy", "installation_proxy", instproxy_connect, &ipc) < 0) {
+				instproxy_client_options_free(client_opts);
+				goto leave_cleanup;
+			}
+			idi_operation_set_client(op, ipc);
 		}
 
 		instproxy_client_options_free(client_opts);
-		if (err != INSTPROXY_E_SUCCESS) {
-			fprintf(stderr, "ERROR: instproxy_browse returned %d\n", err);
+		if (ierr != IDI_E_SUCCESS) {
+			command_failed(op, ierr);
 			goto leave_cleanup;
 		}
-
-		wait_for_command_complete = 1;
-		notification_expected = 0;
+		metrics_observe_browse(seconds_since(list_browse_start));
 	} else if (cmd == CMD_INSTALL || cmd == CMD_UPGRADE) {
-		plist_t sinf = NULL;
-		plist_t meta = NULL;
-		char *pkgname = NULL;
-		struct stat fst;
-		uint64_t af = 0;
-		char buf[8192];
-
-		lockdownd_service_descriptor_free(service);
-		service = NULL;
-
-		lerr = lockdownd_start_service(client, "com.apple.afc", &service);
-		if (lerr != LOCKDOWN_E_SUCCESS) {
-			fprintf(stderr, "Could not start com.apple.afc: %s\n", lockdownd_strerror(lerr));
-			goto leave_cleanup;
-		}
-
 		lockdownd_client_free(client);
 		client = NULL;
 
-		if (afc_client_new(device, service, &afc) != AFC_E_SUCCESS) {
-			fprintf(stderr, "Could not connect to AFC!\n");
-			goto leave_cleanup;
-		}
-
-		if (stat(cmdarg, &fst) != 0) {
-			fprintf(stderr, "ERROR: stat: %s: %s\n", cmdarg, strerror(errno));
-			goto leave_cleanup;
-		}
-
 		char **strs = NULL;
 		if (afc_get_file_info(afc, PKG_PATH, &strs) != AFC_E_SUCCESS) {
 			if (afc_make_directory(afc, PKG_PATH) != AFC_E_SUCCESS) {
@@ -1028,339 +5650,132 @@ run_again:
 			free(strs);
 		}
 
-		plist_t client_opts = instproxy_client_options_new();
-
-		/* open install package */
-		int errp = 0;
-		struct zip *zf = NULL;
-
-		if ((strlen(cmdarg) > 5) && (strcmp(&cmdarg[strlen(cmdarg)-5], ".ipcc") == 0)) {
-			zf = zip_open(cmdarg, 0, &errp);
-			if (!zf) {
-				fprintf(stderr, "ERROR: zip_open: %s: %d\n", cmdarg, errp);
-				goto leave_cleanup;
-			}
-
-			char* ipcc = strdup(cmdarg);
-			if ((asprintf(&pkgname, "%s/%s", PKG_PATH, basename(ipcc)) > 0) && pkgname) {
-				afc_make_directory(afc, pkgname);
-			}
-
-			printf("Uploading %s package contents... ", basename(ipcc));
-
-			/* extract the contents of the .ipcc file to PublicStaging/<name>.ipcc directory */
-			zip_int64_t numzf = (zip_int64_t)zip_get_num_entries(zf, 0);
-			zip_int64_t i = 0;
-			for (i = 0; numzf > 0 && i < numzf; i++) {
-				const char* zname = zip_get_name(zf, i, 0);
-				char* dstpath = NULL;
-				if (!zname) continue;
-				if (zname[strlen(zname)-1] == '/') {
-					// directory
-					if ((asprintf(&dstpath, "%s/%s/%s", PKG_PATH, basename(ipcc), zname) > 0) && dstpath) {
-						afc_make_directory(afc, dstpath);						}
-					free(dstpath);
-					dstpath = NULL;
-				} else {
-					// file
-					struct zip_file* zfile = zip_fopen_index(zf, i, 0);
-					if (!zfile) continue;
-
-					if ((asprintf(&dstpath, "%s/%s/%s", PKG_PATH, basename(ipcc), zname) <= 0) || !dstpath || (afc_file_open(afc, dstpath, AFC_FOPEN_WRONLY, &af) != AFC_E_SUCCESS)) {
-						fprintf(stderr, "ERROR: can't open afc://%s for writing\n", dstpath);
-						free(dstpath);
-						dstpath = NULL;
-						zip_fclose(zfile);
-						continue;
-					}
-
-					struct zip_stat zs;
-					zip_stat_init(&zs);
-					if (zip_stat_index(zf, i, 0, &zs) != 0) {
-						fprintf(stderr, "ERROR: zip_stat_index %" PRIu64 " failed!\n", i);
-						free(dstpath);
-						dstpath = NULL;
-						zip_fclose(zfile);
-						continue;
-					}
-
-					free(dstpath);
-					dstpath = NULL;
-
-					zip_uint64_t zfsize = 0;
-					while (zfsize < zs.size) {
-						zip_int64_t amount = zip_fread(zfile, buf, sizeof(buf));
-						if (amount == 0) {
-							break;
-						}
-
-						if (amount > 0) {
-							uint32_t written, total = 0;
-							while (total < amount) {
-								written = 0;
-								if (afc_file_write(afc, af, buf, amount, &written) !=
-									AFC_E_SUCCESS) {
-									fprintf(stderr, "AFC Write error!\n");
-									break;
-								}
-								total += written;
-							}
-							if (total != amount) {
-								fprintf(stderr, "Error: wrote only %d of %" PRIi64 "\n", total, amount);
-								afc_file_close(afc, af);
-								zip_fclose(zfile);
-								free(dstpath);
-								goto leave_cleanup;
-							}
-						}
-
-						zfsize += amount;
-					}
-
-					afc_file_close(afc, af);
-					af = 0;
-
-					zip_fclose(zfile);
-				}
-			}
-			free(ipcc);
-			printf("DONE.\n");
-
-			instproxy_client_options_add(client_opts, "PackageType", "CarrierBundle", NULL);
-		} else if (S_ISDIR(fst.st_mode)) {
-			/* upload developer app directory */
-			instproxy_client_options_add(client_opts, "PackageType", "Developer", NULL);
-
-			if (asprintf(&pkgname, "%s/%s", PKG_PATH, basename(cmdarg)) < 0) {
-				fprintf(stderr, "ERROR: Out of memory allocating pkgname!?\n");
-				goto leave_cleanup;
-			}
-
-			printf("Uploading %s package contents... ", basename(cmdarg));
-			afc_upload_dir(afc, cmdarg, pkgname);
-			printf("DONE.\n");
-
-			/* extract the CFBundleIdentifier from the package */
-
-			/* construct full filename to Info.plist */
-			char *filename = (char*)malloc(strlen(cmdarg)+11+1);
-			strcpy(filename, cmdarg);
-			strcat(filename, "/Info.plist");
-
-			struct stat st;
-			FILE *fp = NULL;
-
-			if (stat(filename, &st) == -1 || (fp = fopen(filename, "r")) == NULL) {
-				fprintf(stderr, "ERROR: could not locate %s in app!\n", filename);
-				free(filename);
-				goto leave_cleanup;
-			}
-			size_t filesize = st.st_size;
-			char *ibuf = malloc(filesize * sizeof(char));
-			size_t amount = fread(ibuf, 1, filesize, fp);
-			if (amount != filesize) {
-				fprintf(stderr, "ERROR: could not read %u bytes from %s\n", (uint32_t)filesize, filename);
-				free(filename);
-				goto leave_cleanup;
-			}
-			fclose(fp);
-			free(filename);
-
-			plist_t info = NULL;
-			plist_from_memory(ibuf, filesize, &info, NULL);
-			free(ibuf);
-
-			if (!info) {
-				fprintf(stderr, "ERROR: could not parse Info.plist!\n");
+		if (space_check) {
+			span = trace_begin("space check", NULL);
+			int space_res = check_free_space(device, afc, cmdargs, num_cmdargs);
+			trace_end(span);
+			if (space_res < 0) {
 				goto leave_cleanup;
 			}
+		}
 
-			plist_t bname = plist_dict_get_item(info, "CFBundleIdentifier");
-			if (bname) {
-				plist_get_string_val(bname, &bundleidentifier);
-			}
-			plist_free(info);
-			info = NULL;
-		} else {
-			zf = zip_open(cmdarg, 0, &errp);
-			if (!zf) {
-				fprintf(stderr, "ERROR: zip_open: %s: %d\n", cmdarg, errp);
-				goto leave_cleanup;
-			}
-
-			char *zbuf = NULL;
-			uint32_t len = 0;
-			plist_t meta_dict = NULL;
-
-			if (extmeta) {
-				size_t flen = 0;
-				zbuf = buf_from_file(extmeta, &flen);
-				if (zbuf && flen) {
-					meta = plist_new_data(zbuf, flen);
-					plist_from_memory(zbuf, flen, &meta_dict, NULL);
-					free(zbuf);
-				}
-				if (!meta_dict) {
-					plist_free(meta);
-					meta = NULL;
-					fprintf(stderr, "WARNING: could not load external iTunesMetadata %s!\n", extmeta);
-				}
-				zbuf = NULL;
-			}
-
-			if (!meta && !meta_dict) {
-				/* extract iTunesMetadata.plist from package */
-				if (zip_get_contents(zf, ITUNES_METADATA_PLIST_FILENAME, 0, &zbuf, &len) == 0) {
-					meta = plist_new_data(zbuf, len);
-					plist_from_memory(zbuf, len, &meta_dict, NULL);
+		/*
+		 * Installs are done one after another, but the next package is
+		 * uploaded while the device is busy installing the current one.
+		 */
+		int *results = (int*)calloc(num_cmdargs, sizeof(int));
+		int failed_install = 0;
+		struct staged_package next;
+		int next_res = stage_package(device, &afc, cmdargs[0], &zverify, &next);
+		int i;
+		for (i = 0; i < num_cmdargs; i++) {
+			struct staged_package current = next;
+			int stage_res = next_res;
+
+			memset(&next, 0, sizeof(next));
+			if (stage_res != 0) {
+				if (stage_res < 0) {
+					failed_stage++;
 				}
-				if (!meta_dict) {
-					plist_free(meta);
-					meta = NULL;
-					fprintf(stderr, "WARNING: could not locate %s in archive!\n", ITUNES_METADATA_PLIST_FILENAME);
+				results[i] = stage_res;
+				progress_package(cmdargs[i], current.bundle_id, (stage_res < 0) ? "failure" : "skipped");
+				staged_package_free(&current);
+				if (i+1 < num_cmdargs) {
+					next_res = stage_package(device, &afc, cmdargs[i+1], &zverify, &next);
 				}
-				free(zbuf);
-			}
-
-			/* determine .app directory in archive */
-			zbuf = NULL;
-			len = 0;
-			plist_t info = NULL;
-			char* filename = NULL;
-			char* app_directory_name = NULL;
-
-			if (zip_get_app_directory(zf, &app_directory_name)) {
-				fprintf(stderr, "ERROR: Unable to locate .app directory in archive. Make sure it is inside a 'Payload' directory.\n");
-				goto leave_cleanup;
-			}
-
-			/* construct full filename to Info.plist */
-			filename = (char*)malloc(strlen(app_directory_name)+10+1);
-			strcpy(filename, app_directory_name);
-			free(app_directory_name);
-			app_directory_name = NULL;
-			strcat(filename, "Info.plist");
-
-			if (zip_get_contents(zf, filename, 0, &zbuf, &len) < 0) {
-				fprintf(stderr, "WARNING: could not locate %s in archive!\n", filename);
-				free(filename);
-				zip_unchange_all(zf);
-				zip_close(zf);
-				goto leave_cleanup;
-			}
-			free(filename);
-			plist_from_memory(zbuf, len, &info, NULL);
-			free(zbuf);
-
-			if (!info) {
-				fprintf(stderr, "Could not parse Info.plist!\n");
-				zip_unchange_all(zf);
-				zip_close(zf);
-				goto leave_cleanup;
+				continue;
 			}
 
-			char *bundleexecutable = NULL;
-
-			plist_t bname = plist_dict_get_item(info, "CFBundleExecutable");
-			if (bname) {
-				plist_get_string_val(bname, &bundleexecutable);
+			free(output.last_status);
+			output.last_status = NULL;
+			output.completed_time = 0;
+
+			/* perform installation or upgrade */
+			progress_phase((cmd == CMD_INSTALL) ? "install" : "upgrade");
+			span = trace_begin((cmd == CMD_INSTALL) ? "install" : "upgrade", current.bundle_id);
+			uint64_t install_start = get_monotonic_us();
+			progress_install_start = install_start;
+			progress_install_expected = history_predict_ms(&history_install, current.size);
+			if (np) {
+				idi_operation_expect_notification(op, current.bundle_id, current.bundle_version);
 			}
-
-			bname = plist_dict_get_item(info, "CFBundleIdentifier");
-			if (bname) {
-				plist_get_string_val(bname, &bundleidentifier);
+			if (cmd == CMD_INSTALL) {
+				output_line("Installing '%s'\n", current.bundle_id);
+				ierr = idi_install_async(op, current.pkgname, current.client_opts);
+			} else {
+				output_line("Upgrading '%s'\n", current.bundle_id);
+				ierr = idi_upgrade_async(op, current.pkgname, current.client_opts);
 			}
-			plist_free(info);
-			info = NULL;
 
-			if (!bundleexecutable) {
-				fprintf(stderr, "Could not determine value for CFBundleExecutable!\n");
-				zip_unchange_all(zf);
-				zip_close(zf);
-				goto leave_cleanup;
+			if (i+1 < num_cmdargs) {
+				output_deferred = 1;
+				next_res = stage_package(device, &afc, cmdargs[i+1], &zverify, &next);
+				output_deferred = 0;
 			}
 
-			if (extsinf) {
-				size_t flen = 0;
-				zbuf = buf_from_file(extsinf, &flen);
-				if (zbuf && flen) {
-					sinf = plist_new_data(zbuf, flen);
-					free(zbuf);
-				} else {
-					fprintf(stderr, "WARNING: could not load external SINF %s!\n", extsinf);
+			progress_phase("wait");
+			ierr = command_wait(op, ierr);
+			trace_end(span);
+			if (ierr != IDI_E_SUCCESS) {
+				failed_install++;
+				results[i] = -1;
+			} else {
+				/* the next upload might have outlasted the install, so take the time of completion */
+				if (output.completed_time > install_start) {
+					metrics_observe_install((double)(output.completed_time - install_start) / 1000000);
+					history_record(HISTORY_INSTALL, current.size, output.completed_time - install_start);
 				}
-				zbuf = NULL;
 			}
-
-			if (!sinf) {
-				char *sinfname = NULL;
-				if (asprintf(&sinfname, "Payload/%s.app/SC_Info/%s.sinf", bundleexecutable, bundleexecutable) < 0) {
-					fprintf(stderr, "Out of memory!?\n");
-					goto leave_cleanup;
+			progress_install_expected = -1;
+			progress_package(cmdargs[i], current.bundle_id, (results[i] == 0) ? "success" : "failure");
+			staged_package_free(&current);
+
+			if (ierr == IDI_E_NO_DEVICE) {
+				/* the device is gone, the remaining packages fail */
+				device_removed = 1;
+				staged_package_free(&next);
+				for (i++; i < num_cmdargs; i++) {
+					failed_install++;
+					results[i] = -1;
+					progress_package(cmdargs[i], NULL, "failure");
 				}
-				free(bundleexecutable);
-
-				/* extract .sinf from package */
-				zbuf = NULL;
-				len = 0;
-				if (zip_get_contents(zf, sinfname, 0, &zbuf, &len) == 0) {
-					sinf = plist_new_data(zbuf, len);
-				} else {
-					fprintf(stderr, "WARNING: could not locate %s in archive!\n", sinfname);
-				}
-				free(sinfname);
-				free(zbuf);
-			}
-
-			/* copy archive to device */
-			pkgname = NULL;
-			if (asprintf(&pkgname, "%s/%s", PKG_PATH, bundleidentifier) < 0) {
-				fprintf(stderr, "Out of memory!?\n");
-				goto leave_cleanup;
+				break;
 			}
+		}
 
-			printf("Copying '%s' to device... ", cmdarg);
-
-			if (afc_upload_file(afc, cmdarg, pkgname) < 0) {
-				printf("FAILED\n");
-				free(pkgname);
-				goto leave_cleanup;
+		if (num_cmdargs > 1) {
+			printf("\n");
+			for (i = 0; i < num_cmdargs; i++) {
+				printf("%s: %s\n", cmdargs[i], (results[i] == 0) ? "OK" : (results[i] > 0) ? "SKIPPED" : "FAILED");
 			}
+		}
+		free(results);
 
-			printf("DONE.\n");
-
-			if (bundleidentifier) {
-				instproxy_client_options_add(client_opts, "CFBundleIdentifier", bundleidentifier, NULL);
-			}
-			if (sinf) {
-				instproxy_client_options_add(client_opts, "ApplicationSINF", sinf, NULL);
-			}
-			if (meta) {
-				instproxy_client_options_add(client_opts, "iTunesMetadata", meta, NULL);
-			}
+		err_occurred = (failed_install > 0);
+	} else if (cmd == CMD_UNINSTALL && num_cmdargs == 1 && !uninstall_patterns) {
+		printf("Uninstalling '%s'\n", cmdarg);
+		ierr = idi_uninstall_async(op, cmdarg, NULL);
+		command_started = 1;
+	} else if (cmd == CMD_UNINSTALL) {
+		plist_t ids = plist_new_array();
+		int i;
+		for (i = 0; i < num_cmdargs; i++) {
+			string_array_add_unique(ids, cmdargs[i]);
 		}
-		if (zf) {
-			zip_unchange_all(zf);
-			zip_close(zf);
+		if (uninstall_patterns && uninstall_resolve_patterns(ipc, uninstall_patterns, ids) < 0) {
+			plist_free(ids);
+			goto leave_cleanup;
 		}
-
-		/* perform installation or upgrade */
-		if (cmd == CMD_INSTALL) {
-			printf("Installing '%s'\n", bundleidentifier);
-			instproxy_install(ipc, pkgname, client_opts, status_cb, NULL);
+		if (plist_array_get_size(ids) == 0) {
+			printf("No matching apps found.\n");
 		} else {
-			printf("Upgrading '%s'\n", bundleidentifier);
-			instproxy_upgrade(ipc, pkgname, client_opts, status_cb, NULL);
+			span = trace_begin("uninstall", NULL);
+			if (uninstall_batch(device, ipc, ids) > 0) {
+				err_occurred = 1;
+			}
+			trace_end(span);
 		}
-		instproxy_client_options_free(client_opts);
-		free(pkgname);
-		wait_for_command_complete = 1;
-		notification_expected = 1;
-	} else if (cmd == CMD_UNINSTALL) {
-		printf("Uninstalling '%s'\n", cmdarg);
-		instproxy_uninstall(ipc, cmdarg, NULL, status_cb, NULL);
-		wait_for_command_complete = 1;
-		notification_expected = 0;
+		plist_free(ids);
 	} else if (cmd == CMD_LIST_ARCHIVES) {
 		plist_t dict = NULL;
 
@@ -1466,39 +5881,21 @@ run_again:
 				goto leave_cleanup;
 			}
 
-			if (service) {
-				lockdownd_service_descriptor_free(service);
-			}
-			service = NULL;
-
-			if ((lockdownd_start_service(client, "com.apple.afc", &service) != LOCKDOWN_E_SUCCESS) || !service) {
-				fprintf(stderr, "Could not start com.apple.afc!\n");
-				goto leave_cleanup;
-			}
-
 			lockdownd_client_free(client);
 			client = NULL;
-
-			if (afc_client_new(device, service, &afc) != AFC_E_SUCCESS) {
-				fprintf(stderr, "Could not connect to AFC!\n");
-				goto leave_cleanup;
-			}
 		}
 
-		instproxy_archive(ipc, cmdarg, client_opts, status_cb, NULL);
+		if (np && !skip_uninstall) {
+			idi_operation_expect_notification(op, NULL, NULL);
+		}
+		ierr = idi_archive_async(op, cmdarg, client_opts);
 
 		instproxy_client_options_free(client_opts);
-		wait_for_command_complete = 1;
-		if (skip_uninstall) {
-			notification_expected = 0;
-		} else {
-			notification_expected = 1;
-		}
 
-		idevice_wait_for_command_to_complete();
+		ierr = command_wait(op, ierr);
 
 		if (copy_path) {
-			if (err_occurred) {
+			if (ierr != IDI_E_SUCCESS) {
 				afc_client_free(afc);
 				afc = NULL;
 				goto leave_cleanup;
@@ -1571,28 +5968,40 @@ run_again:
 			free(remotefile);
 			free(localfile);
 
+			progress_transfer_begin("download", fsize, 1);
+
 			uint32_t amount = 0;
 			uint32_t total = 0;
-			char buf[8192];
+			struct afc_transfer xfer;
+			if (afc_transfer_init(&xfer, device, 8192) < 0) {
+				afc_file_close(afc, af);
+				fclose(f);
+				goto leave_cleanup;
+			}
 
 			do {
-				if (afc_file_read(afc, af, buf, sizeof(buf), &amount) != AFC_E_SUCCESS) {
+				chunk_tuner_begin(&xfer.ct);
+				if (afc_file_read(afc, af, xfer.buf, xfer.ct.size, &amount) != AFC_E_SUCCESS) {
 					fprintf(stderr, "AFC Read error!\n");
 					break;
 				}
+				chunk_tuner_end(&xfer.ct, amount);
 
 				if (amount > 0) {
-					size_t written = fwrite(buf, 1, amount, f);
+					size_t written = fwrite(xfer.buf, 1, amount, f);
 					if (written != amount) {
 						fprintf(stderr, "Error when writing %d bytes to local file!\n", amount);
 						break;
 					}
 					total += written;
+					progress_transfer_add(written);
 				}
 			} while (amount > 0);
 
 			afc_file_close(afc, af);
 			fclose(f);
+			afc_transfer_free(&xfer);
+			progress_transfer_end();
 
 			printf("DONE.\n");
 
@@ -1617,12 +6026,19 @@ run_again:
 		}
 		goto leave_cleanup;
 	} else if (cmd == CMD_RESTORE) {
-		instproxy_restore(ipc, cmdarg, NULL, status_cb, NULL);
-		wait_for_command_complete = 1;
-		notification_expected = 1;
+		if (np) {
+			idi_operation_expect_notification(op, NULL, NULL);
+		}
+		ierr = idi_restore_async(op, cmdarg, NULL);
+		command_started = 1;
 	} else if (cmd == CMD_REMOVE_ARCHIVE) {
-		instproxy_remove_archive(ipc, cmdarg, NULL, status_cb, NULL);
-		wait_for_command_complete = 1;
+		ierr = idi_remove_archive_async(op, cmdarg, NULL);
+		command_started = 1;
+	} else if (cmd == CMD_STAGING_GC) {
+		/* without any limits everything gets removed */
+		uint64_t quota = (staging_quota == STAGING_QUOTA_UNLIMITED && staging_max_age == 0) ? 0 : staging_quota;
+		res = (staging_gc(device, afc, quota, staging_max_age, 0) == 0) ? 0 : 1;
+		goto leave_cleanup;
 	} else {
 		printf("ERROR: no command selected?! This should not be reached!\n");
 		res = 2;
@@ -1633,27 +6049,58 @@ run_again:
 	lockdownd_client_free(client);
 	client = NULL;
 
-	idevice_wait_for_command_to_complete();
+	if (command_started) {
+		progress_phase("wait");
+		command_wait(op, ierr);
+	}
 	res = 0;
 
+	if (afc && !device_removed && (cmd == CMD_INSTALL || cmd == CMD_UPGRADE) && (staging_quota != STAGING_QUOTA_UNLIMITED || staging_max_age > 0)) {
+		progress_phase("cleanup");
+		span = trace_begin("cleanup", NULL);
+		staging_gc(device, afc, staging_quota, staging_max_age, 0);
+		trace_end(span);
+	}
+	if (failed_stage > 0) {
+		res = EXIT_FAILURE;
+	}
+
 leave_cleanup:
+	zip_verify_finish(&zverify);
+	usb_sched_free();
+	/* waits for a command that is still running */
+	idi_operation_free(op);
 	np_client_free(np);
 	instproxy_client_free(ipc);
 	afc_client_free(afc);
 	lockdownd_client_free(client);
 	idevice_free(device);
 
-	free(udid);
+	free(trace_path);
 	free(copy_path);
 	free(extsinf);
 	free(extmeta);
-	free(bundleidentifier);
 	plist_free(bundle_ids);
 	plist_free(return_attrs);
+	plist_free(uninstall_patterns);
+	io_buffer_pool_free();
 
 	if (err_occurred && !res) {
 		res = 128;
 	}
 
+	progress_result(res);
+	trace_close();
+	metrics_write(udid, res);
+	metrics_free();
+	free(udid);
+	free(metrics_path);
+	free(progress_last_status);
+	free(output.last_status);
+	mutex_destroy(&transfer_mutex);
+	mutex_destroy(&io_buffer_mutex);
+	mutex_destroy(&lockdownd_mutex);
+	mutex_destroy(&output_mutex);
+
 	return res;
 }
@@ -0,0 +1,689 @@
+/*
+ * libideviceinstaller.c
+ * Runs installation_proxy commands, each with its own operation context
+ *
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more profile.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/installation_proxy.h>
+
+#include <libimobiledevice-glue/thread.h>
+
+#include "libideviceinstaller.h"
+
+#define IDI_LABEL "libideviceinstaller"
+/* how often the device is checked for while waiting */
+#define IDI_DEVICE_CHECK_INTERVAL_MS 1000
+
+enum idi_command {
+	IDI_CMD_NONE = 0,
+	IDI_CMD_BROWSE,
+	IDI_CMD_INSTALL,
+	IDI_CMD_UPGRADE,
+	IDI_CMD_UNINSTALL,
+	IDI_CMD_ARCHIVE,
+	IDI_CMD_RESTORE,
+	IDI_CMD_REMOVE_ARCHIVE
+};
+
+struct idi_operation_private {
+	char *udid;
+	enum idevice_options lookup_opts;
+	instproxy_client_t client;
+	idi_status_cb_t status_cb;
+	idi_apps_cb_t apps_cb;
+	idi_complete_cb_t complete_cb;
+	void *user_data;
+
+	/* set by idi_operation_expect_notification() for the next command */
+	int expect_notification;
+	char *expect_bundle_id;
+	char *expect_version;
+
+	mutex_t mutex;
+	cond_t cond;
+	THREAD_T thread;
+	int has_thread;
+	int running;
+
+	/* the current command */
+	enum idi_command command;
+	char *arg;
+	plist_t client_options;
+	int wait_notification;
+	char *confirm_bundle_id;
+	char *confirm_version;
+	idi_error_t result;
+
+	/* updated by the installation_proxy status callback and idi_operation_notify() */
+	int completed;
+	int failed;
+	int notified;
+	char *error_name;
+	char *error_description;
+	uint64_t error_code;
+
+	plist_t apps;
+};
+
+const char *idi_strerror(idi_error_t err)
+{
+	switch (err) {
+	case IDI_E_SUCCESS:
+		return "Success";
+	case IDI_E_INVALID_ARG:
+		return "Invalid argument";
+	case IDI_E_NO_DEVICE:
+		return "No device found";
+	case IDI_E_CONN_FAILED:
+		return "Connection to the device failed";
+	case IDI_E_OP_FAILED:
+		return "Operation failed on the device";
+	case IDI_E_OP_IN_PROGRESS:
+		return "Operation in progress";
+	case IDI_E_NO_MEM:
+		return "Out of memory";
+	default:
+		return "Unknown error";
+	}
+}
+
+static idi_error_t idi_error_from_instproxy(instproxy_error_t err)
+{
+	switch (err) {
+	case INSTPROXY_E_SUCCESS:
+		return IDI_E_SUCCESS;
+	case INSTPROXY_E_INVALID_ARG:
+		return IDI_E_INVALID_ARG;
+	case INSTPROXY_E_CONN_FAILED:
+	case INSTPROXY_E_RECEIVE_TIMEOUT:
+		return IDI_E_CONN_FAILED;
+	case INSTPROXY_E_OP_IN_PROGRESS:
+		return IDI_E_OP_IN_PROGRESS;
+	case INSTPROXY_E_OP_FAILED:
+		return IDI_E_OP_FAILED;
+	default:
+		return IDI_E_UNKNOWN_ERROR;
+	}
+}
+
+idi_error_t idi_operation_new(const char *udid, enum idevice_options lookup_opts, idi_operation_t *op)
+{
+	if (!op) {
+		return IDI_E_INVALID_ARG;
+	}
+	idi_operation_t res = (idi_operation_t)calloc(1, sizeof(struct idi_operation_private));
+	if (!res) {
+		return IDI_E_NO_MEM;
+	}
+	if (udid) {
+		res->udid = strdup(udid);
+		if (!res->udid) {
+			free(res);
+			return IDI_E_NO_MEM;
+		}
+	}
+	res->lookup_opts = lookup_opts;
+	mutex_init(&res->mutex);
+	cond_init(&res->cond);
+	*op = res;
+	return IDI_E_SUCCESS;
+}
+
+static int idi_operation_is_running(idi_operation_t op)
+{
+	mutex_lock(&op->mutex);
+	int running = op->running;
+	mutex_unlock(&op->mutex);
+	return running;
+}
+
+idi_error_t idi_operation_set_callbacks(idi_operation_t op, idi_status_cb_t status_cb, idi_complete_cb_t complete_cb, void *user_data)
+{
+	if (!op) {
+		return IDI_E_INVALID_ARG;
+	}
+	if (idi_operation_is_running(op)) {
+		return IDI_E_OP_IN_PROGRESS;
+	}
+	op->status_cb = status_cb;
+	op->complete_cb = complete_cb;
+	op->user_data = user_data;
+	return IDI_E_SUCCESS;
+}
+
+idi_error_t idi_operation_set_apps_callback(idi_operation_t op, idi_apps_cb_t apps_cb)
+{
+	if (!op) {
+		return IDI_E_INVALID_ARG;
+	}
+	if (idi_operation_is_running(op)) {
+		return IDI_E_OP_IN_PROGRESS;
+	}
+	op->apps_cb = apps_cb;
+	return IDI_E_SUCCESS;
+}
+
+idi_error_t idi_operation_set_client(idi_operation_t op, instproxy_client_t client)
+{
+	if (!op) {
+		return IDI_E_INVALID_ARG;
+	}
+	if (idi_operation_is_running(op)) {
+		return IDI_E_OP_IN_PROGRESS;
+	}
+	op->client = client;
+	return IDI_E_SUCCESS;
+}
+
+idi_error_t idi_operation_expect_notification(idi_operation_t op, const char *bundle_id, const char *version)
+{
+	if (!op) {
+		return IDI_E_INVALID_ARG;
+	}
+	free(op->expect_bundle_id);
+	free(op->expect_version);
+	op->expect_bundle_id = NULL;
+	op->expect_version = NULL;
+	if (bundle_id && version) {
+		op->expect_bundle_id = strdup(bundle_id);
+		op->expect_version = strdup(version);
+		if (!op->expect_bundle_id || !op->expect_version) {
+			free(op->expect_bundle_id);
+			free(op->expect_version);
+			op->expect_bundle_id = NULL;
+			op->expect_version = NULL;
+			return IDI_E_NO_MEM;
+		}
+	}
+	op->expect_notification = 1;
+	return IDI_E_SUCCESS;
+}
+
+void idi_operation_notify(idi_operation_t op)
+{
+	if (!op) {
+		return;
+	}
+	mutex_lock(&op->mutex);
+	op->notified = 1;
+	cond_signal(&op->cond);
+	mutex_unlock(&op->mutex);
+}
+
+static void idi_operation_reset(idi_operation_t op)
+{
+	free(op->arg);
+	op->arg = NULL;
+	plist_free(op->client_options);
+	op->client_options = NULL;
+	free(op->confirm_bundle_id);
+	op->confirm_bundle_id = NULL;
+	free(op->confirm_version);
+	op->confirm_version = NULL;
+	op->wait_notification = 0;
+	free(op->error_name);
+	op->error_name = NULL;
+	free(op->error_description);
+	op->error_description = NULL;
+	op->error_code = 0;
+	op->completed = 0;
+	op->failed = 0;
+	op->notified = 0;
+	op->result = IDI_E_SUCCESS;
+}
+
+static void idi_status(idi_operation_t op, const char *command, const char *status, int percent)
+{
+	if (op->status_cb) {
+		op->status_cb(op, command, status, percent, op->user_data);
+	}
+}
+
+/* installation_proxy status callback, called on the status thread of libimobiledevice */
+static void idi_instproxy_status_cb(plist_t command, plist_t status, void *user_data)
+{
+	idi_operation_t op = (idi_operation_t)user_data;
+	char *command_name = NULL;
+	char *status_name = NULL;
+	char *error_name = NULL;
+	char *error_description = NULL;
+	uint64_t error_code = 0;
+	int percent = -1;
+
+	if (!command || !status) {
+		return;
+	}
+	instproxy_command_get_name(command, &command_name);
+	instproxy_status_get_name(status, &status_name);
+	instproxy_status_get_percent_complete(status, &percent);
+	instproxy_status_get_error(status, &error_name, &error_description, &error_code);
+
+	if (!error_name && op->command == IDI_CMD_BROWSE) {
+		uint64_t total = 0;
+		uint64_t current_index = 0;
+		uint64_t current_amount = 0;
+		plist_t current_list = NULL;
+		instproxy_status_get_current_list(status, &total, &current_index, &current_amount, &current_list);
+		if (current_list && op->apps_cb) {
+			op->apps_cb(op, current_list, op->user_data);
+		} else if (current_list) {
+			uint32_t i;
+			mutex_lock(&op->mutex);
+			for (i = 0; i < plist_array_get_size(current_list); i++) {
+				plist_array_append_item(op->apps, plist_copy(plist_array_get_item(current_list, i)));
+			}
+			mutex_unlock(&op->mutex);
+		}
+		plist_free(current_list);
+	}
+
+	if (!error_name && command_name && status_name) {
+		idi_status(op, command_name, status_name, percent);
+	}
+
+	mutex_lock(&op->mutex);
+	if (error_name) {
+		op->failed = 1;
+		free(op->error_name);
+		free(op->error_description);
+		op->error_name = error_name;
+		op->error_description = error_description;
+		op->error_code = error_code;
+		error_name = NULL;
+		error_description = NULL;
+	} else if (status_name && !strcmp(status_name, "Complete")) {
+		op->completed = 1;
+	}
+	cond_signal(&op->cond);
+	mutex_unlock(&op->mutex);
+
+	free(error_name);
+	free(error_description);
+	free(status_name);
+	free(command_name);
+}
+
+static int idi_device_present(idi_operation_t op)
+{
+	idevice_t device = NULL;
+	if (idevice_new_with_options(&device, op->udid, op->lookup_opts) != IDEVICE_E_SUCCESS) {
+		return 0;
+	}
+	idevice_free(device);
+	return 1;
+}
+
+/*
+ * Waits with the mutex held until done() holds. libimobiledevice doesn't
+ * report a lost connection to the status callback, so the device is
+ * checked for in between; returns IDI_E_NO_DEVICE if it went away.
+ */
+static idi_error_t idi_wait_until(idi_operation_t op, int (*done)(idi_operation_t))
+{
+	while (!done(op)) {
+		if (cond_wait_timeout(&op->cond, &op->mutex, IDI_DEVICE_CHECK_INTERVAL_MS) == 0) {
+			continue;
+		}
+		mutex_unlock(&op->mutex);
+		int present = idi_device_present(op);
+		mutex_lock(&op->mutex);
+		if (!present && !done(op)) {
+			return IDI_E_NO_DEVICE;
+		}
+	}
+	return IDI_E_SUCCESS;
+}
+
+static int idi_command_done(idi_operation_t op)
+{
+	return op->completed || op->failed;
+}
+
+static int idi_notification_done(idi_operation_t op)
+{
+	return op->notified;
+}
+
+/* checks on a connection of its own whether the device lists the expected app */
+static int idi_app_confirmed(idi_operation_t op)
+{
+	idevice_t device = NULL;
+	instproxy_client_t ipc = NULL;
+	plist_t apps = NULL;
+	int confirmed = 0;
+
+	if (idevice_new_with_options(&device, op->udid, op->lookup_opts) == IDEVICE_E_SUCCESS
+	    && instproxy_client_start_service(device, &ipc, IDI_LABEL) == INSTPROXY_E_SUCCESS) {
+		plist_t client_opts = instproxy_client_options_new();
+		plist_t ids = plist_new_array();
+		plist_array_append_item(ids, plist_new_string(op->confirm_bundle_id));
+		plist_dict_set_item(client_opts, "BundleIDs", ids);
+		plist_t attrs = plist_new_array();
+		plist_array_append_item(attrs, plist_new_string("CFBundleIdentifier"));
+		plist_array_append_item(attrs, plist_new_string("CFBundleVersion"));
+		instproxy_client_options_add(client_opts, "ReturnAttributes", attrs, NULL);
+		plist_free(attrs);
+		if (instproxy_browse(ipc, client_opts, &apps) == INSTPROXY_E_SUCCESS && apps && plist_array_get_size(apps) > 0) {
+			plist_t version = plist_dict_get_item(plist_array_get_item(apps, 0), "CFBundleVersion");
+			confirmed = (version && plist_get_node_type(version) == PLIST_STRING && plist_string_val_compare(version, op->confirm_version) == 0);
+		}
+		plist_free(apps);
+		instproxy_client_options_free(client_opts);
+	}
+	instproxy_client_free(ipc);
+	idevice_free(device);
+
+	return confirmed;
+}
+
+static idi_error_t idi_run_command(idi_operation_t op, instproxy_client_t ipc)
+{
+	instproxy_error_t ierr;
+	idi_error_t res;
+
+	switch (op->command) {
+	case IDI_CMD_BROWSE:
+		ierr = instproxy_browse_with_callback(ipc, op->client_options, idi_instproxy_status_cb, op);
+		break;
+	case IDI_CMD_INSTALL:
+		ierr = instproxy_install(ipc, op->arg, op->client_options, idi_instproxy_status_cb, op);
+		break;
+	case IDI_CMD_UPGRADE:
+		ierr = instproxy_upgrade(ipc, op->arg, op->client_options, idi_instproxy_status_cb, op);
+		break;
+	case IDI_CMD_UNINSTALL:
+		ierr = instproxy_uninstall(ipc, op->arg, op->client_options, idi_instproxy_status_cb, op);
+		break;
+	case IDI_CMD_ARCHIVE:
+		ierr = instproxy_archive(ipc, op->arg, op->client_options, idi_instproxy_status_cb, op);
+		break;
+	case IDI_CMD_RESTORE:
+		ierr = instproxy_restore(ipc, op->arg, op->client_options, idi_instproxy_status_cb, op);
+		break;
+	case IDI_CMD_REMOVE_ARCHIVE:
+		ierr = instproxy_remove_archive(ipc, op->arg, op->client_options, idi_instproxy_status_cb, op);
+		break;
+	default:
+		ierr = INSTPROXY_E_INVALID_ARG;
+		break;
+	}
+	if (ierr != INSTPROXY_E_SUCCESS) {
+		return idi_error_from_instproxy(ierr);
+	}
+
+	mutex_lock(&op->mutex);
+	res = idi_wait_until(op, idi_command_done);
+	if (op->failed) {
+		res = IDI_E_OP_FAILED;
+	}
+	mutex_unlock(&op->mutex);
+
+	return res;
+}
+
+/*
+ * Once the device reported the command complete, the app notification
+ * may still be outstanding. A single browse for the expected app ends
+ * the wait early if the device already lists it with the new version.
+ */
+static idi_error_t idi_wait_for_notification(idi_operation_t op)
+{
+	idi_error_t res;
+	int confirmed = 0;
+
+	idi_status(op, "Notification", "Waiting", -1);
+
+	mutex_lock(&op->mutex);
+	int notified = op->notified;
+	mutex_unlock(&op->mutex);
+	if (!notified && op->confirm_bundle_id && op->confirm_version) {
+		confirmed = idi_app_confirmed(op);
+	}
+
+	mutex_lock(&op->mutex);
+	res = (confirmed) ? IDI_E_SUCCESS : idi_wait_until(op, idi_notification_done);
+	confirmed = confirmed && !op->notified;
+	mutex_unlock(&op->mutex);
+
+	if (res == IDI_E_SUCCESS) {
+		idi_status(op, "Notification", (confirmed) ? "Confirmed" : "Notified", -1);
+	}
+
+	return res;
+}
+
+static void* idi_operation_thread(void *arg)
+{
+	idi_operation_t op = (idi_operation_t)arg;
+	idevice_t device = NULL;
+	instproxy_client_t ipc = op->client;
+	idi_error_t res = IDI_E_UNKNOWN_ERROR;
+
+	if (!ipc) {
+		if (idevice_new_with_options(&device, op->udid, op->lookup_opts) != IDEVICE_E_SUCCESS) {
+			res = IDI_E_NO_DEVICE;
+		} else if (instproxy_client_start_service(device, &ipc, IDI_LABEL) != INSTPROXY_E_SUCCESS) {
+			res = IDI_E_CONN_FAILED;
+		}
+	}
+	if (ipc) {
+		res = idi_run_command(op, ipc);
+		if (res == IDI_E_SUCCESS && op->wait_notification) {
+			res = idi_wait_for_notification(op);
+		}
+		if (ipc != op->client) {
+			instproxy_client_free(ipc);
+		}
+	}
+	idevice_free(device);
+
+	op->result = res;
+	if (op->complete_cb) {
+		op->complete_cb(op, res, op->user_data);
+	}
+
+	mutex_lock(&op->mutex);
+	op->running = 0;
+	cond_signal(&op->cond);
+	mutex_unlock(&op->mutex);
+
+	return NULL;
+}
+
+static void idi_operation_join(idi_operation_t op)
+{
+	mutex_lock(&op->mutex);
+	while (op->running) {
+		cond_wait(&op->cond, &op->mutex);
+	}
+	int has_thread = op->has_thread;
+	op->has_thread = 0;
+	mutex_unlock(&op->mutex);
+	if (has_thread) {
+		thread_join(op->thread);
+		thread_free(op->thread);
+	}
+}
+
+static idi_error_t idi_operation_start(idi_operation_t op, enum idi_command command, const char *arg, plist_t client_options)
+{
+	if (!op || (command != IDI_CMD_BROWSE && !arg)) {
+		return IDI_E_INVALID_ARG;
+	}
+	if (idi_operation_is_running(op)) {
+		return IDI_E_OP_IN_PROGRESS;
+	}
+	/* collect the thread of the previous command */
+	idi_operation_join(op);
+
+	idi_operation_reset(op);
+	op->command = command;
+	if (arg) {
+		op->arg = strdup(arg);
+		if (!op->arg) {
+			return IDI_E_NO_MEM;
+		}
+	}
+	if (client_options) {
+		op->client_options = plist_copy(client_options);
+	}
+	if (command == IDI_CMD_BROWSE) {
+		plist_free(op->apps);
+		op->apps = plist_new_array();
+	}
+
+	/* the expectation applies to this command only */
+	op->wait_notification = op->expect_notification;
+	op->confirm_bundle_id = op->expect_bundle_id;
+	op->confirm_version = op->expect_version;
+	op->expect_notification = 0;
+	op->expect_bundle_id = NULL;
+	op->expect_version = NULL;
+
+	op->running = 1;
+	if (thread_new(&op->thread, idi_operation_thread, op) != 0) {
+		op->running = 0;
+		return IDI_E_UNKNOWN_ERROR;
+	}
+	op->has_thread = 1;
+
+	return IDI_E_SUCCESS;
+}
+
+idi_error_t idi_browse_async(idi_operation_t op, plist_t client_options)
+{
+	return idi_operation_start(op, IDI_CMD_BROWSE, NULL, client_options);
+}
+
+idi_error_t idi_install_async(idi_operation_t op, const char *pkg_path, plist_t client_options)
+{
+	return idi_operation_start(op, IDI_CMD_INSTALL, pkg_path, client_options);
+}
+
+idi_error_t idi_upgrade_async(idi_operation_t op, const char *pkg_path, plist_t client_options)
+{
+	return idi_operation_start(op, IDI_CMD_UPGRADE, pkg_path, client_options);
+}
+
+idi_error_t idi_uninstall_async(idi_operation_t op, const char *bundle_id, plist_t client_options)
+{
+	return idi_operation_start(op, IDI_CMD_UNINSTALL, bundle_id, client_options);
+}
+
+idi_error_t idi_archive_async(idi_operation_t op, const char *bundle_id, plist_t client_options)
+{
+	return idi_operation_start(op, IDI_CMD_ARCHIVE, bundle_id, client_options);
+}
+
+idi_error_t idi_restore_async(idi_operation_t op, const char *bundle_id, plist_t client_options)
+{
+	return idi_operation_start(op, IDI_CMD_RESTORE, bundle_id, client_options);
+}
+
+idi_error_t idi_remove_archive_async(idi_operation_t op, const char *bundle_id, plist_t client_options)
+{
+	return idi_operation_start(op, IDI_CMD_REMOVE_ARCHIVE, bundle_id, client_options);
+}
+
+idi_error_t idi_operation_wait(idi_operation_t op)
+{
+	if (!op) {
+		return IDI_E_INVALID_ARG;
+	}
+	idi_operation_join(op);
+	return op->result;
+}
+
+const char *idi_operation_get_command(idi_operation_t op)
+{
+	if (!op) {
+		return NULL;
+	}
+	switch (op->command) {
+	case IDI_CMD_BROWSE:
+		return "Browse";
+	case IDI_CMD_INSTALL:
+		return "Install";
+	case IDI_CMD_UPGRADE:
+		return "Upgrade";
+	case IDI_CMD_UNINSTALL:
+		return "Uninstall";
+	case IDI_CMD_ARCHIVE:
+		return "Archive";
+	case IDI_CMD_RESTORE:
+		return "Restore";
+	case IDI_CMD_REMOVE_ARCHIVE:
+		return "RemoveArchive";
+	default:
+		return NULL;
+	}
+}
+
+plist_t idi_operation_get_apps(idi_operation_t op)
+{
+	if (!op) {
+		return NULL;
+	}
+	mutex_lock(&op->mutex);
+	plist_t apps = op->apps;
+	mutex_unlock(&op->mutex);
+	return apps;
+}
+
+idi_error_t idi_operation_get_error(idi_operation_t op, const char **name, const char **description, uint64_t *code)
+{
+	if (!op) {
+		return IDI_E_INVALID_ARG;
+	}
+	mutex_lock(&op->mutex);
+	if (name) {
+		*name = op->error_name;
+	}
+	if (description) {
+		*description = op->error_description;
+	}
+	if (code) {
+		*code = op->error_code;
+	}
+	mutex_unlock(&op->mutex);
+	return IDI_E_SUCCESS;
+}
+
+void idi_operation_free(idi_operation_t op)
+{
+	if (!op) {
+		return;
+	}
+	idi_operation_join(op);
+	idi_operation_reset(op);
+	free(op->expect_bundle_id);
+	free(op->expect_version);
+	plist_free(op->apps);
+	free(op->udid);
+	cond_destroy(&op->cond);
+	mutex_destroy(&op->mutex);
+	free(op);
+}
@@ -0,0 +1,159 @@
+/*
+ * libideviceinstaller.h
+ * Runs installation_proxy commands, each with its own operation context
+ *
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more profile.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifndef __LIBIDEVICEINSTALLER_H
+#define __LIBIDEVICEINSTALLER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/installation_proxy.h>
+#include <plist/plist.h>
+
+/*
+ * An operation context runs one installation_proxy command at a time on
+ * its own thread and keeps everything about it (progress, errors, the
+ * device check, the wait for the app notification) to itself, so any
+ * number of operations for the same or different devices can run at the
+ * same time. idi_operation_notify() may be called from any thread; the
+ * other functions must not be called concurrently for the same operation.
+ * A context can be reused once its command has completed.
+ */
+
+typedef enum {
+	IDI_E_SUCCESS        =  0,
+	IDI_E_INVALID_ARG    = -1,
+	IDI_E_NO_DEVICE      = -2,
+	IDI_E_CONN_FAILED    = -3,
+	IDI_E_OP_FAILED      = -4,
+	IDI_E_OP_IN_PROGRESS = -5,
+	IDI_E_NO_MEM         = -6,
+	IDI_E_UNKNOWN_ERROR  = -256
+} idi_error_t;
+
+typedef struct idi_operation_private idi_operation_private;
+typedef idi_operation_private *idi_operation_t;
+
+/*
+ * Reports the progress of a command. command is the installation_proxy
+ * command (e.g. "Install"), or "Notification" while waiting for the app
+ * notification, with the status "Waiting", then "Notified" or "Confirmed".
+ * percent is -1 if unknown. Called on an internal thread.
+ */
+typedef void (*idi_status_cb_t)(idi_operation_t op, const char *command, const char *status, int percent, void *user_data);
+
+/* receives the apps of a browse page by page, apps is freed afterwards */
+typedef void (*idi_apps_cb_t)(idi_operation_t op, plist_t apps, void *user_data);
+
+/*
+ * Called once when a command has finished, on the thread of the
+ * operation. The operation must not be freed from within the callback.
+ */
+typedef void (*idi_complete_cb_t)(idi_operation_t op, idi_error_t result, void *user_data);
+
+/*
+ * Creates an operation context for the device with the given udid (or the
+ * first device found if NULL), looked up as given by lookup_opts.
+ */
+idi_error_t idi_operation_new(const char *udid, enum idevice_options lookup_opts, idi_operation_t *op);
+
+/* sets the callbacks used by the following commands, any of them may be NULL */
+idi_error_t idi_operation_set_callbacks(idi_operation_t op, idi_status_cb_t status_cb, idi_complete_cb_t complete_cb, void *user_data);
+
+/*
+ * With an apps callback, a browse hands the apps to it as they arrive
+ * instead of collecting them for idi_operation_get_apps().
+ */
+idi_error_t idi_operation_set_apps_callback(idi_operation_t op, idi_apps_cb_t apps_cb);
+
+/*
+ * Runs the following commands on the given installation_proxy connection
+ * instead of opening one per command. The connection stays owned by the
+ * caller and must not be used by anything else while a command runs.
+ */
+idi_error_t idi_operation_set_client(idi_operation_t op, instproxy_client_t client);
+
+/*
+ * Makes the next command, once the device reported it complete, wait for
+ * idi_operation_notify() (e.g. called for a notification_proxy
+ * notification). If bundle_id and version are given, the wait also ends
+ * when the device lists the app with that version, since some iOS
+ * versions post the notification late or not at all.
+ */
+idi_error_t idi_operation_expect_notification(idi_operation_t op, const char *bundle_id, const char *version);
+
+/* ends the wait for the notification of the running command */
+void idi_operation_notify(idi_operation_t op);
+
+/*
+ * Starts a command. The client_options (may be NULL) are copied. The
+ * functions return once the command was started; its result is passed to
+ * the completion callback and returned by idi_operation_wait(). A device
+ * that goes away while the command runs ends it with IDI_E_NO_DEVICE.
+ */
+
+/* browses the installed apps, see idi_operation_set_apps_callback() */
+idi_error_t idi_browse_async(idi_operation_t op, plist_t client_options);
+
+/* installs the package at pkg_path, which is relative to the AFC root (e.g. in PublicStaging) */
+idi_error_t idi_install_async(idi_operation_t op, const char *pkg_path, plist_t client_options);
+
+/* like idi_install_async(), but upgrades an installed app */
+idi_error_t idi_upgrade_async(idi_operation_t op, const char *pkg_path, plist_t client_options);
+
+/* uninstalls the app with the given bundle identifier */
+idi_error_t idi_uninstall_async(idi_operation_t op, const char *bundle_id, plist_t client_options);
+
+/* archives, restores or removes the archive of the app with the given bundle identifier */
+idi_error_t idi_archive_async(idi_operation_t op, const char *bundle_id, plist_t client_options);
+idi_error_t idi_restore_async(idi_operation_t op, const char *bundle_id, plist_t client_options);
+idi_error_t idi_remove_archive_async(idi_operation_t op, const char *bundle_id, plist_t client_options);
+
+/* waits for the running command (if any) and returns the result of the last one */
+idi_error_t idi_operation_wait(idi_operation_t op);
+
+/* the installation_proxy name of the last command (e.g. "Install"), or NULL */
+const char *idi_operation_get_command(idi_operation_t op);
+
+/* the array of apps of the last completed browse, owned by the operation */
+plist_t idi_operation_get_apps(idi_operation_t op);
+
+/*
+ * Details of the last IDI_E_OP_FAILED result as reported by the device.
+ * The strings are owned by the operation and may be NULL.
+ */
+idi_error_t idi_operation_get_error(idi_operation_t op, const char **name, const char **description, uint64_t *code);
+
+/* waits for the running command (if any) and frees the operation, but not its client */
+void idi_operation_free(idi_operation_t op);
+
+/* a description of err */
+const char *idi_strerror(idi_error_t err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,562 @@
+/*
+ * metrics.c
+ * Prometheus metrics for --metrics-file
+ *
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more profile.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <fcntl.h>
+#ifdef WIN32
+#include <io.h>
+#endif
+
+#include <plist/plist.h>
+#include <libimobiledevice-glue/thread.h>
+
+#include "metrics.h"
+#include "filelock.h"
+
+struct metrics_observations {
+	double *values;
+	size_t count;
+	size_t capacity;
+};
+
+struct metrics_state {
+	char *path;
+	const char *command;
+	uint64_t upload_bytes;
+	uint64_t upload_time_us;
+	struct metrics_observations install_durations;
+	struct metrics_observations browse_durations;
+	plist_t errors;
+	uint64_t disconnects;
+	uint64_t retries;
+};
+
+struct metrics_family {
+	const char *name;
+	const char *type;
+	const char *help;
+};
+
+static const struct metrics_family metrics_families[] = {
+	{ "ideviceinstaller_operations_total", "counter", "Number of runs by command and result." },
+	{ "ideviceinstaller_last_operation_timestamp_seconds", "gauge", "Time of the last run." },
+	{ "ideviceinstaller_install_duration_seconds", "histogram", "Time from sending an install or upgrade command until it completed." },
+	{ "ideviceinstaller_browse_duration_seconds", "histogram", "Latency of app browse requests." },
+	{ "ideviceinstaller_upload_bytes_total", "counter", "Bytes uploaded to the device." },
+	{ "ideviceinstaller_upload_seconds_total", "counter", "Time spent uploading to the device." },
+	{ "ideviceinstaller_upload_throughput_bytes_per_second", "gauge", "Throughput of the uploads of the last run." },
+	{ "ideviceinstaller_errors_total", "counter", "Errors reported by installation_proxy by error name." },
+	{ "ideviceinstaller_device_disconnects_total", "counter", "Device disconnects while waiting for an operation." },
+	{ "ideviceinstaller_retries_total", "counter", "Retries after transient device errors." },
+	{ NULL, NULL, NULL }
+};
+
+static const double metrics_install_buckets[] = { 1, 2.5, 5, 10, 20, 30, 60, 120, 300, 600 };
+static const double metrics_browse_buckets[] = { 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+
+static struct metrics_state metrics;
+static mutex_t metrics_mutex;
+
+static char *metrics_printf(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (len < 0) {
+		return NULL;
+	}
+	char *str = (char*)malloc(len + 1);
+	if (!str) {
+		return NULL;
+	}
+	va_start(ap, fmt);
+	vsnprintf(str, len + 1, fmt, ap);
+	va_end(ap);
+	return str;
+}
+
+void metrics_init(const char *path, const char *command)
+{
+	memset(&metrics, 0, sizeof(metrics));
+	if (!path) {
+		return;
+	}
+	metrics.path = strdup(path);
+	metrics.command = command;
+	metrics.errors = plist_new_dict();
+	mutex_init(&metrics_mutex);
+}
+
+int metrics_enabled(void)
+{
+	return (metrics.path != NULL);
+}
+
+static void metrics_observe(struct metrics_observations *obs, double value)
+{
+	if (!metrics.path) {
+		return;
+	}
+	mutex_lock(&metrics_mutex);
+	if (obs->count >= obs->capacity) {
+		size_t newcap = (obs->capacity) ? obs->capacity * 2 : 16;
+		double *newvalues = (double*)realloc(obs->values, newcap * sizeof(double));
+		if (!newvalues) {
+			mutex_unlock(&metrics_mutex);
+			return;
+		}
+		obs->values = newvalues;
+		obs->capacity = newcap;
+	}
+	obs->values[obs->count++] = value;
+	mutex_unlock(&metrics_mutex);
+}
+
+void metrics_observe_install(double seconds)
+{
+	metrics_observe(&metrics.install_durations, seconds);
+}
+
+void metrics_observe_browse(double seconds)
+{
+	metrics_observe(&metrics.browse_durations, seconds);
+}
+
+void metrics_add_upload(uint64_t bytes, uint64_t time_us)
+{
+	if (!metrics.path) {
+		return;
+	}
+	mutex_lock(&metrics_mutex);
+	metrics.upload_bytes += bytes;
+	metrics.upload_time_us += time_us;
+	mutex_unlock(&metrics_mutex);
+}
+
+void metrics_count_error(const char *error_name)
+{
+	if (!metrics.path) {
+		return;
+	}
+	mutex_lock(&metrics_mutex);
+	plist_t node = plist_dict_get_item(metrics.errors, error_name);
+	if (node) {
+		uint64_t count = 0;
+		plist_get_uint_val(node, &count);
+		plist_set_uint_val(node, count + 1);
+	} else {
+		plist_dict_set_item(metrics.errors, error_name, plist_new_uint(1));
+	}
+	mutex_unlock(&metrics_mutex);
+}
+
+void metrics_count_disconnect(void)
+{
+	if (!metrics.path) {
+		return;
+	}
+	mutex_lock(&metrics_mutex);
+	metrics.disconnects++;
+	mutex_unlock(&metrics_mutex);
+}
+
+void metrics_count_retry(void)
+{
+	if (!metrics.path) {
+		return;
+	}
+	mutex_lock(&metrics_mutex);
+	metrics.retries++;
+	mutex_unlock(&metrics_mutex);
+}
+
+/* escapes a label value as required by the text format */
+static char *metrics_escape(const char *value)
+{
+	size_t len = (value) ? strlen(value) : 0;
+	char *res = (char*)malloc(len * 2 + 1);
+	char *p = res;
+	size_t i;
+	if (!res) {
+		return NULL;
+	}
+	for (i = 0; i < len; i++) {
+		if (value[i] == '\\' || value[i] == '"') {
+			*p++ = '\\';
+			*p++ = value[i];
+		} else if (value[i] == '\n') {
+			*p++ = '\\';
+			*p++ = 'n';
+		} else {
+			*p++ = value[i];
+		}
+	}
+	*p = '\0';
+	return res;
+}
+
+/* adds value to (or with set, replaces) the sample name{labels,extra} */
+static void metrics_sample(plist_t samples, const char *name, const char *labels, const char *extra, double value, int set)
+{
+	char *key = metrics_printf("%s{%s%s%s}", name, labels, (extra) ? "," : "", (extra) ? extra : "");
+	if (!key) {
+		return;
+	}
+	plist_t node = plist_dict_get_item(samples, key);
+	if (node && !set) {
+		double current = 0;
+		plist_get_real_val(node, &current);
+		plist_set_real_val(node, current + value);
+	} else {
+		plist_dict_set_item(samples, key, plist_new_real(value));
+	}
+	free(key);
+}
+
+static void metrics_histogram(plist_t samples, const char *name, const char *labels, const double *buckets, size_t num_buckets, struct metrics_observations *obs)
+{
+	char *series = NULL;
+	char le[64];
+	size_t i, j;
+	double sum = 0;
+
+	if (obs->count == 0 || (series = metrics_printf("%s_bucket", name)) == NULL) {
+		return;
+	}
+	for (i = 0; i < num_buckets; i++) {
+		uint64_t count = 0;
+		for (j = 0; j < obs->count; j++) {
+			if (obs->values[j] <= buckets[i]) {
+				count++;
+			}
+		}
+		snprintf(le, sizeof(le), "le=\"%g\"", buckets[i]);
+		metrics_sample(samples, series, labels, le, (double)count, 0);
+	}
+	metrics_sample(samples, series, labels, "le=\"+Inf\"", (double)obs->count, 0);
+	free(series);
+
+	for (j = 0; j < obs->count; j++) {
+		sum += obs->values[j];
+	}
+	if ((series = metrics_printf("%s_sum", name)) != NULL) {
+		metrics_sample(samples, series, labels, NULL, sum, 0);
+		free(series);
+	}
+	if ((series = metrics_printf("%s_count", name)) != NULL) {
+		metrics_sample(samples, series, labels, NULL, (double)obs->count, 0);
+		free(series);
+	}
+}
+
+/*
+ * splits a sample line into the series (name and labels) and the value,
+ * returns -1 if it is not a valid sample
+ */
+static int metrics_parse_sample(char *line, char **series, double *value)
+{
+	char *p = line;
+	if (!isalpha((unsigned char)*p) && *p != '_' && *p != ':') {
+		return -1;
+	}
+	while (isalnum((unsigned char)*p) || *p == '_' || *p == ':') {
+		p++;
+	}
+	if (*p == '{') {
+		int quoted = 0;
+		for (p++; *p && (quoted || *p != '}'); p++) {
+			if (quoted && *p == '\\' && *(p+1)) {
+				p++;
+			} else if (*p == '"') {
+				quoted = !quoted;
+			}
+		}
+		if (*p != '}') {
+			return -1;
+		}
+		p++;
+	}
+	if (*p != ' ') {
+		return -1;
+	}
+	*p++ = '\0';
+	while (*p == ' ') {
+		p++;
+	}
+	char *endp = NULL;
+	errno = 0;
+	*value = strtod(p, &endp);
+	if (endp == p || errno == ERANGE) {
+		return -1;
+	}
+	/* an optional timestamp may follow, it is not kept */
+	if (*endp == ' ') {
+		char *ts = endp;
+		strtoll(ts, &endp, 10);
+		if (endp == ts) {
+			return -1;
+		}
+	}
+	if (*endp != '\0') {
+		return -1;
+	}
+	*series = line;
+	return 0;
+}
+
+/* reads the samples of an existing metrics file, keeping their order */
+static void metrics_read(const char *path, plist_t samples)
+{
+	char line[4096];
+	int skip = 0;
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		return;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		size_t len = strlen(line);
+		int complete = (len > 0 && line[len-1] == '\n') || feof(f);
+		if (skip || !complete) {
+			/* an overlong line is dropped as a whole */
+			skip = !complete;
+			continue;
+		}
+		while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) {
+			line[--len] = '\0';
+		}
+		if (len == 0 || line[0] == '#') {
+			continue;
+		}
+		char *series = NULL;
+		double value = 0;
+		if (metrics_parse_sample(line, &series, &value) < 0) {
+			continue;
+		}
+		plist_dict_set_item(samples, series, plist_new_real(value));
+	}
+	fclose(f);
+}
+
+static int metrics_family_matches(const struct metrics_family *family, const char *key)
+{
+	size_t len = strlen(family->name);
+	size_t keylen = strcspn(key, "{");
+	if (keylen < len || strncmp(key, family->name, len) != 0) {
+		return 0;
+	}
+	if (keylen == len) {
+		return 1;
+	}
+	if (strcmp(family->type, "histogram") != 0) {
+		return 0;
+	}
+	return (keylen == len + 7 && !strncmp(key + len, "_bucket", 7))
+		|| (keylen == len + 4 && !strncmp(key + len, "_sum", 4))
+		|| (keylen == len + 6 && !strncmp(key + len, "_count", 6));
+}
+
+static void metrics_print_sample(FILE *f, const char *key, plist_t node)
+{
+	double value = 0;
+	plist_get_real_val(node, &value);
+	if (value == (double)(int64_t)value && value < 9007199254740992.0 && value > -9007199254740992.0) {
+		fprintf(f, "%s %.0f\n", key, value);
+	} else {
+		fprintf(f, "%s %.15g\n", key, value);
+	}
+}
+
+static void metrics_print(FILE *f, plist_t samples)
+{
+	const struct metrics_family *family;
+	plist_dict_iter iter = NULL;
+	char *key = NULL;
+	plist_t node = NULL;
+
+	/* all samples of a family have to be grouped together */
+	for (family = metrics_families; family->name; family++) {
+		int header = 0;
+		plist_dict_new_iter(samples, &iter);
+		while (1) {
+			plist_dict_next_item(samples, iter, &key, &node);
+			if (!node) {
+				break;
+			}
+			if (metrics_family_matches(family, key)) {
+				if (!header) {
+					fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", family->name, family->help, family->name, family->type);
+					header = 1;
+				}
+				metrics_print_sample(f, key, node);
+			}
+			free(key);
+			key = NULL;
+		}
+		free(iter);
+	}
+
+	/* keep samples this version doesn't know about */
+	plist_dict_new_iter(samples, &iter);
+	while (1) {
+		plist_dict_next_item(samples, iter, &key, &node);
+		if (!node) {
+			break;
+		}
+		for (family = metrics_families; family->name; family++) {
+			if (metrics_family_matches(family, key)) {
+				break;
+			}
+		}
+		if (!family->name) {
+			metrics_print_sample(f, key, node);
+		}
+		free(key);
+		key = NULL;
+	}
+	free(iter);
+}
+
+void metrics_write(const char *device_udid, int result)
+{
+	char *lockname = NULL;
+	char *tmpname = NULL;
+	char *eudid = metrics_escape(device_udid);
+	char *labels = NULL;
+	char extra[64];
+	int lockfd = -1;
+
+	if (!metrics.path) {
+		free(eudid);
+		return;
+	}
+	labels = (eudid) ? metrics_printf("udid=\"%s\",command=\"%s\"", eudid, metrics.command) : NULL;
+	free(eudid);
+	if (!labels) {
+		return;
+	}
+	lockname = metrics_printf("%s.lock", metrics.path);
+	tmpname = metrics_printf("%s.%d.tmp", metrics.path, (int)getpid());
+	if (!lockname || !tmpname) {
+		fprintf(stderr, "ERROR: Out of memory!?\n");
+		goto leave;
+	}
+
+	/* serialize the read-modify-write of concurrent runs */
+	lockfd = open(lockname, O_RDWR | O_CREAT, 0644);
+	if (lockfd < 0 || lock_file(lockfd, 0) < 0) {
+		fprintf(stderr, "WARNING: Could not lock %s: %s. Metrics not written.\n", lockname, strerror(errno));
+		goto leave;
+	}
+
+	plist_t samples = plist_new_dict();
+	metrics_read(metrics.path, samples);
+
+	snprintf(extra, sizeof(extra), "result=\"%s\"", (result == 0) ? "success" : "failure");
+	metrics_sample(samples, "ideviceinstaller_operations_total", labels, extra, 1, 0);
+	metrics_sample(samples, "ideviceinstaller_last_operation_timestamp_seconds", labels, NULL, (double)time(NULL), 1);
+	metrics_histogram(samples, "ideviceinstaller_install_duration_seconds", labels, metrics_install_buckets, sizeof(metrics_install_buckets) / sizeof(double), &metrics.install_durations);
+	metrics_histogram(samples, "ideviceinstaller_browse_duration_seconds", labels, metrics_browse_buckets, sizeof(metrics_browse_buckets) / sizeof(double), &metrics.browse_durations);
+	if (metrics.upload_bytes > 0) {
+		double seconds = (double)metrics.upload_time_us / 1000000;
+		metrics_sample(samples, "ideviceinstaller_upload_bytes_total", labels, NULL, (double)metrics.upload_bytes, 0);
+		metrics_sample(samples, "ideviceinstaller_upload_seconds_total", labels, NULL, seconds, 0);
+		if (seconds > 0) {
+			metrics_sample(samples, "ideviceinstaller_upload_throughput_bytes_per_second", labels, NULL, (double)metrics.upload_bytes / seconds, 1);
+		}
+	}
+	plist_dict_iter iter = NULL;
+	plist_dict_new_iter(metrics.errors, &iter);
+	while (1) {
+		char *error_name = NULL;
+		plist_t node = NULL;
+		plist_dict_next_item(metrics.errors, iter, &error_name, &node);
+		if (!node) {
+			break;
+		}
+		char *eerror = metrics_escape(error_name);
+		char *error_label = NULL;
+		uint64_t count = 0;
+		plist_get_uint_val(node, &count);
+		if (eerror && (error_label = metrics_printf("error=\"%s\"", eerror)) != NULL) {
+			metrics_sample(samples, "ideviceinstaller_errors_total", labels, error_label, (double)count, 0);
+			free(error_label);
+		}
+		free(eerror);
+		free(error_name);
+	}
+	free(iter);
+	if (metrics.disconnects > 0) {
+		metrics_sample(samples, "ideviceinstaller_device_disconnects_total", labels, NULL, (double)metrics.disconnects, 0);
+	}
+	if (metrics.retries > 0) {
+		metrics_sample(samples, "ideviceinstaller_retries_total", labels, NULL, (double)metrics.retries, 0);
+	}
+
+	/* the collector must never see a partially written file */
+	int written = 0;
+	FILE *f = fopen(tmpname, "w");
+	if (f) {
+		metrics_print(f, samples);
+		written = (fclose(f) == 0 && rename(tmpname, metrics.path) == 0);
+	}
+	if (!written) {
+		fprintf(stderr, "WARNING: Could not write metrics to %s: %s\n", metrics.path, strerror(errno));
+		remove(tmpname);
+	}
+	plist_free(samples);
+
+leave:
+	if (lockfd >= 0) {
+		/* closing releases the lock */
+		close(lockfd);
+	}
+	free(lockname);
+	free(tmpname);
+	free(labels);
+}
+
+void metrics_free(void)
+{
+	if (!metrics.path) {
+		return;
+	}
+	free(metrics.path);
+	free(metrics.install_durations.values);
+	free(metrics.browse_durations.values);
+	plist_free(metrics.errors);
+	mutex_destroy(&metrics_mutex);
+	memset(&metrics, 0, sizeof(metrics));
+}
+
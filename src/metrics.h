@@ -0,0 +1,51 @@
+/*
+ * metrics.h
+ * Prometheus metrics for --metrics-file
+ *
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more profile.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+
+#ifndef __METRICS_H
+#define __METRICS_H
+
+#include <stdint.h>
+
+/*
+ * Metrics in the Prometheus text format, as read by the node_exporter
+ * textfile collector. Counters and histograms accumulate over all runs
+ * sharing the file: metrics_write() merges the samples of this run into the
+ * existing ones under a lock and replaces the file atomically. Lines of the
+ * existing file that are not valid samples are dropped.
+ * Unless metrics_init() was called with a path, all calls do nothing.
+ */
+void metrics_init(const char *path, const char *command);
+int metrics_enabled(void);
+
+void metrics_observe_install(double seconds);
+void metrics_observe_browse(double seconds);
+void metrics_add_upload(uint64_t bytes, uint64_t time_us);
+void metrics_count_error(const char *error_name);
+void metrics_count_disconnect(void);
+void metrics_count_retry(void);
+
+/* result is 0 on success */
+void metrics_write(const char *device_udid, int result);
+void metrics_free(void);
+
+#endif
@@ -0,0 +1,277 @@
+/*
+ * metricstest.c
+ * Checks merging runs into an existing --metrics-file
+ *
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more profile.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "metrics.h"
+
+#define UDID "00008030-001A2D0E3C0A802E"
+#define LABELS "udid=\"" UDID "\",command=\"install\""
+
+static int failed = 0;
+
+static char *read_file(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	char *data = NULL;
+	long size;
+	if (!f) {
+		return NULL;
+	}
+	if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0) {
+		data = (char*)malloc(size + 1);
+		if (data && fread(data, 1, size, f) == (size_t)size) {
+			data[size] = '\0';
+		} else {
+			free(data);
+			data = NULL;
+		}
+	}
+	fclose(f);
+	return data;
+}
+
+static int write_file(const char *path, const char *data)
+{
+	FILE *f = fopen(path, "wb");
+	if (!f) {
+		return -1;
+	}
+	int res = (fputs(data, f) >= 0) ? 0 : -1;
+	if (fclose(f) != 0) {
+		res = -1;
+	}
+	return res;
+}
+
+static int count_lines(const char *data, const char *line)
+{
+	size_t len = strlen(line);
+	const char *p = data;
+	int count = 0;
+	while (p && *p) {
+		const char *end = strchr(p, '\n');
+		size_t n = (end) ? (size_t)(end - p) : strlen(p);
+		if (n == len && memcmp(p, line, len) == 0) {
+			count++;
+		}
+		p = (end) ? end + 1 : NULL;
+	}
+	return count;
+}
+
+/* lines starting with ! must not appear, all others exactly once */
+static void check(const char *name, const char *path, const char *const *lines)
+{
+	char *data = read_file(path);
+	int ok = (data != NULL);
+	int i;
+	for (i = 0; ok && lines[i]; i++) {
+		int negate = (lines[i][0] == '!');
+		int count = count_lines(data, lines[i] + negate);
+		if (count != ((negate) ? 0 : 1)) {
+			printf("%-36s FAILED: line %s %s\n", name, lines[i] + negate, (negate) ? "found" : (count) ? "repeated" : "missing");
+			ok = 0;
+		}
+	}
+	if (!ok) {
+		printf("----\n%s----\n", (data) ? data : "(no file)\n");
+		failed++;
+	} else {
+		printf("%-36s OK\n", name);
+	}
+	free(data);
+}
+
+static void run_install(const char *path, double seconds, int result)
+{
+	metrics_init(path, "install");
+	metrics_observe_install(seconds);
+	metrics_observe_browse(0.2);
+	metrics_add_upload(4000000, 2000000);
+	metrics_count_error("APIInternalError");
+	metrics_count_error("APIInternalError");
+	metrics_count_error("Error \"quoted\"");
+	metrics_count_disconnect();
+	metrics_write(UDID, result);
+	metrics_free();
+}
+
+static void test_new_file(const char *path)
+{
+	static const char *const lines[] = {
+		"# TYPE ideviceinstaller_operations_total counter",
+		"ideviceinstaller_operations_total{" LABELS ",result=\"success\"} 1",
+		"# TYPE ideviceinstaller_install_duration_seconds histogram",
+		"ideviceinstaller_install_duration_seconds_bucket{" LABELS ",le=\"2.5\"} 0",
+		"ideviceinstaller_install_duration_seconds_bucket{" LABELS ",le=\"5\"} 1",
+		"ideviceinstaller_install_duration_seconds_bucket{" LABELS ",le=\"+Inf\"} 1",
+		"ideviceinstaller_install_duration_seconds_sum{" LABELS "} 3",
+		"ideviceinstaller_install_duration_seconds_count{" LABELS "} 1",
+		"ideviceinstaller_browse_duration_seconds_bucket{" LABELS ",le=\"0.25\"} 1",
+		"ideviceinstaller_upload_bytes_total{" LABELS "} 4000000",
+		"ideviceinstaller_upload_seconds_total{" LABELS "} 2",
+		"ideviceinstaller_upload_throughput_bytes_per_second{" LABELS "} 2000000",
+		"ideviceinstaller_errors_total{" LABELS ",error=\"APIInternalError\"} 2",
+		"ideviceinstaller_errors_total{" LABELS ",error=\"Error \\\"quoted\\\"\"} 1",
+		"ideviceinstaller_device_disconnects_total{" LABELS "} 1",
+		"!ideviceinstaller_retries_total{" LABELS "} 0",
+		NULL
+	};
+	remove(path);
+	run_install(path, 3, 0);
+	check("new file", path, lines);
+}
+
+static void test_merge(const char *path)
+{
+	static const char *const lines[] = {
+		"# TYPE ideviceinstaller_operations_total counter",
+		"ideviceinstaller_operations_total{" LABELS ",result=\"success\"} 1",
+		"ideviceinstaller_operations_total{" LABELS ",result=\"failure\"} 1",
+		"ideviceinstaller_install_duration_seconds_bucket{" LABELS ",le=\"5\"} 1",
+		"ideviceinstaller_install_duration_seconds_bucket{" LABELS ",le=\"60\"} 2",
+		"ideviceinstaller_install_duration_seconds_bucket{" LABELS ",le=\"+Inf\"} 2",
+		"ideviceinstaller_install_duration_seconds_sum{" LABELS "} 48.5",
+		"ideviceinstaller_install_duration_seconds_count{" LABELS "} 2",
+		"ideviceinstaller_upload_bytes_total{" LABELS "} 8000000",
+		"ideviceinstaller_upload_seconds_total{" LABELS "} 4",
+		"ideviceinstaller_upload_throughput_bytes_per_second{" LABELS "} 2000000",
+		"ideviceinstaller_errors_total{" LABELS ",error=\"APIInternalError\"} 4",
+		"ideviceinstaller_device_disconnects_total{" LABELS "} 2",
+		NULL
+	};
+	/* on top of the file of test_new_file() */
+	run_install(path, 45.5, 1);
+	check("merge into existing file", path, lines);
+}
+
+static void test_malformed(const char *path)
+{
+	char *input = NULL;
+	char longline[4096 + 32];
+	static const char *const lines[] = {
+		/* valid samples, including ones this version doesn't know, are kept */
+		"ideviceinstaller_operations_total{" LABELS ",result=\"success\"} 4",
+		"ideviceinstaller_retries_total{" LABELS "} 3",
+		"node_custom_metric{path=\"/a b\",note=\"x} \\\"y\\\"\"} 7",
+		"node_other_metric 1.5",
+		"with_timestamp 9",
+		/* our histogram starts over, its broken samples are gone */
+		"ideviceinstaller_install_duration_seconds_count{" LABELS "} 1",
+		"ideviceinstaller_install_duration_seconds_sum{" LABELS "} 3",
+		"!ideviceinstaller_install_duration_seconds_bucket{" LABELS ",le=\"5\"} oops",
+		"!garbage",
+		"!ideviceinstaller_errors_total{" LABELS ",error=\"Unterminated} 5",
+		"!9starts_with_digit 1",
+		"!no_value{a=\"b\"}",
+		"!trailing_junk 5 6 7",
+		"!tail_of_long_line 1",
+		"# TYPE ideviceinstaller_retries_total counter",
+		NULL
+	};
+
+	/* longer than the read buffer, its tail must not be taken for a line of its own */
+	memset(longline, ' ', sizeof(longline));
+	memcpy(longline, "long_line 1", 11);
+	strcpy(longline + 4095, "tail_of_long_line 1\n");
+
+	const char *parts[] = {
+		"# HELP something\n",
+		"garbage\n",
+		"ideviceinstaller_operations_total{" LABELS ",result=\"success\"} 3\n",
+		"ideviceinstaller_retries_total{" LABELS "} 3\r\n",
+		"ideviceinstaller_install_duration_seconds_bucket{" LABELS ",le=\"5\"} oops\n",
+		"ideviceinstaller_errors_total{" LABELS ",error=\"Unterminated} 5\n",
+		"9starts_with_digit 1\n",
+		"no_value{a=\"b\"}\n",
+		"trailing_junk 5 6 7\n",
+		"\n",
+		longline,
+		"node_custom_metric{path=\"/a b\",note=\"x} \\\"y\\\"\"} 7\n",
+		"with_timestamp 9 1700000000000\n",
+		"node_other_metric 1.5",
+		NULL
+	};
+	size_t len = 1;
+	int i;
+	for (i = 0; parts[i]; i++) {
+		len += strlen(parts[i]);
+	}
+	input = (char*)malloc(len);
+	input[0] = '\0';
+	for (i = 0; parts[i]; i++) {
+		strcat(input, parts[i]);
+	}
+	if (write_file(path, input) < 0) {
+		printf("%-36s FAILED: could not write %s\n", "malformed file", path);
+		failed++;
+		free(input);
+		return;
+	}
+	free(input);
+
+	metrics_init(path, "install");
+	metrics_observe_install(3);
+	metrics_write(UDID, 0);
+	metrics_free();
+	check("malformed file", path, lines);
+}
+
+static void test_disabled(const char *path)
+{
+	static const char *const lines[] = {
+		"ideviceinstaller_install_duration_seconds_count{" LABELS "} 1",
+		NULL
+	};
+	/* without a path nothing is collected or written */
+	metrics_init(NULL, "install");
+	metrics_observe_install(3);
+	metrics_count_retry();
+	metrics_write(UDID, 0);
+	metrics_free();
+	check("disabled", path, lines);
+}
+
+int main(int argc, char **argv)
+{
+	char path[64];
+	char lockpath[80];
+
+	snprintf(path, sizeof(path), "metricstest.%d.prom", (int)getpid());
+	snprintf(lockpath, sizeof(lockpath), "%s.lock", path);
+	test_new_file(path);
+	test_merge(path);
+	test_malformed(path);
+	test_disabled(path);
+	remove(path);
+	remove(lockpath);
+	return (failed > 0) ? 1 : 0;
+}
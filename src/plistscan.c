@@ -0,0 +1,809 @@
+/*
+ * plistscan.c
+ * Extraction of top-level string values from property lists without
+ * building the plist tree
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more profile.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+#include "plistscan.h"
+
+#define BPLIST_MAGIC "bplist00"
+#define BPLIST_MAGIC_LEN 8
+#define BPLIST_TRAILER_SIZE 32
+#define BPLIST_MAX_SIZE (256 * 1024 * 1024)
+
+#define BPLIST_DICT 0xD0
+#define BPLIST_STRING 0x50
+#define BPLIST_UNICODE 0x60
+#define BPLIST_UINT 0x10
+
+struct scan_stream {
+	plistscan_read_func read_func;
+	void *userdata;
+	char buf[16384];
+	size_t pos;
+	size_t len;
+	int eof;
+	int error;
+};
+
+static int stream_fill(struct scan_stream *s)
+{
+	if (s->eof) {
+		return -1;
+	}
+	int64_t r = s->read_func(s->userdata, s->buf, sizeof(s->buf));
+	if (r <= 0) {
+		s->eof = 1;
+		if (r < 0) {
+			s->error = 1;
+		}
+		return -1;
+	}
+	s->pos = 0;
+	s->len = (size_t)r;
+	return 0;
+}
+
+static int stream_getc(struct scan_stream *s)
+{
+	if (s->pos >= s->len && stream_fill(s) < 0) {
+		return -1;
+	}
+	return (unsigned char)s->buf[s->pos++];
+}
+
+static int stream_peek(struct scan_stream *s)
+{
+	if (s->pos >= s->len && stream_fill(s) < 0) {
+		return -1;
+	}
+	return (unsigned char)s->buf[s->pos];
+}
+
+static int find_key(const char *const *keys, char **values, int num_keys, const char *key, size_t keylen)
+{
+	int i;
+	for (i = 0; i < num_keys; i++) {
+		if (!values[i] && strlen(keys[i]) == keylen && memcmp(keys[i], key, keylen) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* binary plists */
+
+struct bplist {
+	const unsigned char *data;
+	uint64_t size;
+	uint8_t offset_size;
+	uint8_t ref_size;
+	uint64_t num_objects;
+	uint64_t offset_table;
+};
+
+static uint64_t be_uint(const unsigned char *p, uint8_t n)
+{
+	uint64_t v = 0;
+	uint8_t i;
+	for (i = 0; i < n; i++) {
+		v = (v << 8) | p[i];
+	}
+	return v;
+}
+
+static int bplist_get_object_offset(struct bplist *bp, uint64_t ref, uint64_t *offset)
+{
+	if (ref >= bp->num_objects) {
+		return -1;
+	}
+	*offset = be_uint(bp->data + bp->offset_table + ref * bp->offset_size, bp->offset_size);
+	if (*offset < BPLIST_MAGIC_LEN || *offset >= bp->offset_table) {
+		return -1;
+	}
+	return 0;
+}
+
+/* reads the length of the object at offset and advances offset to its data */
+static int bplist_get_length(struct bplist *bp, uint64_t *offset, uint64_t *length)
+{
+	uint8_t marker = bp->data[*offset];
+	*offset += 1;
+	if ((marker & 0x0F) != 0x0F) {
+		*length = marker & 0x0F;
+		return 0;
+	}
+	if (*offset >= bp->offset_table) {
+		return -1;
+	}
+	uint8_t imarker = bp->data[*offset];
+	if ((imarker & 0xF0) != BPLIST_UINT || (imarker & 0x0F) > 3) {
+		return -1;
+	}
+	uint8_t n = 1 << (imarker & 0x0F);
+	if (*offset + 1 + n > bp->offset_table) {
+		return -1;
+	}
+	*length = be_uint(bp->data + *offset + 1, n);
+	*offset += 1 + n;
+	return 0;
+}
+
+/* locates the character data of a string object, units is 1 for ASCII and 2 for UTF-16.
+ * Returns 1 if the object is valid but not a string, -1 if it is malformed. */
+static int bplist_get_string_data(struct bplist *bp, uint64_t ref, const unsigned char **data, uint64_t *length, int *units)
+{
+	uint64_t offset = 0;
+	if (bplist_get_object_offset(bp, ref, &offset) < 0) {
+		return -1;
+	}
+	uint8_t type = bp->data[offset] & 0xF0;
+	if (type == BPLIST_STRING) {
+		*units = 1;
+	} else if (type == BPLIST_UNICODE) {
+		*units = 2;
+	} else {
+		return 1;
+	}
+	if (bplist_get_length(bp, &offset, length) < 0) {
+		return -1;
+	}
+	if (*length > (bp->offset_table - offset) / *units) {
+		return -1;
+	}
+	*data = bp->data + offset;
+	return 0;
+}
+
+/* returns the index of the requested key, -1 if it is not requested and -2 if it is malformed */
+static int bplist_key_index(struct bplist *bp, uint64_t ref, const char *const *keys, char **values, int num_keys)
+{
+	const unsigned char *data = NULL;
+	uint64_t length = 0;
+	int units = 0;
+	int i;
+
+	int res = bplist_get_string_data(bp, ref, &data, &length, &units);
+	if (res < 0) {
+		return -2;
+	} else if (res > 0) {
+		return -1;
+	}
+	if (units == 1) {
+		return find_key(keys, values, num_keys, (const char*)data, length);
+	}
+	/* the keys we look for are ASCII, so compare the UTF-16 code units directly */
+	for (i = 0; i < num_keys; i++) {
+		uint64_t j;
+		if (values[i] || strlen(keys[i]) != length) {
+			continue;
+		}
+		for (j = 0; j < length; j++) {
+			if (data[j*2] != 0 || data[j*2+1] != (unsigned char)keys[i][j]) {
+				break;
+			}
+		}
+		if (j == length) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* stores the string, or NULL if the object is not a string, returns -1 if it is malformed */
+static int bplist_get_string(struct bplist *bp, uint64_t ref, char **value)
+{
+	const unsigned char *data = NULL;
+	uint64_t length = 0;
+	int units = 0;
+	char *str = NULL;
+
+	*value = NULL;
+	int res = bplist_get_string_data(bp, ref, &data, &length, &units);
+	if (res != 0) {
+		return (res < 0) ? -1 : 0;
+	}
+	if (units == 1) {
+		str = (char*)malloc(length + 1);
+		if (!str) {
+			return -1;
+		}
+		memcpy(str, data, length);
+		str[length] = '\0';
+		*value = str;
+		return 0;
+	}
+
+	/* UTF-16BE to UTF-8 */
+	str = (char*)malloc(length * 3 + 1);
+	if (!str) {
+		return -1;
+	}
+	char *p = str;
+	uint64_t i = 0;
+	while (i < length) {
+		uint32_t c = (data[i*2] << 8) | data[i*2+1];
+		i++;
+		if (c >= 0xD800 && c <= 0xDBFF && i < length) {
+			uint32_t c2 = (data[i*2] << 8) | data[i*2+1];
+			if (c2 >= 0xDC00 && c2 <= 0xDFFF) {
+				c = 0x10000 + ((c - 0xD800) << 10) + (c2 - 0xDC00);
+				i++;
+			}
+		}
+		if (c < 0x80) {
+			*p++ = (char)c;
+		} else if (c < 0x800) {
+			*p++ = (char)(0xC0 | (c >> 6));
+			*p++ = (char)(0x80 | (c & 0x3F));
+		} else if (c < 0x10000) {
+			*p++ = (char)(0xE0 | (c >> 12));
+			*p++ = (char)(0x80 | ((c >> 6) & 0x3F));
+			*p++ = (char)(0x80 | (c & 0x3F));
+		} else {
+			*p++ = (char)(0xF0 | (c >> 18));
+			*p++ = (char)(0x80 | ((c >> 12) & 0x3F));
+			*p++ = (char)(0x80 | ((c >> 6) & 0x3F));
+			*p++ = (char)(0x80 | (c & 0x3F));
+		}
+	}
+	*p = '\0';
+	*value = str;
+	return 0;
+}
+
+static int bplist_scan(const unsigned char *data, uint64_t size, const char *const *keys, char **values, int num_keys)
+{
+	struct bplist bp;
+	int found = 0;
+
+	if (size < BPLIST_MAGIC_LEN + 1 + BPLIST_TRAILER_SIZE) {
+		return -1;
+	}
+	const unsigned char *trailer = data + size - BPLIST_TRAILER_SIZE;
+	bp.data = data;
+	bp.size = size;
+	bp.offset_size = trailer[6];
+	bp.ref_size = trailer[7];
+	bp.num_objects = be_uint(trailer + 8, 8);
+	uint64_t top_object = be_uint(trailer + 16, 8);
+	bp.offset_table = be_uint(trailer + 24, 8);
+
+	if (bp.offset_size < 1 || bp.offset_size > 8 || bp.ref_size < 1 || bp.ref_size > 8) {
+		return -1;
+	}
+	uint64_t table_max = size - BPLIST_TRAILER_SIZE;
+	if (bp.offset_table < BPLIST_MAGIC_LEN + 1 || bp.offset_table > table_max) {
+		return -1;
+	}
+	if (bp.num_objects == 0 || bp.num_objects > (table_max - bp.offset_table) / bp.offset_size || top_object >= bp.num_objects) {
+		return -1;
+	}
+
+	uint64_t offset = 0;
+	if (bplist_get_object_offset(&bp, top_object, &offset) < 0) {
+		return -1;
+	}
+	if ((data[offset] & 0xF0) != BPLIST_DICT) {
+		return -1;
+	}
+	uint64_t count = 0;
+	if (bplist_get_length(&bp, &offset, &count) < 0) {
+		return -1;
+	}
+	if (count > (bp.offset_table - offset) / bp.ref_size / 2) {
+		return -1;
+	}
+
+	/* keys are stored first, followed by the values in the same order */
+	const unsigned char *key_refs = data + offset;
+	const unsigned char *value_refs = key_refs + count * bp.ref_size;
+	uint64_t i;
+	for (i = 0; i < count && found < num_keys; i++) {
+		int idx = bplist_key_index(&bp, be_uint(key_refs + i * bp.ref_size, bp.ref_size), keys, values, num_keys);
+		if (idx == -2) {
+			return -1;
+		} else if (idx < 0) {
+			continue;
+		}
+		if (bplist_get_string(&bp, be_uint(value_refs + i * bp.ref_size, bp.ref_size), &values[idx]) < 0) {
+			return -1;
+		}
+		if (values[idx]) {
+			found++;
+		}
+	}
+	return found;
+}
+
+/* binary plists need random access, so they are read into memory, but not parsed into a tree */
+static int bplist_scan_stream(struct scan_stream *s, uint64_t size, const char *const *keys, char **values, int num_keys)
+{
+	uint64_t cap = (size > 0) ? size : sizeof(s->buf) * 4;
+	uint64_t len = 0;
+	unsigned char *data = NULL;
+	int res = -1;
+
+	if (cap > BPLIST_MAX_SIZE) {
+		return -1;
+	}
+	data = (unsigned char*)malloc(cap);
+	if (!data) {
+		return -1;
+	}
+	do {
+		size_t avail = s->len - s->pos;
+		if (len + avail > cap) {
+			if (len + avail > BPLIST_MAX_SIZE) {
+				goto leave;
+			}
+			while (len + avail > cap) {
+				cap *= 2;
+			}
+			unsigned char *newdata = (unsigned char*)realloc(data, cap);
+			if (!newdata) {
+				goto leave;
+			}
+			data = newdata;
+		}
+		memcpy(data + len, s->buf + s->pos, avail);
+		len += avail;
+		s->pos = s->len;
+	} while (stream_fill(s) == 0);
+	if (s->error) {
+		goto leave;
+	}
+
+	res = bplist_scan(data, len, keys, values, num_keys);
+
+leave:
+	free(data);
+	return res;
+}
+
+/* XML plists */
+
+struct strbuf {
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+static int strbuf_append(struct strbuf *sb, const char *data, size_t len)
+{
+	if (sb->len + len + 1 > sb->cap) {
+		size_t newcap = (sb->cap) ? sb->cap : 64;
+		while (sb->len + len + 1 > newcap) {
+			newcap *= 2;
+		}
+		char *newdata = (char*)realloc(sb->data, newcap);
+		if (!newdata) {
+			return -1;
+		}
+		sb->data = newdata;
+		sb->cap = newcap;
+	}
+	memcpy(sb->data + sb->len, data, len);
+	sb->len += len;
+	sb->data[sb->len] = '\0';
+	return 0;
+}
+
+static int strbuf_append_utf8(struct strbuf *sb, uint32_t c)
+{
+	char u[4];
+	size_t n = 0;
+	if (c < 0x80) {
+		u[n++] = (char)c;
+	} else if (c < 0x800) {
+		u[n++] = (char)(0xC0 | (c >> 6));
+		u[n++] = (char)(0x80 | (c & 0x3F));
+	} else if (c < 0x10000) {
+		u[n++] = (char)(0xE0 | (c >> 12));
+		u[n++] = (char)(0x80 | ((c >> 6) & 0x3F));
+		u[n++] = (char)(0x80 | (c & 0x3F));
+	} else if (c < 0x110000) {
+		u[n++] = (char)(0xF0 | (c >> 18));
+		u[n++] = (char)(0x80 | ((c >> 12) & 0x3F));
+		u[n++] = (char)(0x80 | ((c >> 6) & 0x3F));
+		u[n++] = (char)(0x80 | (c & 0x3F));
+	} else {
+		return -1;
+	}
+	return strbuf_append(sb, u, n);
+}
+
+enum xml_tag_type {
+	XML_TAG_OPEN,
+	XML_TAG_CLOSE,
+	XML_TAG_EMPTY,
+	XML_TAG_CDATA,
+	XML_TAG_OTHER
+};
+
+/* consumes input up to and including the given terminator (max. 3 characters) */
+static int xml_skip_until(struct scan_stream *s, const char *end)
+{
+	size_t n = strlen(end);
+	char win[4] = { 0, 0, 0, 0 };
+	int c;
+	while ((c = stream_getc(s)) >= 0) {
+		memmove(win, win + 1, 2);
+		win[2] = (char)c;
+		if (memcmp(win + 3 - n, end, n) == 0) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* consumes the content of a CDATA section, appending it to sb if given */
+static int xml_read_cdata(struct scan_stream *s, struct strbuf *sb)
+{
+	char win[3] = { 0, 0, 0 };
+	size_t n = 0;
+	int c;
+	while ((c = stream_getc(s)) >= 0) {
+		if (n == 3) {
+			if (sb && strbuf_append(sb, win, 1) < 0) {
+				return -1;
+			}
+			memmove(win, win + 1, 2);
+			n--;
+		}
+		win[n++] = (char)c;
+		if (n == 3 && memcmp(win, "]]>", 3) == 0) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* reads a tag after the opening '<', stores its (possibly truncated) name */
+static int xml_read_tag(struct scan_stream *s, char *name, size_t namesize)
+{
+	size_t n = 0;
+	int c = stream_getc(s);
+
+	name[0] = '\0';
+	if (c == '?') {
+		return (xml_skip_until(s, "?>") < 0) ? -1 : XML_TAG_OTHER;
+	}
+	if (c == '!') {
+		c = stream_getc(s);
+		if (c == '-') {
+			if (stream_getc(s) != '-') {
+				return -1;
+			}
+			return (xml_skip_until(s, "-->") < 0) ? -1 : XML_TAG_OTHER;
+		}
+		if (c == '[') {
+			const char *cdata = "CDATA[";
+			while (*cdata) {
+				if (stream_getc(s) != *cdata++) {
+					return -1;
+				}
+			}
+			return XML_TAG_CDATA;
+		}
+		/* <!DOCTYPE ...>, possibly with an internal subset in brackets */
+		int brackets = 0;
+		while (c >= 0) {
+			if (c == '[') {
+				brackets++;
+			} else if (c == ']') {
+				brackets--;
+			} else if (c == '>' && brackets <= 0) {
+				return XML_TAG_OTHER;
+			}
+			c = stream_getc(s);
+		}
+		return -1;
+	}
+
+	int type = XML_TAG_OPEN;
+	if (c == '/') {
+		type = XML_TAG_CLOSE;
+		c = stream_getc(s);
+	}
+	while (c >= 0 && c != '>' && c != '/' && c != ' ' && c != '\t' && c != '\r' && c != '\n') {
+		if (n + 1 < namesize) {
+			name[n++] = (char)c;
+		}
+		c = stream_getc(s);
+	}
+	name[n] = '\0';
+
+	/* skip attributes */
+	int quote = 0;
+	int last = 0;
+	while (c >= 0) {
+		if (quote) {
+			if (c == quote) {
+				quote = 0;
+			}
+		} else if (c == '"' || c == '\'') {
+			quote = c;
+		} else if (c == '>') {
+			if (last == '/' && type == XML_TAG_OPEN) {
+				type = XML_TAG_EMPTY;
+			}
+			return type;
+		}
+		if (c != ' ' && c != '\t' && c != '\r' && c != '\n') {
+			last = c;
+		}
+		c = stream_getc(s);
+	}
+	return -1;
+}
+
+static int xml_read_entity(struct scan_stream *s, struct strbuf *sb)
+{
+	char ent[12];
+	size_t n = 0;
+	int c;
+	while ((c = stream_getc(s)) >= 0 && c != ';' && n < sizeof(ent) - 1) {
+		ent[n++] = (char)c;
+	}
+	ent[n] = '\0';
+	if (c != ';') {
+		return -1;
+	}
+	if (strcmp(ent, "amp") == 0) {
+		return strbuf_append(sb, "&", 1);
+	} else if (strcmp(ent, "lt") == 0) {
+		return strbuf_append(sb, "<", 1);
+	} else if (strcmp(ent, "gt") == 0) {
+		return strbuf_append(sb, ">", 1);
+	} else if (strcmp(ent, "quot") == 0) {
+		return strbuf_append(sb, "\"", 1);
+	} else if (strcmp(ent, "apos") == 0) {
+		return strbuf_append(sb, "'", 1);
+	} else if (ent[0] == '#') {
+		char *endp = NULL;
+		unsigned long v = (ent[1] == 'x' || ent[1] == 'X') ? strtoul(ent + 2, &endp, 16) : strtoul(ent + 1, &endp, 10);
+		if (!endp || *endp != '\0' || v == 0) {
+			return -1;
+		}
+		return strbuf_append_utf8(sb, (uint32_t)v);
+	}
+	return -1;
+}
+
+/* reads the text content of the current element, including its closing tag */
+static char *xml_read_text(struct scan_stream *s)
+{
+	struct strbuf sb = { NULL, 0, 0 };
+	char name[16];
+	int c;
+
+	if (strbuf_append(&sb, "", 0) < 0) {
+		return NULL;
+	}
+	while ((c = stream_getc(s)) >= 0) {
+		if (c == '&') {
+			if (xml_read_entity(s, &sb) < 0) {
+				break;
+			}
+			continue;
+		}
+		if (c != '<') {
+			char ch = (char)c;
+			if (strbuf_append(&sb, &ch, 1) < 0) {
+				break;
+			}
+			continue;
+		}
+		int type = xml_read_tag(s, name, sizeof(name));
+		if (type == XML_TAG_CLOSE) {
+			return sb.data;
+		} else if (type == XML_TAG_CDATA) {
+			if (xml_read_cdata(s, &sb) < 0) {
+				break;
+			}
+		} else if (type != XML_TAG_OTHER) {
+			break;
+		}
+	}
+	free(sb.data);
+	return NULL;
+}
+
+/* skips the remainder of an element whose opening tag was just read */
+static int xml_skip_element(struct scan_stream *s)
+{
+	char name[16];
+	int level = 1;
+	int c;
+	while (level > 0 && (c = stream_getc(s)) >= 0) {
+		if (c != '<') {
+			continue;
+		}
+		int type = xml_read_tag(s, name, sizeof(name));
+		if (type == XML_TAG_OPEN) {
+			level++;
+		} else if (type == XML_TAG_CLOSE) {
+			level--;
+		} else if (type == XML_TAG_CDATA) {
+			if (xml_read_cdata(s, NULL) < 0) {
+				return -1;
+			}
+		} else if (type < 0) {
+			return -1;
+		}
+	}
+	return (level == 0) ? 0 : -1;
+}
+
+static int xml_scan_stream(struct scan_stream *s, const char *const *keys, char **values, int num_keys)
+{
+	char name[16];
+	char *key = NULL;
+	int in_plist = 0;
+	int in_dict = 0;
+	int seen_dict = 0;
+	int found = 0;
+	int c;
+
+	/* skip UTF-8 byte order mark */
+	if (stream_peek(s) == 0xEF) {
+		if (stream_getc(s) != 0xEF || stream_getc(s) != 0xBB || stream_getc(s) != 0xBF) {
+			return -1;
+		}
+	}
+
+	while (found < num_keys && (c = stream_getc(s)) >= 0) {
+		if (c != '<') {
+			if (c != ' ' && c != '\t' && c != '\r' && c != '\n' && !in_dict) {
+				/* not an XML document */
+				found = -1;
+				break;
+			}
+			continue;
+		}
+		int type = xml_read_tag(s, name, sizeof(name));
+		if (type < 0) {
+			found = -1;
+			break;
+		}
+		if (type == XML_TAG_OTHER) {
+			continue;
+		}
+		if (!in_dict) {
+			if (type == XML_TAG_OPEN && !in_plist && strcmp(name, "plist") == 0) {
+				in_plist = 1;
+			} else if (type == XML_TAG_OPEN && strcmp(name, "dict") == 0) {
+				in_dict = 1;
+				seen_dict = 1;
+			} else if (type == XML_TAG_EMPTY && strcmp(name, "dict") == 0) {
+				seen_dict = 1;
+				break;
+			} else {
+				/* not a plist with a dictionary at the top */
+				found = -1;
+				break;
+			}
+			continue;
+		}
+
+		if (type == XML_TAG_CLOSE) {
+			/* end of the top-level dictionary */
+			break;
+		}
+		if (type == XML_TAG_CDATA) {
+			if (xml_read_cdata(s, NULL) < 0) {
+				found = -1;
+				break;
+			}
+			continue;
+		}
+		if (strcmp(name, "key") == 0) {
+			free(key);
+			key = (type == XML_TAG_EMPTY) ? strdup("") : xml_read_text(s);
+			if (!key) {
+				found = -1;
+				break;
+			}
+			continue;
+		}
+
+		/* a value, only strings of requested keys are extracted */
+		int idx = (key) ? find_key(keys, values, num_keys, key, strlen(key)) : -1;
+		free(key);
+		key = NULL;
+		if (idx >= 0 && strcmp(name, "string") == 0) {
+			values[idx] = (type == XML_TAG_EMPTY) ? strdup("") : xml_read_text(s);
+			if (!values[idx]) {
+				found = -1;
+				break;
+			}
+			found++;
+		} else if (type == XML_TAG_OPEN && xml_skip_element(s) < 0) {
+			found = -1;
+			break;
+		}
+	}
+	free(key);
+	if (s->error || !seen_dict) {
+		/* read error, or no dictionary before the end of the input */
+		found = -1;
+	}
+	return found;
+}
+
+int plistscan_get_strings(plistscan_read_func read_func, void *userdata, uint64_t size, const char *const *keys, char **values, int num_keys)
+{
+	struct scan_stream *s = NULL;
+	int res = -1;
+	int i;
+
+	for (i = 0; i < num_keys; i++) {
+		values[i] = NULL;
+	}
+
+	s = (struct scan_stream*)malloc(sizeof(struct scan_stream));
+	if (!s) {
+		return -1;
+	}
+	s->read_func = read_func;
+	s->userdata = userdata;
+	s->pos = 0;
+	s->len = 0;
+	s->eof = 0;
+	s->error = 0;
+
+	/* make sure the first chunk holds enough data to tell the format */
+	while (s->len < BPLIST_MAGIC_LEN && !s->eof) {
+		int64_t r = read_func(userdata, s->buf + s->len, sizeof(s->buf) - s->len);
+		if (r <= 0) {
+			s->eof = 1;
+			if (r < 0) {
+				s->error = 1;
+			}
+			break;
+		}
+		s->len += (size_t)r;
+	}
+	if (s->error) {
+		goto leave;
+	}
+
+	if (s->len >= BPLIST_MAGIC_LEN && memcmp(s->buf, BPLIST_MAGIC, BPLIST_MAGIC_LEN) == 0) {
+		res = bplist_scan_stream(s, size, keys, values, num_keys);
+	} else {
+		res = xml_scan_stream(s, keys, values, num_keys);
+	}
+	if (res < 0) {
+		for (i = 0; i < num_keys; i++) {
+			free(values[i]);
+			values[i] = NULL;
+		}
+	}
+
+leave:
+	free(s);
+	return res;
+}
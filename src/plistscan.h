@@ -0,0 +1,42 @@
+/*
+ * plistscan.h
+ * Extraction of top-level string values from property lists without
+ * building the plist tree
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more profile.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifndef __PLISTSCAN_H
+#define __PLISTSCAN_H
+
+#include <stdint.h>
+
+/* reads up to len bytes into buf, returns the number of bytes read, 0 at the end or -1 on error */
+typedef int64_t (*plistscan_read_func)(void *userdata, char *buf, uint64_t len);
+
+/*
+ * Looks up the string values of the given keys in the top-level dictionary
+ * of a binary or XML property list of size bytes, provided by read_func.
+ * XML plists are processed as a stream; binary plists are read into memory
+ * once and accessed through their offset table. values[i] receives a newly
+ * allocated copy of the value of keys[i], or NULL if the key does not exist
+ * or is not a string. Returns the number of values found, or -1 if the data
+ * is not a (supported) property list or is malformed.
+ */
+int plistscan_get_strings(plistscan_read_func read_func, void *userdata, uint64_t size, const char *const *keys, char **values, int num_keys);
+
+#endif
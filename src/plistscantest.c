@@ -0,0 +1,452 @@
+/*
+ * plistscantest.c
+ * Checks for the streaming Info.plist string scanner
+ *
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more profile.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "plistscan.h"
+
+#define NUM_KEYS 4
+
+static const char *const keys[NUM_KEYS] = {
+	"CFBundleIdentifier",
+	"CFBundleExecutable",
+	"CFBundleVersion",
+	"CFBundleShortVersionString"
+};
+
+/* input is handed out in small pieces to cross the scanner's buffer refills */
+struct mem_reader {
+	const unsigned char *data;
+	size_t len;
+	size_t pos;
+	size_t chunk;
+};
+
+static int64_t mem_read(void *userdata, char *buf, uint64_t len)
+{
+	struct mem_reader *r = (struct mem_reader*)userdata;
+	size_t n = r->len - r->pos;
+	if (n > len) {
+		n = (size_t)len;
+	}
+	if (r->chunk && n > r->chunk) {
+		n = r->chunk;
+	}
+	memcpy(buf, r->data + r->pos, n);
+	r->pos += n;
+	return (int64_t)n;
+}
+
+/* minimal binary plist writer: 2 byte offsets, 1 byte object references */
+struct bplist_builder {
+	unsigned char data[4096];
+	size_t len;
+	size_t offsets[64];
+	int num_objects;
+};
+
+static void bp_init(struct bplist_builder *b)
+{
+	memcpy(b->data, "bplist00", 8);
+	b->len = 8;
+	b->num_objects = 0;
+}
+
+static void bp_put(struct bplist_builder *b, const void *data, size_t len)
+{
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void bp_marker(struct bplist_builder *b, uint8_t type, size_t length)
+{
+	unsigned char m[4];
+	if (length < 15) {
+		m[0] = type | (uint8_t)length;
+		bp_put(b, m, 1);
+	} else {
+		m[0] = type | 0x0F;
+		m[1] = 0x11;
+		m[2] = (unsigned char)(length >> 8);
+		m[3] = (unsigned char)length;
+		bp_put(b, m, 4);
+	}
+}
+
+static int bp_begin(struct bplist_builder *b)
+{
+	b->offsets[b->num_objects] = b->len;
+	return b->num_objects++;
+}
+
+static int bp_ascii(struct bplist_builder *b, const char *str)
+{
+	int ref = bp_begin(b);
+	bp_marker(b, 0x50, strlen(str));
+	bp_put(b, str, strlen(str));
+	return ref;
+}
+
+static int bp_utf16(struct bplist_builder *b, const uint16_t *units, size_t count)
+{
+	int ref = bp_begin(b);
+	size_t i;
+	bp_marker(b, 0x60, count);
+	for (i = 0; i < count; i++) {
+		unsigned char u[2] = { (unsigned char)(units[i] >> 8), (unsigned char)units[i] };
+		bp_put(b, u, 2);
+	}
+	return ref;
+}
+
+static int bp_int(struct bplist_builder *b, uint8_t value)
+{
+	int ref = bp_begin(b);
+	unsigned char v[2] = { 0x10, value };
+	bp_put(b, v, 2);
+	return ref;
+}
+
+static int bp_container(struct bplist_builder *b, uint8_t type, const int *refs, size_t count)
+{
+	int ref = bp_begin(b);
+	size_t num_refs = (type == 0xD0) ? count * 2 : count;
+	size_t i;
+	bp_marker(b, type, count);
+	for (i = 0; i < num_refs; i++) {
+		unsigned char r = (unsigned char)refs[i];
+		bp_put(b, &r, 1);
+	}
+	return ref;
+}
+
+/* dict entries are given as key, value pairs */
+static int bp_dict(struct bplist_builder *b, const int *pairs, size_t count)
+{
+	int refs[32];
+	size_t i;
+	for (i = 0; i < count; i++) {
+		refs[i] = pairs[i*2];
+		refs[count + i] = pairs[i*2+1];
+	}
+	return bp_container(b, 0xD0, refs, count);
+}
+
+static void bp_be(unsigned char *p, uint64_t v, int n)
+{
+	while (n-- > 0) {
+		p[n] = (unsigned char)v;
+		v >>= 8;
+	}
+}
+
+static void bp_finish(struct bplist_builder *b, int top)
+{
+	unsigned char trailer[32];
+	size_t table = b->len;
+	int i;
+	for (i = 0; i < b->num_objects; i++) {
+		unsigned char o[2];
+		bp_be(o, b->offsets[i], 2);
+		bp_put(b, o, 2);
+	}
+	memset(trailer, 0, sizeof(trailer));
+	trailer[6] = 2;
+	trailer[7] = 1;
+	bp_be(trailer + 8, b->num_objects, 8);
+	bp_be(trailer + 16, top, 8);
+	bp_be(trailer + 24, table, 8);
+	bp_put(b, trailer, sizeof(trailer));
+}
+
+static int failed = 0;
+
+/* expected values are NULL where no string must be found, res is the expected return value */
+static void check(const char *name, const void *data, size_t len, int res, const char *const *expected)
+{
+	static const size_t chunks[] = { 0, 1, 7 };
+	size_t c;
+	int i;
+
+	for (c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+		struct mem_reader r = { (const unsigned char*)data, len, 0, chunks[c] };
+		char *values[NUM_KEYS];
+		int ok = 1;
+		/* the size is only a hint, also pass none */
+		int got = plistscan_get_strings(mem_read, &r, (c == 1) ? 0 : len, keys, values, NUM_KEYS);
+		if (got != res) {
+			ok = 0;
+		}
+		for (i = 0; i < NUM_KEYS; i++) {
+			const char *want = (expected) ? expected[i] : NULL;
+			if ((want == NULL) != (values[i] == NULL) || (want && strcmp(want, values[i]) != 0)) {
+				ok = 0;
+			}
+		}
+		if (!ok) {
+			printf("%-44s chunk %-2u FAILED: returned %d, expected %d\n", name, (unsigned)chunks[c], got, res);
+			for (i = 0; i < NUM_KEYS; i++) {
+				printf("    %-28s %s\n", keys[i], (values[i]) ? values[i] : "(null)");
+			}
+			failed++;
+		}
+		for (i = 0; i < NUM_KEYS; i++) {
+			free(values[i]);
+		}
+		if (!ok) {
+			return;
+		}
+	}
+	printf("%-44s OK\n", name);
+}
+
+static const char *const info_values[NUM_KEYS] = {
+	"com.example.Demo",
+	"Demo",
+	"2024.11.28.1734",
+	"1.2.3"
+};
+
+static void build_info(struct bplist_builder *b)
+{
+	int pairs[12];
+	int unrelated[2];
+	int i;
+
+	bp_init(b);
+	unrelated[0] = bp_int(b, 1);
+	unrelated[1] = bp_int(b, 2);
+	pairs[0] = bp_ascii(b, "UIDeviceFamily");
+	pairs[1] = bp_container(b, 0xA0, unrelated, 2);
+	for (i = 0; i < NUM_KEYS; i++) {
+		pairs[2 + i*2] = bp_ascii(b, keys[i]);
+		pairs[3 + i*2] = bp_ascii(b, info_values[i]);
+	}
+	pairs[10] = bp_ascii(b, "CFBundleName");
+	pairs[11] = bp_ascii(b, "Demo");
+	bp_finish(b, bp_dict(b, pairs, 6));
+}
+
+static void test_binary(void)
+{
+	struct bplist_builder b;
+	build_info(&b);
+	check("binary Info.plist", b.data, b.len, NUM_KEYS, info_values);
+}
+
+static void test_binary_utf16(void)
+{
+	/* "CFBundleIdentifier" as a UTF-16 key, an executable name with U+00E9 and U+1F600 */
+	static const uint16_t key[] = { 'C','F','B','u','n','d','l','e','I','d','e','n','t','i','f','i','e','r' };
+	static const uint16_t id[] = { 'c','o','m','.','e','x','.','c','a','f',0x00E9 };
+	static const uint16_t exe[] = { 'S','m','i','l','e',0xD83D,0xDE00 };
+	static const uint16_t version[] = { '1',0x2024,'0' };
+	static const char *const expected[NUM_KEYS] = {
+		"com.ex.caf\xC3\xA9",
+		"Smile\xF0\x9F\x98\x80",
+		"1\xE2\x80\xA4" "0",
+		NULL
+	};
+	struct bplist_builder b;
+	int pairs[6];
+
+	bp_init(&b);
+	pairs[0] = bp_utf16(&b, key, sizeof(key) / sizeof(key[0]));
+	pairs[1] = bp_utf16(&b, id, sizeof(id) / sizeof(id[0]));
+	pairs[2] = bp_ascii(&b, "CFBundleExecutable");
+	pairs[3] = bp_utf16(&b, exe, sizeof(exe) / sizeof(exe[0]));
+	pairs[4] = bp_ascii(&b, "CFBundleVersion");
+	pairs[5] = bp_utf16(&b, version, sizeof(version) / sizeof(version[0]));
+	bp_finish(&b, bp_dict(&b, pairs, 3));
+	check("binary UTF-16 keys and values", b.data, b.len, 3, expected);
+}
+
+static void test_binary_non_string(void)
+{
+	static const char *const expected[NUM_KEYS] = { "com.example.Demo", NULL, NULL, "1.0" };
+	struct bplist_builder b;
+	int pairs[10];
+	int empty;
+
+	bp_init(&b);
+	empty = bp_dict(&b, NULL, 0);
+	pairs[0] = bp_ascii(&b, "CFBundleIdentifier");
+	pairs[1] = bp_ascii(&b, "com.example.Demo");
+	pairs[2] = bp_ascii(&b, "CFBundleVersion");
+	pairs[3] = bp_int(&b, 42);
+	pairs[4] = bp_ascii(&b, "CFBundleExecutable");
+	pairs[5] = empty;
+	pairs[6] = bp_ascii(&b, "CFBundleShortVersionString");
+	pairs[7] = bp_ascii(&b, "1.0");
+	bp_finish(&b, bp_dict(&b, pairs, 4));
+	check("binary non-string values", b.data, b.len, 2, expected);
+}
+
+static void test_binary_top_level(void)
+{
+	struct bplist_builder b;
+	int refs[2];
+
+	bp_init(&b);
+	refs[0] = bp_ascii(&b, "CFBundleIdentifier");
+	refs[1] = bp_ascii(&b, "com.example.Demo");
+	bp_finish(&b, bp_container(&b, 0xA0, refs, 2));
+	check("binary array at the top", b.data, b.len, -1, NULL);
+
+	bp_init(&b);
+	bp_finish(&b, bp_ascii(&b, "CFBundleIdentifier"));
+	check("binary string at the top", b.data, b.len, -1, NULL);
+}
+
+/* broken copies of the Info.plist, trailer fields are patched relative to its start */
+static void test_binary_broken(void)
+{
+	struct bplist_builder b;
+	unsigned char data[4096];
+	unsigned char *trailer;
+	size_t len, table;
+
+	build_info(&b);
+	len = b.len;
+	table = len - 32 - b.num_objects * 2;
+
+#define BROKEN(name, patch) do { \
+		memcpy(data, b.data, len); \
+		trailer = data + len - 32; \
+		(void)trailer; \
+		patch; \
+		check(name, data, len, -1, NULL); \
+	} while (0)
+
+	BROKEN("truncated trailer", len -= 1; trailer = NULL);
+	len = b.len;
+	BROKEN("magic only", len = 8);
+	len = b.len;
+	BROKEN("offset size 0", trailer[6] = 0);
+	BROKEN("offset size 9", trailer[6] = 9);
+	BROKEN("reference size 0", trailer[7] = 0);
+	BROKEN("no objects", bp_be(trailer + 8, 0, 8));
+	BROKEN("too many objects", bp_be(trailer + 8, b.num_objects + 1, 8));
+	BROKEN("huge object count", bp_be(trailer + 8, UINT64_MAX, 8));
+	BROKEN("top object out of range", bp_be(trailer + 16, b.num_objects, 8));
+	BROKEN("offset table in the trailer", bp_be(trailer + 24, len - 16, 8));
+	BROKEN("offset table past the end", bp_be(trailer + 24, UINT64_MAX - 8, 8));
+	BROKEN("offset table in the header", bp_be(trailer + 24, 4, 8));
+	BROKEN("top offset in the header", bp_be(data + table + (b.num_objects - 1) * 2, 3, 2));
+	BROKEN("top offset past the table", bp_be(data + table + (b.num_objects - 1) * 2, table + 1, 2));
+	BROKEN("dict count past the table", data[b.offsets[b.num_objects - 1]] = 0xDF; data[b.offsets[b.num_objects - 1] + 1] = 0x11);
+	/* object 5 is the CFBundleIdentifier value, the dict holds 6 key and 6 value references */
+	BROKEN("value length past the table", data[b.offsets[5] + 2] = 0xFF);
+	BROKEN("value length with a bad integer", data[b.offsets[5] + 1] = 0x14);
+	BROKEN("key reference out of range", data[b.offsets[b.num_objects - 1] + 1 + 1] = 0xFF);
+	BROKEN("value reference out of range", data[b.offsets[b.num_objects - 1] + 1 + 6 + 1] = 0xFF);
+	BROKEN("value offset in the trailer", bp_be(data + table + 5 * 2, len - 32, 2));
+
+#undef BROKEN
+}
+
+static const char xml_info[] =
+	"\xEF\xBB\xBF<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	"<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" \"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n"
+	"<plist version=\"1.0\">\n"
+	"<!-- <key>CFBundleIdentifier</key><string>com.example.Comment</string> -->\n"
+	"<dict>\n"
+	"\t<key>UIDeviceFamily</key>\n"
+	"\t<array><integer>1</integer><integer>2</integer></array>\n"
+	"\t<key>Nested</key>\n"
+	"\t<dict><key>CFBundleIdentifier</key><string>com.example.Nested</string><key>Deeper</key><dict/></dict>\n"
+	"\t<key>CFBundleIdentifier</key>\n"
+	"\t<string>com.example.Demo</string>\n"
+	"\t<key>CFBundleExecutable</key>\n"
+	"\t<string>Q&amp;A &lt;&#x1F600;&gt; &#233;</string>\n"
+	"\t<key>CFBundleVersion</key>\n"
+	"\t<string><![CDATA[2024.11 <beta> ]]]]><![CDATA[>]]></string>\n"
+	"\t<key>CFBundleShortVersionString</key>\n"
+	"\t<string/>\n"
+	"</dict>\n"
+	"</plist>\n";
+
+static void test_xml(void)
+{
+	static const char *const expected[NUM_KEYS] = {
+		"com.example.Demo",
+		"Q&A <\xF0\x9F\x98\x80> \xC3\xA9",
+		"2024.11 <beta> ]]>",
+		""
+	};
+	check("XML Info.plist", xml_info, sizeof(xml_info) - 1, NUM_KEYS, expected);
+}
+
+static void test_xml_non_string(void)
+{
+	static const char xml[] =
+		"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<plist version=\"1.0\"><dict>"
+		"<key>CFBundleIdentifier</key><string>com.example.Demo</string>"
+		"<key>CFBundleVersion</key><integer>42</integer>"
+		"<key>CFBundleExecutable</key><dict><key>CFBundleExecutable</key><string>Inner</string></dict>"
+		"<key>CFBundleShortVersionString</key><true/>"
+		"</dict></plist>";
+	static const char *const expected[NUM_KEYS] = { "com.example.Demo", NULL, NULL, NULL };
+	check("XML non-string values", xml, sizeof(xml) - 1, 1, expected);
+}
+
+static void test_xml_broken(void)
+{
+	static const struct {
+		const char *name;
+		const char *xml;
+	} cases[] = {
+		{ "XML array at the top", "<?xml version=\"1.0\"?><plist><array><string>x</string></array></plist>" },
+		{ "XML string at the top", "<plist version=\"1.0\"><string>CFBundleIdentifier</string></plist>" },
+		{ "XML truncated value", "<plist><dict><key>CFBundleIdentifier</key><string>com.exa" },
+		{ "XML unknown entity", "<plist><dict><key>CFBundleIdentifier</key><string>&nbsp;</string></dict></plist>" },
+		{ "XML unterminated comment", "<plist><!-- <dict>" },
+		{ "not a plist", "CFBundleIdentifier = com.example.Demo" },
+		{ "empty input", "" },
+		{ NULL, NULL }
+	};
+	int i;
+	for (i = 0; cases[i].name; i++) {
+		check(cases[i].name, cases[i].xml, strlen(cases[i].xml), -1, NULL);
+	}
+	check("XML empty dict", "<plist><dict/></plist>", 22, 0, NULL);
+}
+
+int main(int argc, char **argv)
+{
+	test_binary();
+	test_binary_utf16();
+	test_binary_non_string();
+	test_binary_top_level();
+	test_binary_broken();
+	test_xml();
+	test_xml_non_string();
+	test_xml_broken();
+	return (failed > 0) ? 1 : 0;
+}
@@ -0,0 +1,154 @@
+/*
+ * sha256.c
+ * SHA-256 message digest (FIPS 180-4)
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more profile.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <string.h>
+
+#include "sha256.h"
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z) (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define S0(x) (ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define S1(x) (ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define G0(x) (ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))
+#define G1(x) (ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+
+static void sha256_transform(uint32_t state[8], const uint8_t *block)
+{
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = ((uint32_t)block[i*4] << 24) | ((uint32_t)block[i*4+1] << 16) | ((uint32_t)block[i*4+2] << 8) | block[i*4+3];
+	}
+	for (i = 16; i < 64; i++) {
+		w[i] = G1(w[i-2]) + w[i-7] + G0(w[i-15]) + w[i-16];
+	}
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+	for (i = 0; i < 64; i++) {
+		uint32_t t1 = h + S1(e) + CH(e, f, g) + K[i] + w[i];
+		uint32_t t2 = S0(a) + MAJ(a, b, c);
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void sha256_init(sha256_ctx *ctx)
+{
+	ctx->state[0] = 0x6a09e667;
+	ctx->state[1] = 0xbb67ae85;
+	ctx->state[2] = 0x3c6ef372;
+	ctx->state[3] = 0xa54ff53a;
+	ctx->state[4] = 0x510e527f;
+	ctx->state[5] = 0x9b05688c;
+	ctx->state[6] = 0x1f83d9ab;
+	ctx->state[7] = 0x5be0cd19;
+	ctx->length = 0;
+	ctx->buflen = 0;
+}
+
+void sha256_update(sha256_ctx *ctx, const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t*)data;
+
+	ctx->length += len;
+	if (ctx->buflen > 0) {
+		size_t n = 64 - ctx->buflen;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(ctx->buf + ctx->buflen, p, n);
+		ctx->buflen += n;
+		p += n;
+		len -= n;
+		if (ctx->buflen < 64) {
+			return;
+		}
+		sha256_transform(ctx->state, ctx->buf);
+		ctx->buflen = 0;
+	}
+	while (len >= 64) {
+		sha256_transform(ctx->state, p);
+		p += 64;
+		len -= 64;
+	}
+	if (len > 0) {
+		memcpy(ctx->buf, p, len);
+		ctx->buflen = len;
+	}
+}
+
+void sha256_final(sha256_ctx *ctx, unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+	uint64_t bits = ctx->length * 8;
+	int i;
+
+	ctx->buf[ctx->buflen++] = 0x80;
+	if (ctx->buflen > 56) {
+		memset(ctx->buf + ctx->buflen, 0, 64 - ctx->buflen);
+		sha256_transform(ctx->state, ctx->buf);
+		ctx->buflen = 0;
+	}
+	memset(ctx->buf + ctx->buflen, 0, 56 - ctx->buflen);
+	for (i = 0; i < 8; i++) {
+		ctx->buf[56 + i] = (uint8_t)(bits >> (56 - i*8));
+	}
+	sha256_transform(ctx->state, ctx->buf);
+
+	for (i = 0; i < 8; i++) {
+		digest[i*4] = (unsigned char)(ctx->state[i] >> 24);
+		digest[i*4+1] = (unsigned char)(ctx->state[i] >> 16);
+		digest[i*4+2] = (unsigned char)(ctx->state[i] >> 8);
+		digest[i*4+3] = (unsigned char)ctx->state[i];
+	}
+}
+
+void sha256_to_hex(const unsigned char digest[SHA256_DIGEST_LENGTH], char *hex)
+{
+	static const char hexchars[] = "0123456789abcdef";
+	int i;
+	for (i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+		hex[i*2] = hexchars[digest[i] >> 4];
+		hex[i*2+1] = hexchars[digest[i] & 0xf];
+	}
+	hex[SHA256_DIGEST_LENGTH*2] = '\0';
+}
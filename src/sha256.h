@@ -0,0 +1,44 @@
+/*
+ * sha256.h
+ * SHA-256 message digest
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more profile.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifndef __SHA256_H
+#define __SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_LENGTH 32
+
+typedef struct {
+	uint32_t state[8];
+	uint64_t length;
+	uint8_t buf[64];
+	size_t buflen;
+} sha256_ctx;
+
+void sha256_init(sha256_ctx *ctx);
+void sha256_update(sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final(sha256_ctx *ctx, unsigned char digest[SHA256_DIGEST_LENGTH]);
+
+/* writes the lowercase hex representation of digest to hex (65 bytes) */
+void sha256_to_hex(const unsigned char digest[SHA256_DIGEST_LENGTH], char *hex);
+
+#endif
@@ -0,0 +1,309 @@
+/*
+ * trace.c
+ * Chrome trace event output for --trace
+ *
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more profile.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/time.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <fcntl.h>
+#ifdef WIN32
+#include <io.h>
+#endif
+
+#include <libimobiledevice-glue/thread.h>
+
+#include "trace.h"
+
+#define TRACE_BUFFER_SIZE 65536
+#define TRACE_MAX_DEPTH 16
+#define TRACE_COUNTER_INTERVAL_US 20000
+
+struct trace_event {
+	char data[2048];
+	size_t len;
+};
+
+struct trace_state {
+	int pid;
+	char *buf;
+	size_t len;
+	int depth;
+	const char *spans[TRACE_MAX_DEPTH];
+	uint64_t bytes_uploaded;
+	uint64_t bytes_downloaded;
+	uint64_t last_counter;
+};
+
+static int trace_fd = -1;
+static struct trace_state trace;
+static mutex_t trace_mutex;
+
+static uint64_t get_timestamp_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return ((uint64_t)tv.tv_sec * 1000000) + tv.tv_usec;
+}
+
+static void trace_event_append(struct trace_event *ev, const char *fmt, ...)
+{
+	va_list ap;
+	size_t avail = sizeof(ev->data) - ev->len;
+	va_start(ap, fmt);
+	int res = vsnprintf(ev->data + ev->len, avail, fmt, ap);
+	va_end(ap);
+	if (res < 0) {
+		return;
+	}
+	ev->len += ((size_t)res < avail) ? (size_t)res : avail - 1;
+}
+
+static void trace_event_append_string(struct trace_event *ev, const char *key, const char *value)
+{
+	/* no separator needed as the first member of an object */
+	trace_event_append(ev, (ev->len > 0 && ev->data[ev->len-1] == '{') ? "\"%s\":\"" : ",\"%s\":\"", key);
+	/* reserve room for the closing quote and the trailing "},\n" */
+	size_t max = sizeof(ev->data) - 5;
+	const unsigned char *p = (const unsigned char*)value;
+	while (p && *p && ev->len < max - 6) {
+		switch (*p) {
+		case '"':
+		case '\\':
+			ev->data[ev->len++] = '\\';
+			ev->data[ev->len++] = *p;
+			break;
+		case '\n':
+			ev->data[ev->len++] = '\\';
+			ev->data[ev->len++] = 'n';
+			break;
+		case '\r':
+			ev->data[ev->len++] = '\\';
+			ev->data[ev->len++] = 'r';
+			break;
+		case '\t':
+			ev->data[ev->len++] = '\\';
+			ev->data[ev->len++] = 't';
+			break;
+		default:
+			if (*p < 0x20) {
+				ev->len += snprintf(ev->data + ev->len, 7, "\\u%04x", *p);
+			} else {
+				ev->data[ev->len++] = *p;
+			}
+			break;
+		}
+		p++;
+	}
+	ev->data[ev->len++] = '"';
+	ev->data[ev->len] = '\0';
+}
+
+static void trace_flush_locked(void)
+{
+	const char *p = trace.buf;
+	size_t left = trace.len;
+	while (left > 0 && trace_fd >= 0) {
+		ssize_t n = write(trace_fd, p, left);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "WARNING: Could not write to trace file: %s. Tracing disabled.\n", strerror(errno));
+			close(trace_fd);
+			trace_fd = -1;
+			break;
+		}
+		p += n;
+		left -= n;
+	}
+	trace.len = 0;
+}
+
+static void trace_event_begin(struct trace_event *ev, char ph, const char *name)
+{
+	ev->len = 0;
+	trace_event_append(ev, "{\"ph\":\"%c\",\"ts\":%" PRIu64 ",\"pid\":%d,\"tid\":1", ph, get_timestamp_us(), trace.pid);
+	if (name) {
+		trace_event_append_string(ev, "name", name);
+	}
+}
+
+static void trace_event_send(struct trace_event *ev)
+{
+	trace_event_append(ev, "},\n");
+	mutex_lock(&trace_mutex);
+	if (trace_fd >= 0 && trace.len + ev->len > TRACE_BUFFER_SIZE) {
+		trace_flush_locked();
+	}
+	if (trace_fd >= 0) {
+		memcpy(trace.buf + trace.len, ev->data, ev->len);
+		trace.len += ev->len;
+	}
+	mutex_unlock(&trace_mutex);
+}
+
+int trace_open(const char *path)
+{
+	/* the first process to create the file starts the JSON array */
+	int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+	if (fd >= 0) {
+		if (write(fd, "[\n", 2) != 2) {
+			close(fd);
+			fd = -1;
+		}
+	} else if (errno == EEXIST) {
+		fd = open(path, O_WRONLY | O_APPEND);
+	}
+	if (fd < 0) {
+		fprintf(stderr, "ERROR: Could not open trace file %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	memset(&trace, 0, sizeof(trace));
+	trace.buf = (char*)malloc(TRACE_BUFFER_SIZE);
+	if (!trace.buf) {
+		fprintf(stderr, "ERROR: Out of memory!?\n");
+		close(fd);
+		return -1;
+	}
+	trace.pid = (int)getpid();
+	mutex_init(&trace_mutex);
+	trace_fd = fd;
+	return 0;
+}
+
+int trace_enabled(void)
+{
+	return (trace_fd >= 0);
+}
+
+void trace_process_name(const char *device_udid)
+{
+	struct trace_event ev;
+	char name[128];
+	if (trace_fd < 0) {
+		return;
+	}
+	snprintf(name, sizeof(name), "ideviceinstaller %s", (device_udid) ? device_udid : "");
+	trace_event_begin(&ev, 'M', "process_name");
+	trace_event_append(&ev, ",\"args\":{");
+	trace_event_append_string(&ev, "name", name);
+	trace_event_append(&ev, "}");
+	trace_event_send(&ev);
+}
+
+int trace_begin(const char *name, const char *detail)
+{
+	struct trace_event ev;
+	if (trace_fd < 0) {
+		return 0;
+	}
+	trace_event_begin(&ev, 'B', name);
+	if (detail) {
+		trace_event_append(&ev, ",\"args\":{");
+		trace_event_append_string(&ev, "detail", detail);
+		trace_event_append(&ev, "}");
+	}
+	trace_event_send(&ev);
+	if (trace.depth < TRACE_MAX_DEPTH) {
+		trace.spans[trace.depth] = name;
+	}
+	return trace.depth++;
+}
+
+void trace_end(int depth)
+{
+	struct trace_event ev;
+	if (trace_fd < 0) {
+		return;
+	}
+	while (trace.depth > depth) {
+		trace.depth--;
+		trace_event_begin(&ev, 'E', (trace.depth < TRACE_MAX_DEPTH) ? trace.spans[trace.depth] : NULL);
+		trace_event_send(&ev);
+	}
+}
+
+void trace_instant(const char *name, const char *command_name, const char *detail, int percent)
+{
+	struct trace_event ev;
+	if (trace_fd < 0) {
+		return;
+	}
+	trace_event_begin(&ev, 'i', name);
+	trace_event_append(&ev, ",\"s\":\"p\",\"args\":{");
+	if (percent >= 0) {
+		trace_event_append(&ev, "\"percent\":%d", percent);
+	}
+	trace_event_append_string(&ev, "command", command_name);
+	if (detail) {
+		trace_event_append_string(&ev, "detail", detail);
+	}
+	trace_event_append(&ev, "}");
+	trace_event_send(&ev);
+}
+
+/* the totals are not locked, callers serialize the calls (transfer_mutex in the tool) */
+void trace_transfer_counter(const char *phase, uint64_t amount, int force)
+{
+	struct trace_event ev;
+	if (trace_fd < 0) {
+		return;
+	}
+	int upload = (strcmp(phase, "upload") == 0);
+	uint64_t *total = (upload) ? &trace.bytes_uploaded : &trace.bytes_downloaded;
+	*total += amount;
+	uint64_t now = get_timestamp_us();
+	if (!force && now - trace.last_counter < TRACE_COUNTER_INTERVAL_US) {
+		return;
+	}
+	trace.last_counter = now;
+	trace_event_begin(&ev, 'C', (upload) ? "bytes_uploaded" : "bytes_downloaded");
+	trace_event_append(&ev, ",\"args\":{\"bytes\":%" PRIu64 "}", *total);
+	trace_event_send(&ev);
+}
+
+void trace_close(void)
+{
+	if (trace_fd < 0) {
+		return;
+	}
+	trace_end(0);
+	mutex_lock(&trace_mutex);
+	trace_flush_locked();
+	if (trace_fd >= 0) {
+		close(trace_fd);
+		trace_fd = -1;
+	}
+	mutex_unlock(&trace_mutex);
+	mutex_destroy(&trace_mutex);
+	free(trace.buf);
+	trace.buf = NULL;
+}
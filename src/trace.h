@@ -0,0 +1,57 @@
+/*
+ * trace.h
+ * Chrome trace event output for --trace
+ *
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more profile.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Chrome trace event output (JSON array format). Events are buffered and
+ * appended to the file in large writes, so several processes, e.g. one per
+ * device, can share one trace file. The closing bracket is optional in this
+ * format and never written for that reason.
+ * Spans are only recorded on the main thread. All functions do nothing
+ * unless trace_open() succeeded.
+ */
+int trace_open(const char *path);
+int trace_enabled(void);
+
+/* names the track of this process in the trace viewer */
+void trace_process_name(const char *device_udid);
+
+/* starts a span, returns the depth to pass to trace_end() */
+int trace_begin(const char *name, const char *detail);
+
+/* ends all spans started since trace_begin() returned depth */
+void trace_end(int depth);
+
+void trace_instant(const char *name, const char *command_name, const char *detail, int percent);
+
+/* counter tracks of the bytes uploaded or downloaded depending on phase */
+void trace_transfer_counter(const char *phase, uint64_t amount, int force);
+
+/* ends all open spans, flushes and closes the file */
+void trace_close(void);
+
+#endif
@@ -0,0 +1,171 @@
+/*
+ * usbtopology.c
+ * USB topology of a device from sysfs
+ *
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more profile.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <libgen.h>
+#include <dirent.h>
+
+#include "usbtopology.h"
+
+static char *path_join(const char *dir, const char *name)
+{
+	size_t len = strlen(dir) + strlen(name) + 2;
+	char *path = (char*)malloc(len);
+	if (path) {
+		snprintf(path, len, "%s/%s", dir, name);
+	}
+	return path;
+}
+
+static char *read_sysfs_string(const char *dir, const char *name)
+{
+	char buf[256];
+	char *res = NULL;
+	char *path = path_join(dir, name);
+	if (!path) {
+		return NULL;
+	}
+	FILE *f = fopen(path, "r");
+	free(path);
+	if (!f) {
+		return NULL;
+	}
+	if (fgets(buf, sizeof(buf), f)) {
+		buf[strcspn(buf, "\r\n")] = '\0';
+		res = strdup(buf);
+	}
+	fclose(f);
+	return res;
+}
+
+/* the USB serial number is the UDID, but without dashes */
+static int usb_serial_matches(const char *serial, const char *device_udid)
+{
+	while (*serial || *device_udid) {
+		if (*device_udid == '-') {
+			device_udid++;
+			continue;
+		}
+		if (tolower((unsigned char)*serial) != tolower((unsigned char)*device_udid)) {
+			return 0;
+		}
+		serial++;
+		device_udid++;
+	}
+	return 1;
+}
+
+int usb_topology_lookup(const char *sysfs_root, const char *device_udid, char **controller, char **hub)
+{
+	char *devdir = NULL;
+	char *port = NULL;
+	char name[32];
+	DIR *dir = NULL;
+	struct dirent *ep;
+
+	*controller = NULL;
+	*hub = NULL;
+	devdir = path_join((sysfs_root && *sysfs_root) ? sysfs_root : "/sys", "bus/usb/devices");
+	if (!devdir) {
+		return -1;
+	}
+	dir = opendir(devdir);
+	if (!dir) {
+		free(devdir);
+		return -1;
+	}
+	while ((ep = readdir(dir))) {
+		/* skip interfaces (1-2:1.0) and root hubs (usb1) */
+		if (ep->d_name[0] < '0' || ep->d_name[0] > '9' || strchr(ep->d_name, ':')) {
+			continue;
+		}
+		char *path = path_join(devdir, ep->d_name);
+		if (!path) {
+			continue;
+		}
+		char *serial = read_sysfs_string(path, "serial");
+		free(path);
+		if (serial && usb_serial_matches(serial, device_udid)) {
+			port = strdup(ep->d_name);
+		}
+		free(serial);
+		if (port) {
+			break;
+		}
+	}
+	closedir(dir);
+	if (!port) {
+		free(devdir);
+		return -1;
+	}
+
+	/* port paths look like <bus>-<port>[.<port>...], the hub is the parent */
+	int bus = atoi(port);
+	char *sep = strrchr(port, '.');
+	if (sep) {
+		*sep = '\0';
+		*hub = port;
+	} else {
+		free(port);
+		snprintf(name, sizeof(name), "usb%d", bus);
+		*hub = strdup(name);
+	}
+
+	/* the root hubs (e.g. USB 2 and USB 3) of one controller share its parent device */
+	char *real = NULL;
+#ifndef WIN32
+	snprintf(name, sizeof(name), "usb%d", bus);
+	char *roothub = path_join(devdir, name);
+	if (roothub) {
+		real = realpath(roothub, NULL);
+		free(roothub);
+	}
+#endif
+	if (real) {
+		char *slash = strrchr(real, '/');
+		if (slash && slash != real) {
+			*slash = '\0';
+			*controller = strdup(basename(real));
+		}
+		free(real);
+	}
+	if (!*controller) {
+		snprintf(name, sizeof(name), "usb%d", bus);
+		*controller = strdup(name);
+	}
+	free(devdir);
+
+	if (!*controller || !*hub) {
+		free(*controller);
+		free(*hub);
+		*controller = NULL;
+		*hub = NULL;
+		return -1;
+	}
+	return 0;
+}
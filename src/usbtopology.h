@@ -0,0 +1,36 @@
+/*
+ * usbtopology.h
+ * USB topology of a device from sysfs
+ *
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more profile.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifndef __USBTOPOLOGY_H
+#define __USBTOPOLOGY_H
+
+/*
+ * Determines the host controller and hub the device with the given UDID is
+ * attached to, by its serial number in <sysfs_root>/bus/usb/devices
+ * (sysfs_root defaults to /sys if NULL or empty). controller is the name of
+ * the controller's device (e.g. 0000:00:14.0), hub the port path of the hub
+ * (e.g. 1-3) or the root hub (e.g. usb2). Both are allocated and must be
+ * freed by the caller. Returns 0 on success or -1 if not found.
+ */
+int usb_topology_lookup(const char *sysfs_root, const char *device_udid, char **controller, char **hub);
+
+#endif
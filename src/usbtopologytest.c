@@ -0,0 +1,151 @@
+/*
+ * usbtopologytest.c
+ * Checks the USB topology lookup against a fake sysfs tree
+ *
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more profile.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#include "usbtopology.h"
+
+#ifndef WIN32
+/*
+ * A machine with an xHCI controller (USB 2 root hub usb1 and USB 3 root hub
+ * usb2) and a second controller with usb3. Like in the real sysfs, the
+ * entries in bus/usb/devices are links into the devices hierarchy.
+ */
+static const char *dirs[] = {
+	"bus/usb/devices",
+	"devices/pci0000:00/0000:00:14.0/usb1/1-3/1-3.4/1-3.4:1.0",
+	"devices/pci0000:00/0000:00:14.0/usb2/2-1",
+	"devices/pci0000:00/0000:00:1c.0/0000:03:00.0/usb3/3-1",
+	NULL
+};
+
+static const char *links[][2] = {
+	{ "usb1", "../../../devices/pci0000:00/0000:00:14.0/usb1" },
+	{ "usb2", "../../../devices/pci0000:00/0000:00:14.0/usb2" },
+	{ "usb3", "../../../devices/pci0000:00/0000:00:1c.0/0000:03:00.0/usb3" },
+	{ "1-3", "../../../devices/pci0000:00/0000:00:14.0/usb1/1-3" },
+	{ "1-3.4", "../../../devices/pci0000:00/0000:00:14.0/usb1/1-3/1-3.4" },
+	{ "1-3.4:1.0", "../../../devices/pci0000:00/0000:00:14.0/usb1/1-3/1-3.4/1-3.4:1.0" },
+	{ "2-1", "../../../devices/pci0000:00/0000:00:14.0/usb2/2-1" },
+	{ "3-1", "../../../devices/pci0000:00/0000:00:1c.0/0000:03:00.0/usb3/3-1" },
+	{ NULL, NULL }
+};
+
+static const char *serials[][2] = {
+	{ "devices/pci0000:00/0000:00:14.0/usb1/1-3/serial", "HUB0001" },
+	{ "devices/pci0000:00/0000:00:14.0/usb1/1-3/1-3.4/serial", "00008030001A2D0E3C0A802E" },
+	/* interfaces have no serial, this one must be ignored anyway */
+	{ "devices/pci0000:00/0000:00:14.0/usb1/1-3/1-3.4/1-3.4:1.0/serial", "00008101000E1D2C3B4A5968" },
+	{ "devices/pci0000:00/0000:00:14.0/usb2/2-1/serial", "00008101000E1D2C3B4A5968" },
+	{ "devices/pci0000:00/0000:00:1c.0/0000:03:00.0/usb3/3-1/serial", "a1b2c3d4e5f60718293a4b5c6d7e8f9012345678" },
+	{ NULL, NULL }
+};
+
+static const struct {
+	const char *udid;
+	const char *controller;
+	const char *hub;
+} cases[] = {
+	{ "00008030-001A2D0E3C0A802E", "0000:00:14.0", "1-3" },
+	{ "00008101-000E1D2C3B4A5968", "0000:00:14.0", "usb2" },
+	{ "A1B2C3D4E5F60718293A4B5C6D7E8F9012345678", "0000:03:00.0", "usb3" },
+	{ "00008030-FFFFFFFFFFFFFFFF", NULL, NULL },
+	{ NULL, NULL, NULL }
+};
+
+static int make_tree(const char *root)
+{
+	char path[1024];
+	char cmd[1200];
+	int i;
+
+	for (i = 0; dirs[i]; i++) {
+		snprintf(cmd, sizeof(cmd), "mkdir -p '%s/%s'", root, dirs[i]);
+		if (system(cmd) != 0) {
+			return -1;
+		}
+	}
+	for (i = 0; links[i][0]; i++) {
+		snprintf(path, sizeof(path), "%s/bus/usb/devices/%s", root, links[i][0]);
+		if (symlink(links[i][1], path) != 0) {
+			return -1;
+		}
+	}
+	for (i = 0; serials[i][0]; i++) {
+		snprintf(path, sizeof(path), "%s/%s", root, serials[i][0]);
+		FILE *f = fopen(path, "w");
+		if (!f) {
+			return -1;
+		}
+		fprintf(f, "%s\n", serials[i][1]);
+		fclose(f);
+	}
+	return 0;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+#ifdef WIN32
+	/* no sysfs, skip */
+	return 77;
+#else
+	char root[] = "/tmp/usbtopologytest.XXXXXX";
+	char cmd[64];
+	int i, failed = 0;
+
+	if (!mkdtemp(root)) {
+		fprintf(stderr, "ERROR: Could not create a temporary directory\n");
+		return 1;
+	}
+	if (make_tree(root) < 0) {
+		fprintf(stderr, "ERROR: Could not create the fake sysfs tree in %s\n", root);
+		failed++;
+	}
+	for (i = 0; !failed && cases[i].udid; i++) {
+		char *controller = NULL;
+		char *hub = NULL;
+		int res = usb_topology_lookup(root, cases[i].udid, &controller, &hub);
+		int ok = (cases[i].controller) ? (res == 0 && !strcmp(controller, cases[i].controller) && !strcmp(hub, cases[i].hub)) : (res < 0);
+		printf("%-42s %-14s %-6s %s\n", cases[i].udid, (controller) ? controller : "-", (hub) ? hub : "-", (ok) ? "OK" : "FAILED");
+		if (!ok) {
+			failed++;
+		}
+		free(controller);
+		free(hub);
+	}
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", root);
+	if (system(cmd) != 0) {
+		fprintf(stderr, "WARNING: Could not remove %s\n", root);
+	}
+	return (failed > 0) ? 1 : 0;
+#endif
+}